@@ -0,0 +1,67 @@
+#ifndef PB_CROSEC_H
+#define PB_CROSEC_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * The EC host commands pbkbd-backlight sends itself through /dev/cros_ec,
+ * from the kernel's cros_ec_chardev.h and the EC's ec_commands.h. Payloads
+ * are packed and little endian.
+ */
+
+#define CROS_EC_DEV "/dev/cros_ec"
+
+struct cros_ec_command {
+	uint32_t version;
+	uint32_t command;
+	uint32_t outsize; /* request payload */
+	uint32_t insize; /* room for the response payload */
+	uint32_t result; /* EC_RES_*, 0 on success */
+	uint8_t data[];
+};
+
+#define CROS_EC_DEV_IOCXCMD _IOWR(0xec, 0, struct cros_ec_command)
+
+#define EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT 0x0023
+#define EC_CMD_MOTION_SENSE_CMD 0x002b
+
+#define EC_RES_SUCCESS 0
+
+enum {
+	MOTIONSENSE_CMD_DUMP = 0,
+	MOTIONSENSE_CMD_INFO = 1,
+	MOTIONSENSE_CMD_DATA = 6,
+};
+
+#define MOTIONSENSE_TYPE_LIGHT 4
+
+/* DUMP takes max_sensor_count instead of sensor_num */
+struct ec_params_motion_sense {
+	uint8_t cmd;
+	uint8_t sensor_num;
+} __attribute__((packed));
+
+struct ec_response_motion_sense_dump {
+	uint8_t module_flags;
+	uint8_t sensor_count; /* since version 1 */
+} __attribute__((packed));
+
+struct ec_response_motion_sense_info {
+	uint8_t type;
+	uint8_t location;
+	uint8_t chip;
+} __attribute__((packed));
+
+/* lux in data[0] for light sensors */
+struct ec_response_motion_sensor_data {
+	uint8_t flags;
+	uint8_t sensor_num;
+	uint16_t data[3];
+} __attribute__((packed));
+
+struct ec_params_pwm_set_keyboard_backlight {
+	uint8_t percent;
+} __attribute__((packed));
+
+#endif
@@ -1,84 +1,139 @@
 #define keymap_key_max 0xff
-#define keymap_fn_key_scan 0xdb
-const int keymap_direct[] = {
-	[0x01] = KEY_ESC,
-	[0x02] = KEY_1,
-	[0x03] = KEY_2,
-	[0x04] = KEY_3,
-	[0x05] = KEY_4,
-	[0x06] = KEY_5,
-	[0x07] = KEY_6,
-	[0x08] = KEY_7,
-	[0x09] = KEY_8,
-	[0x0a] = KEY_9,
-	[0x0b] = KEY_0,
-	[0x0c] = KEY_MINUS,
-	[0x0d] = KEY_EQUAL,
-	[0x0e] = KEY_BACKSPACE,
-	[0x0f] = KEY_TAB,
-	[0x10] = KEY_Q,
-	[0x11] = KEY_W,
-	[0x12] = KEY_E,
-	[0x13] = KEY_R,
-	[0x14] = KEY_T,
-	[0x15] = KEY_Y,
-	[0x16] = KEY_U,
-	[0x17] = KEY_I,
-	[0x18] = KEY_O,
-	[0x19] = KEY_P,
-	[0x1a] = KEY_LEFTBRACE,
-	[0x1b] = KEY_RIGHTBRACE,
-	[0x1c] = KEY_ENTER,
-	[0x1d] = KEY_LEFTCTRL,
-	[0x1e] = KEY_A,
-	[0x1f] = KEY_S,
-	[0x20] = KEY_D,
-	[0x21] = KEY_F,
-	[0x22] = KEY_G,
-	[0x23] = KEY_H,
-	[0x24] = KEY_J,
-	[0x25] = KEY_K,
-	[0x26] = KEY_L,
-	[0x27] = KEY_SEMICOLON,
-	[0x28] = KEY_APOSTROPHE,
-	[0x29] = KEY_GRAVE,
-	[0x2a] = KEY_LEFTSHIFT,
-	[0x2b] = KEY_BACKSLASH,
-	[0x2c] = KEY_Z,
-	[0x2d] = KEY_X,
-	[0x2e] = KEY_C,
-	[0x2f] = KEY_V,
-	[0x30] = KEY_B,
-	[0x31] = KEY_N,
-	[0x32] = KEY_M,
-	[0x33] = KEY_COMMA,
-	[0x34] = KEY_DOT,
-	[0x35] = KEY_SLASH,
-	[0x36] = KEY_RIGHTSHIFT,
-	[0x38] = KEY_LEFTALT,
-	[0x39] = KEY_SPACE,
-	[0x3b] = KEY_BACK, /* back keys */
-	[0x3c] = KEY_REFRESH, /* refresh key */
-	[0x3d] = KEY_F11, /* fullscreen key */
-	[0x3e] = KEY_LEFTMETA, /* overview key */
-	[0x3f] = KEY_BRIGHTNESSDOWN,
-	[0x40] = KEY_BRIGHTNESSUP,
-	[0x41] = KEY_PLAY,
-	[0x42] = KEY_MUTE,
-	[0x43] = KEY_VOLUMEDOWN,
-	[0x44] = KEY_VOLUMEUP,
-	[0x5d] = KEY_COMPOSE, /* Hamburger key */
-	[0x9d] = KEY_RIGHTCTRL,
-	[0xae] = KEY_VOLUMEDOWN,
-	[0xb0] = KEY_VOLUMEUP,
-	[0xb8] = KEY_RIGHTALT,
-	[0xc8] = KEY_UP,
-	[0xcb] = KEY_LEFT,
-	[0xcd] = KEY_RIGHT,
-	[0xd0] = KEY_DOWN,
-	[0xd8] = KEY_LEFTMETA, /* Assisstant key */
+#define keymap_fn_key_scan 0xdb /* Search, the same on every Chromebook keyboard */
+
+/*
+ * Keymap profiles, picked by DMI at startup. They differ in the top row
+ * and the extra keys; the rest of the keyboard, the function layer and the
+ * combos are shared. The chosen profile is copied into keymap_direct, so the
+ * translation indexes the same fixed tables whatever the model.
+ */
+#define KEYMAP_DIRECT_COMMON \
+	[0x01] = KEY_ESC, \
+	[0x02] = KEY_1, \
+	[0x03] = KEY_2, \
+	[0x04] = KEY_3, \
+	[0x05] = KEY_4, \
+	[0x06] = KEY_5, \
+	[0x07] = KEY_6, \
+	[0x08] = KEY_7, \
+	[0x09] = KEY_8, \
+	[0x0a] = KEY_9, \
+	[0x0b] = KEY_0, \
+	[0x0c] = KEY_MINUS, \
+	[0x0d] = KEY_EQUAL, \
+	[0x0e] = KEY_BACKSPACE, \
+	[0x0f] = KEY_TAB, \
+	[0x10] = KEY_Q, \
+	[0x11] = KEY_W, \
+	[0x12] = KEY_E, \
+	[0x13] = KEY_R, \
+	[0x14] = KEY_T, \
+	[0x15] = KEY_Y, \
+	[0x16] = KEY_U, \
+	[0x17] = KEY_I, \
+	[0x18] = KEY_O, \
+	[0x19] = KEY_P, \
+	[0x1a] = KEY_LEFTBRACE, \
+	[0x1b] = KEY_RIGHTBRACE, \
+	[0x1c] = KEY_ENTER, \
+	[0x1d] = KEY_LEFTCTRL, \
+	[0x1e] = KEY_A, \
+	[0x1f] = KEY_S, \
+	[0x20] = KEY_D, \
+	[0x21] = KEY_F, \
+	[0x22] = KEY_G, \
+	[0x23] = KEY_H, \
+	[0x24] = KEY_J, \
+	[0x25] = KEY_K, \
+	[0x26] = KEY_L, \
+	[0x27] = KEY_SEMICOLON, \
+	[0x28] = KEY_APOSTROPHE, \
+	[0x29] = KEY_GRAVE, \
+	[0x2a] = KEY_LEFTSHIFT, \
+	[0x2b] = KEY_BACKSLASH, \
+	[0x2c] = KEY_Z, \
+	[0x2d] = KEY_X, \
+	[0x2e] = KEY_C, \
+	[0x2f] = KEY_V, \
+	[0x30] = KEY_B, \
+	[0x31] = KEY_N, \
+	[0x32] = KEY_M, \
+	[0x33] = KEY_COMMA, \
+	[0x34] = KEY_DOT, \
+	[0x35] = KEY_SLASH, \
+	[0x36] = KEY_RIGHTSHIFT, \
+	[0x38] = KEY_LEFTALT, \
+	[0x39] = KEY_SPACE, \
+	[0x9d] = KEY_RIGHTCTRL, \
+	[0xae] = KEY_VOLUMEDOWN, \
+	[0xb0] = KEY_VOLUMEUP, \
+	[0xb8] = KEY_RIGHTALT, \
+	[0xc8] = KEY_UP, \
+	[0xcb] = KEY_LEFT, \
+	[0xcd] = KEY_RIGHT, \
+	[0xd0] = KEY_DOWN, \
 	[0xdb] = KEY_LEFTMETA /* Search key */
+
+/* Pixelbook */
+#define KEYMAP_EVE_DIRECT \
+	KEYMAP_DIRECT_COMMON, \
+	[0x3b] = KEY_BACK, /* back keys */ \
+	[0x3c] = KEY_REFRESH, /* refresh key */ \
+	[0x3d] = KEY_F11, /* fullscreen key */ \
+	[0x3e] = KEY_LEFTMETA, /* overview key */ \
+	[0x3f] = KEY_BRIGHTNESSDOWN, \
+	[0x40] = KEY_BRIGHTNESSUP, \
+	[0x41] = KEY_PLAY, \
+	[0x42] = KEY_MUTE, \
+	[0x43] = KEY_VOLUMEDOWN, \
+	[0x44] = KEY_VOLUMEUP, \
+	[0x5d] = KEY_COMPOSE, /* Hamburger key */ \
+	[0xd8] = KEY_LEFTMETA /* Assisstant key */
+
+/* Chromebooks with the original top row, a forward key and no media keys */
+#define KEYMAP_CHROMEBOOK_DIRECT \
+	KEYMAP_DIRECT_COMMON, \
+	[0x3b] = KEY_BACK, \
+	[0x3c] = KEY_FORWARD, \
+	[0x3d] = KEY_REFRESH, \
+	[0x3e] = KEY_F11, /* fullscreen key */ \
+	[0x3f] = KEY_LEFTMETA, /* overview key */ \
+	[0x40] = KEY_BRIGHTNESSDOWN, \
+	[0x41] = KEY_BRIGHTNESSUP, \
+	[0x42] = KEY_MUTE, \
+	[0x43] = KEY_VOLUMEDOWN, \
+	[0x44] = KEY_VOLUMEUP
+
+static const int keymap_eve_direct[keymap_key_max + 1] = { KEYMAP_EVE_DIRECT };
+static const int keymap_chromebook_direct[keymap_key_max + 1] = { KEYMAP_CHROMEBOOK_DIRECT };
+
+static const char *const keymap_eve_products[] = { "Eve", NULL };
+/* the x86 boards with an i8042 keyboard before Eve, 61-keyboard.hwdb lists the same */
+static const char *const keymap_chromebook_products[] = {
+	"Link", "Samus", "Peppy", "Falco", "Leon", "Wolf", "Squawks", "Clapper",
+	"Enguarde", "Glimmer", "Gnawty", "Kip", "Swanky", "Winky", "Quawks",
+	"Paine", "Yuna", "Lulu", "Gandof", "Cyan", "Celes", "Reks", "Terra",
+	"Ultima", "Edgar", "Banon", "Kefka", "Relm", "Setzer", "Wizpig", "Chell",
+	"Lars", "Cave", "Caroline", "Asuka", "Sentry", NULL
 };
+
+struct keymap_profile {
+	const char *name;
+	const char *vendor; /* /sys/class/dmi/id/sys_vendor, any case */
+	const char *const *products; /* product_name, any case */
+	const int *direct;
+};
+
+/* the first match is used, the Pixelbook's if none matches */
+static const struct keymap_profile keymap_profiles[] = {
+	{ "eve", "Google", keymap_eve_products, keymap_eve_direct },
+	{ "chromebook", "Google", keymap_chromebook_products, keymap_chromebook_direct },
+};
+#define keymap_profiles_size (sizeof(keymap_profiles) / sizeof(*keymap_profiles))
+
+/* the profile in use */
+static int keymap_direct[keymap_key_max + 1] = { KEYMAP_EVE_DIRECT };
+
 const int keymap_fn[] = {
 	[0x02] = KEY_F1, /* 1 */
 	[0x03] = KEY_F2, /* 2 */
@@ -0,0 +1,469 @@
+/*
+ * Mock DP AUX harness for pbbacklight.
+ *
+ * The DPCD is a regular file, so the daemon's AUX reads and writes work
+ * unmodified against it. The harness plays the panel firmware: it reverts
+ * the registers the way a panel power cycle does and measures how long the
+ * panel shows the wrong brightness, at startup and after a reset. Failures
+ * are injected into the AUX transfers to check that the daemon rides out
+ * flaky transfers, panel power transitions and the device going away, and
+ * gives up when the failures persist. A fake power_supply tree checks the
+ * battery ceiling.
+ */
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static ssize_t aux_pread(int fd, void *buf, size_t n, off_t off);
+static ssize_t aux_pwrite(int fd, const void *buf, size_t n, off_t off);
+
+#define pread(f, b, n, o) aux_pread(f, b, n, o)
+#define pwrite(f, b, n, o) aux_pwrite(f, b, n, o)
+#define main pbbacklight_main
+#include "pbbacklight.cpp"
+#undef main
+#undef pwrite
+#undef pread
+
+using sim_clock = std::chrono::steady_clock;
+
+static unsigned long aux_transactions;
+static sim_clock::time_point last_brightness_write;
+static unsigned long last_brightness_transactions; /* up to and including the write */
+static int last_brightness = -1;
+
+/* transfers failing with err until the deadline, percent of them */
+static struct {
+	int err = 0;
+	int percent = 100;
+	off_t reg = -1; /* only transfers starting there, -1 for all */
+	sim_clock::time_point until;
+	unsigned long injected = 0;
+	unsigned rng = 1;
+} fault;
+
+static bool inject(off_t off)
+{
+	if (!fault.err || sim_clock::now() >= fault.until || (fault.reg >= 0 && off != fault.reg))
+		return false;
+	fault.rng = fault.rng * 1103515245 + 12345;
+	if ((fault.rng >> 16) % 100 >= static_cast<unsigned>(fault.percent))
+		return false;
+	fault.injected++;
+	errno = fault.err;
+	return true;
+}
+
+/* DPCD registers live at 0x700 and up, sysfs attributes are read at 0 */
+static ssize_t aux_pread(int fd, void *buf, size_t n, off_t off)
+{
+	if (off >= 0x700) {
+		aux_transactions++;
+		if (inject(off))
+			return -1;
+	}
+	return pread(fd, buf, n, off);
+}
+
+static ssize_t aux_pwrite(int fd, const void *buf, size_t n, off_t off)
+{
+	if (off >= 0x700 && inject(off)) {
+		aux_transactions++;
+		return -1;
+	}
+	ssize_t r = pwrite(fd, buf, n, off);
+	if (off >= 0x700)
+		aux_transactions++;
+	if (off == 0x722 && r > 0) {
+		auto b = static_cast<const uint8_t *>(buf);
+		last_brightness = n == 2 ? (b[0] << 8) | b[1] : b[0];
+		last_brightness_write = sim_clock::now();
+		last_brightness_transactions = aux_transactions;
+	}
+	return r;
+}
+
+static string root;
+static string dpcd;
+
+static void writefile(const string &path, const string &content)
+{
+	std::ofstream f(path);
+	if (!(f << content))
+		throw std::runtime_error("cannot write " + path);
+}
+
+/* power-on defaults: AUX control off, bit count unset, full brightness */
+static void reset_panel()
+{
+	int fd = open(dpcd.c_str(), O_RDWR);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category());
+	uint8_t r[4] = { 0x00, 0xff, 0xff, 0x00 };
+	if (pwrite(fd, r, 4, 0x721) != 4)
+		throw std::system_error(errno, std::generic_category());
+	close(fd);
+}
+
+/* whether the panel is in AUX mode at level, read behind the daemon's back */
+static bool panel_shows(int level)
+{
+	int fd = open(dpcd.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category());
+	uint8_t r[3];
+	ssize_t n = pread(fd, r, 3, 0x721);
+	close(fd);
+	return n == 3 && (r[0] & 0x7) == 0x2 && ((r[1] << 8) | r[2]) == level;
+}
+
+static void make_panel(int bits)
+{
+	make_mock_dpcd(dpcd, bits);
+	reset_panel();
+}
+
+static double us_since(sim_clock::time_point t0, sim_clock::time_point t1)
+{
+	return std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+static sim_clock::time_point next_tick;
+
+/*
+ * pixelbookd's scheduling of the daemon: tick when due, dispatch events as
+ * they come. Returns once the panel shows level, or after ms.
+ */
+static bool run_until(BLProxy &p, int level, int ms)
+{
+	auto end = sim_clock::now() + std::chrono::milliseconds(ms);
+	for (;;) {
+		if (level >= 0 && last_brightness == level)
+			return true;
+		auto now = sim_clock::now();
+		if (now >= end)
+			return false;
+		if (now >= next_tick)
+			next_tick = now + std::chrono::milliseconds(p.tick());
+		auto wake = next_tick < end ? next_tick : end;
+		struct pollfd pfd = {
+			.fd = p.ep,
+			.events = POLLIN,
+			.revents = 0
+		};
+		if (poll(&pfd, 1, std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() + 1) > 0) {
+			p.dispatch();
+			/* both loops tick right after dispatching */
+			next_tick = sim_clock::now();
+		}
+	}
+}
+
+static void boot(bool with_state, double ratio, const string &sysbl)
+{
+	int value = PBBLManager::absbri(ratio) + 0.5;
+	if (with_state)
+		writefile(state_path, std::to_string(value) + "\n");
+	else
+		unlink(state_path.c_str());
+	reset_panel();
+	last_brightness = -1;
+	aux_transactions = 0;
+
+	auto t0 = sim_clock::now();
+	BLProxy p;
+	bool early = last_brightness >= 0;
+	p.add(sysbl);
+	p.listen_control((root + "/sock").c_str());
+	p.start();
+	next_tick = sim_clock::now();
+	int level = p.pbbl.pbbl.quantize(value);
+	run_until(p, level, 2000);
+	printf("boot %-14s %9.1f us to correct brightness, %lu AUX transactions, %s sysfs setup\n",
+			with_state ? "with state:" : "without state:",
+			last_brightness == level ? us_since(t0, last_brightness_write) : -1.0,
+			last_brightness_transactions, early ? "before" : "after");
+}
+
+/* a panel still powering up at boot, its capabilities NAK for ms */
+static void boot_powerup(double ratio, const string &sysbl, int ms)
+{
+	int value = PBBLManager::absbri(ratio) + 0.5;
+	writefile(state_path, std::to_string(value) + "\n");
+	reset_panel();
+	last_brightness = -1;
+	fault.err = ETIMEDOUT;
+	fault.percent = 100;
+	fault.reg = 0x702;
+	fault.injected = 0;
+	auto t0 = sim_clock::now();
+	fault.until = t0 + std::chrono::milliseconds(ms);
+	try {
+		BLProxy p;
+		p.add(sysbl);
+		p.start();
+		next_tick = sim_clock::now();
+		/* the PWM resolution is only known once the panel answers */
+		while (!p.pbbl.pbbl.probed && sim_clock::now() < fault.until + std::chrono::seconds(5))
+			run_until(p, -1, 10);
+		int level = p.pbbl.pbbl.quantize(value);
+		run_until(p, level, 1000);
+		if (last_brightness == level && panel_shows(level))
+			printf("boot powering up: %5lu failed, correct %.1f ms after\n", fault.injected,
+					us_since(fault.until, last_brightness_write) / 1e3);
+		else
+			printf("boot powering up: %5lu failed, panel wrong\n", fault.injected);
+	} catch (AuxError &e) {
+		printf("boot powering up: %5lu failed, exited after %.1f s\n", fault.injected,
+				us_since(t0, sim_clock::now()) / 1e6);
+	}
+	fault.err = 0;
+	fault.reg = -1;
+}
+
+/* us until the ramp's first panel write, -1 if none within a second */
+static double first_write(BLProxy &p, sim_clock::time_point t0)
+{
+	last_brightness = -1;
+	while (last_brightness < 0 && us_since(t0, sim_clock::now()) < 1e6)
+		run_until(p, -1, 1);
+	return last_brightness < 0 ? -1 : us_since(t0, last_brightness_write);
+}
+
+/*
+ * A brightness key through the control socket, as pbkbd -b sends it, and
+ * the same step written to sysfs the way the desktop does. Only the part
+ * inside pbbacklight is measured, the desktop's own hops come on top.
+ */
+static void keys(BLProxy &p, const string &sysbl)
+{
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, (root + "/sock").c_str(), sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)))
+		throw std::system_error(errno, std::generic_category());
+	run_until(p, -1, 100);
+	int tgt = p.pbbl.tgt_bri + 0.5;
+
+	pbbl_msg m = {};
+	m.op = PBBL_STEP;
+	m.value = 1;
+	auto t0 = sim_clock::now();
+	if (send(fd, &m, sizeof(m), MSG_NOSIGNAL) != sizeof(m))
+		throw std::system_error(errno, std::generic_category());
+	double key = first_write(p, t0);
+	run_until(p, -1, 2000);
+	close(fd);
+	int stepped = p.pbbl.tgt_bri + 0.5;
+	std::ifstream f(sysbl + "/brightness");
+	int sys = -1;
+	f >> sys;
+	printf("brightness key: %9.1f us to the first panel write, target %d to %d, sysfs %d/1000%s\n",
+			key, tgt, stepped, sys, stepped != tgt && p.pbbl.tgt_bri == stepped ? "" : ", wrong");
+
+	t0 = sim_clock::now();
+	writefile(sysbl + "/brightness", std::to_string(sys - 50) + "\n");
+	printf("sysfs write:    %9.1f us to the first panel write\n", first_write(p, t0));
+	run_until(p, -1, 2000);
+}
+
+static void resume(BLProxy &p, bool uevent, int cycles)
+{
+	double total = 0, worst = 0;
+	int level = p.pbbl.pbbl.quantize(p.pbbl.cur_bri + 0.5);
+	for (int i = 0; i < cycles; i++) {
+		/* spread resets over the idle check period */
+		run_until(p, -1, 100 + 1000 * i / cycles);
+		reset_panel();
+		last_brightness = -1;
+		auto t0 = sim_clock::now();
+		if (uevent)
+			p.pbbl.restore();
+		if (!run_until(p, level, 3000))
+			throw std::runtime_error("brightness not restored");
+		double us = us_since(t0, last_brightness_write);
+		total += us;
+		if (us > worst)
+			worst = us;
+	}
+	printf("reset %-13s %9.1f us mean, %9.1f us worst to restore\n",
+			uevent ? "with uevent:" : "idle check:", total / cycles, worst);
+}
+
+/* brightness changes every 20 ms while failures are injected for ms */
+static void faults(BLProxy &p, const char *name, int err, int percent, int ms, bool reset)
+{
+	auto &m = p.pbbl;
+	m.failures.clear();
+	unsigned long retried = m.pbbl.bl.retried, reopens = m.pbbl.bl.reopens, errors = m.errors;
+	fault.err = err;
+	fault.percent = percent;
+	fault.injected = 0;
+	unsigned long transactions = aux_transactions;
+	auto t0 = sim_clock::now();
+	fault.until = ms < 0 ? sim_clock::time_point::max() : t0 + std::chrono::milliseconds(ms);
+	if (reset) {
+		reset_panel();
+		m.restore();
+	}
+	int value = m.cur_bri + 0.5;
+	int level = -1;
+	double gaveup = -1;
+	try {
+		for (int i = 0; sim_clock::now() < fault.until; i++) {
+			value = 20000 + i % 50 * 500;
+			m.setabs(value, false);
+			run_until(p, -1, 20);
+		}
+		level = m.pbbl.quantize(value);
+		last_brightness = -1;
+		if (!panel_shows(level))
+			run_until(p, level, 5000);
+		else
+			last_brightness_write = fault.until;
+	} catch (AuxError &e) {
+		gaveup = us_since(t0, sim_clock::now()) / 1e6;
+	}
+	fault.err = 0;
+	printf("fault %-12s %6lu transfers, %5lu failed, %4lu retried, %2lu reopens, %2lu given up, ",
+			name, aux_transactions - transactions, fault.injected, m.pbbl.bl.retried - retried, m.pbbl.bl.reopens - reopens,
+			m.errors - errors);
+	if (gaveup >= 0)
+		printf("exited after %.1f s\n", gaveup);
+	else if (panel_shows(level))
+		printf("correct %.1f ms after\n", std::max(0.0, us_since(fault.until, last_brightness_write) / 1e3));
+	else
+		printf("panel wrong\n");
+}
+
+static void supply(bool online, int capacity)
+{
+	writefile(root + "/power/AC/online", online ? "1\n" : "0\n");
+	writefile(root + "/power/BAT0/status", online ? "Charging\n" : "Discharging\n");
+	writefile(root + "/power/BAT0/capacity", std::to_string(capacity) + "\n");
+}
+
+/* ms and frames until the ramp settles on a supply change, as the uevent would start it */
+static void supply_change(BLProxy &p, const char *name, bool online, int capacity, int expect)
+{
+	supply(online, capacity);
+	unsigned long frames = p.pbbl.frames;
+	auto t0 = sim_clock::now();
+	p.supplies();
+	next_tick = t0;
+	int level = p.pbbl.pbbl.quantize(expect);
+	last_brightness = -1;
+	run_until(p, -1, 1500);
+	if (!panel_shows(level))
+		printf("battery %-10s panel wrong\n", name);
+	else if (p.pbbl.frames == frames)
+		printf("battery %-10s stays at level %d\n", name, level);
+	else
+		printf("battery %-10s %7.1f ms over %3lu frames to level %d\n", name,
+				us_since(t0, last_brightness_write) / 1e3, p.pbbl.frames - frames, level);
+}
+
+/* at 0.8, a 0.4 ceiling applies below 30% on battery only */
+static void battery(BLProxy &p)
+{
+	mkdir((root + "/power").c_str(), 0755);
+	mkdir((root + "/power/AC").c_str(), 0755);
+	mkdir((root + "/power/BAT0").c_str(), 0755);
+	writefile(root + "/power/AC/type", "Mains\n");
+	writefile(root + "/power/BAT0/type", "Battery\n");
+	supply(true, 50);
+	p.enable_battery(0.4, 30);
+	p.pbbl.setabs(PBBLManager::absbri(0.8), false);
+	int high = PBBLManager::absbri(0.8), low = PBBLManager::absbri(0.4);
+	run_until(p, -1, 100);
+	supply_change(p, "unplugged:", false, 50, high);
+	supply_change(p, "low:", false, 29, low);
+	supply_change(p, "plugged:", true, 29, high);
+}
+
+int main(int argc, char **argv)
+{
+	int bits = 11;
+	int cycles = 5;
+	double ratio = 0.3;
+	int c;
+	while ((c = getopt(argc, argv, "b:n:r:")) > 0)
+		switch (c) {
+		case 'b':
+			bits = atoi(optarg);
+			break;
+		case 'n':
+			cycles = atoi(optarg);
+			break;
+		case 'r':
+			ratio = atof(optarg);
+			break;
+		default:
+			cerr << "usage: " << argv[0] << " [-b pwm bits] [-n reset cycles] [-r brightness ratio]" << endl;
+			return 1;
+		}
+	if (bits < 1 || bits > 16 || cycles < 1 || ratio < 0 || ratio > 1)
+		return 1;
+
+	const char *tmp = getenv("TMPDIR");
+	string tmpl = string(tmp ? tmp : "/tmp") + "/pbbacklight-aux-sim.XXXXXX";
+	if (!mkdtemp(tmpl.data()))
+		throw std::system_error(errno, std::generic_category());
+	root = tmpl;
+	mkdir((root + "/aux").c_str(), 0755);
+	mkdir((root + "/dev").c_str(), 0755);
+	mkdir((root + "/intel_backlight").c_str(), 0755);
+	if (symlink("../../devices/pci0000:00/0000:00:02.0/drm/card0/card0-eDP-1/drm_dp_aux0",
+				(root + "/aux/drm_dp_aux0").c_str()))
+		throw std::system_error(errno, std::generic_category());
+	dpaux_sysfs = root + "/aux/";
+	dpaux_dev = root + "/dev/";
+	state_path = root + "/brightness";
+	dpcd = root + "/dev/drm_dp_aux0";
+	power_dir = root + "/power";
+	string sysbl = root + "/intel_backlight";
+	writefile(sysbl + "/max_brightness", "1000\n");
+	writefile(sysbl + "/brightness", std::to_string(static_cast<int>(ratio * 1000 + 0.5)) + "\n");
+	make_panel(bits);
+
+	int ret = 0;
+	try {
+		printf("%d bit PWM, brightness %.2f\n", bits, ratio);
+		boot(false, ratio, sysbl);
+		boot(true, ratio, sysbl);
+		boot_powerup(ratio, sysbl, 300);
+
+		BLProxy p;
+		p.add(sysbl);
+		p.listen_control((root + "/sock").c_str());
+		p.start();
+		next_tick = sim_clock::now();
+		run_until(p, p.pbbl.pbbl.quantize(p.pbbl.cur_bri + 0.5), 1000);
+		resume(p, false, cycles);
+		resume(p, true, cycles);
+		keys(p, sysbl);
+		battery(p);
+		faults(p, "flaky:", EIO, 30, 2000, false);
+		faults(p, "power off:", ETIMEDOUT, 100, 300, true);
+		faults(p, "unplugged:", ENODEV, 100, 500, false);
+		faults(p, "dead:", EIO, 100, -1, false);
+	} catch (std::exception &e) {
+		cerr << "error: " << e.what() << endl;
+		ret = 1;
+	}
+
+	for (auto f: { "/brightness", "/brightness.tmp", "/sock", "/dev/drm_dp_aux0",
+			"/aux/drm_dp_aux0", "/intel_backlight/brightness",
+			"/intel_backlight/max_brightness", "/power/AC/type", "/power/AC/online",
+			"/power/BAT0/type", "/power/BAT0/status", "/power/BAT0/capacity" })
+		unlink((root + f).c_str());
+	for (auto d: { "/aux", "/dev", "/intel_backlight", "/power/AC", "/power/BAT0", "/power", "" })
+		rmdir((root + d).c_str());
+	return ret;
+}
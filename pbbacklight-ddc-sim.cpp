@@ -0,0 +1,275 @@
+/*
+ * Fake DDC/CI monitors for pbbacklight.
+ *
+ * Runs the daemon against a mock DPCD with external monitors whose i2c
+ * endpoints are emulated: transactions take tens of ms and commands that
+ * come too soon are rejected. Holds the brightness key, then makes single
+ * changes, and reports how long the panel's frames took, how many monitor
+ * writes were needed and how long the monitors lagged behind.
+ */
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <random>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define main pbbacklight_main
+#include "pbbacklight.cpp"
+#undef main
+
+using sim_clock = std::chrono::steady_clock;
+using std::chrono::milliseconds;
+
+/*
+ * Every transaction occupies the bus for latency. Commands within holdoff of
+ * the previous one are NAKed, and a fraction of the rest fail at random.
+ */
+class FakeMonitor : public DDCBus {
+public:
+	string name;
+	milliseconds latency, holdoff;
+	double failrate;
+	constexpr static int maxval = 100;
+	std::atomic<int> value{75};
+	std::atomic<unsigned long> naks{0}, applied{0};
+
+	FakeMonitor(const string &n, int lat, int hold, double fail) : name(n),
+		latency(lat), holdoff(hold), failrate(fail), rng(std::hash<string>()(n)) {}
+
+	bool write(const uint8_t *buf, size_t n) override {
+		auto t = sim_clock::now();
+		std::this_thread::sleep_for(latency);
+		if (t < ready || reject()) {
+			naks++;
+			errno = EREMOTEIO;
+			return false;
+		}
+		ready = sim_clock::now() + holdoff;
+		uint8_t c = 0x6e;
+		for (size_t i = 0; i < n; i++)
+			c ^= buf[i];
+		if (n < 3 || buf[0] != 0x51 || c != 0 || (buf[1] & 0x7f) != n - 3)
+			return true; /* garbage is ignored, not NAKed */
+		if (n == 7 && buf[2] == 0x03 && buf[3] == 0x10) {
+			value = (buf[4] << 8) | buf[5];
+			applied++;
+		} else if (n == 5 && buf[2] == 0x01 && buf[3] == 0x10) {
+			query = true;
+		}
+		return true;
+	}
+	/* the reply is due reply_delay after the request, holdoff does not apply */
+	bool read(uint8_t *buf, size_t n) override {
+		std::this_thread::sleep_for(latency);
+		if (!query || n != 11 || reject()) {
+			naks++;
+			errno = EREMOTEIO;
+			return false;
+		}
+		query = false;
+		int v = value;
+		uint8_t r[11] = { 0x6e, 0x88, 0x02, 0x00, 0x10, 0x00,
+			0, maxval, static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v & 0xff), 0x50 };
+		for (int i = 0; i < 10; i++)
+			r[10] ^= r[i];
+		memcpy(buf, r, sizeof(r));
+		ready = sim_clock::now() + holdoff;
+		return true;
+	}
+
+private:
+	std::mt19937 rng;
+	sim_clock::time_point ready;
+	bool query = false;
+
+	bool reject() {
+		return std::uniform_real_distribution<double>(0, 1)(rng) < failrate;
+	}
+};
+
+static string root;
+static list<FakeMonitor *> fakes;
+
+static void writefile(const string &path, const string &content)
+{
+	std::ofstream f(path);
+	if (!(f << content))
+		throw std::runtime_error("cannot write " + path);
+}
+
+static double us_since(sim_clock::time_point t0, sim_clock::time_point t1)
+{
+	return std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+/* cost of the daemon's frames, the monitors must never show up here */
+static unsigned long ticks;
+static double tick_total, tick_worst;
+static sim_clock::time_point next_tick;
+
+static bool mirrored(BLProxy &p)
+{
+	int tgt = p.pbbl.tgt_bri + 0.5;
+	for (auto f: fakes)
+		if (f->value != std::lround(BLProxy::monitor_ratio(tgt) * FakeMonitor::maxval))
+			return false;
+	return true;
+}
+
+/*
+ * pixelbookd's scheduling of the daemon for ms, or until the monitors show
+ * the target if wait is set. Returns ms until they did, or -1.
+ */
+static double run(BLProxy &p, int ms, bool wait)
+{
+	auto t0 = sim_clock::now();
+	auto end = t0 + milliseconds(ms);
+	for (;;) {
+		auto now = sim_clock::now();
+		if (wait && mirrored(p))
+			return us_since(t0, now) / 1000;
+		if (now >= end)
+			return -1;
+		if (now >= next_tick) {
+			unsigned d = p.tick();
+			auto t1 = sim_clock::now();
+			double us = us_since(now, t1);
+			ticks++;
+			tick_total += us;
+			if (us > tick_worst)
+				tick_worst = us;
+			next_tick = t1 + milliseconds(d);
+		}
+		auto wake = next_tick < end ? next_tick : end;
+		int timeout = std::chrono::duration_cast<milliseconds>(wake - sim_clock::now()).count() + 1;
+		struct pollfd pfd = {
+			.fd = p.ep,
+			.events = POLLIN,
+			.revents = 0
+		};
+		/* the monitors are checked every ms */
+		poll(&pfd, 1, wait && timeout > 1 ? 1 : timeout);
+		p.dispatch();
+	}
+}
+
+static void report(const char *what, double ms)
+{
+	if (ms < 0)
+		printf("%-28s not mirrored\n", what);
+	else
+		printf("%-28s %7.1f ms until the monitors followed\n", what, ms);
+}
+
+int main(int argc, char **argv)
+{
+	int latency = 40;
+	int holdoff = 200;
+	double failrate = 0.1;
+	int presses = 40;
+	int c;
+	while ((c = getopt(argc, argv, "l:h:f:k:")) > 0)
+		switch (c) {
+		case 'l':
+			latency = atoi(optarg);
+			break;
+		case 'h':
+			holdoff = atoi(optarg);
+			break;
+		case 'f':
+			failrate = atof(optarg);
+			break;
+		case 'k':
+			presses = atoi(optarg);
+			break;
+		default:
+			cerr << "usage: " << argv[0] << " [-l transaction ms] [-h holdoff ms] [-f failure rate] [-k key repeats]" << endl;
+			return 1;
+		}
+	if (latency < 0 || holdoff < 0 || failrate < 0 || failrate >= 1 || presses < 1)
+		return 1;
+
+	const char *tmp = getenv("TMPDIR");
+	string tmpl = string(tmp ? tmp : "/tmp") + "/pbbacklight-ddc-sim.XXXXXX";
+	if (!mkdtemp(tmpl.data()))
+		throw std::system_error(errno, std::generic_category());
+	root = tmpl;
+	mkdir((root + "/aux").c_str(), 0755);
+	mkdir((root + "/dev").c_str(), 0755);
+	mkdir((root + "/intel_backlight").c_str(), 0755);
+	if (symlink("../../devices/pci0000:00/0000:00:02.0/drm/card0/card0-eDP-1/drm_dp_aux0",
+				(root + "/aux/drm_dp_aux0").c_str()))
+		throw std::system_error(errno, std::generic_category());
+	dpaux_sysfs = root + "/aux/";
+	dpaux_dev = root + "/dev/";
+	state_path.clear();
+	string sysbl = root + "/intel_backlight";
+	writefile(sysbl + "/max_brightness", "1000\n");
+	writefile(sysbl + "/brightness", "300\n");
+	make_mock_dpcd(root + "/dev/drm_dp_aux0", 11);
+
+	int ret = 0;
+	try {
+		BLProxy p;
+		p.add(sysbl);
+		p.start();
+		/* a well behaved monitor and a slow, picky one */
+		auto fast = std::make_unique<FakeMonitor>("fast", 2, 50, 0);
+		auto slow = std::make_unique<FakeMonitor>("slow", latency, holdoff, failrate);
+		fakes = { fast.get(), slow.get() };
+		p.add_monitor("fast", move(fast));
+		p.add_monitor("slow", move(slow));
+		next_tick = sim_clock::now();
+		report("startup:", run(p, 5000, true));
+
+		/* key repeat at 30 Hz, up then halfway back down */
+		int v = p.pbbl.tgt_bri + 0.5;
+		int step = (PBBLManager::max_bri - v) / presses;
+		for (int i = 0; i < presses + presses / 2; i++) {
+			v += i < presses ? step : -step;
+			p.pbbl.setabs(v, true);
+			run(p, 33, false);
+		}
+		report("after holding the key:", run(p, 5000, true));
+
+		double total = 0, worst = 0;
+		int n = 5;
+		for (int i = 0; i < n; i++) {
+			run(p, 500, false);
+			p.pbbl.setabs(i % 2 ? 20000 : 40000, true);
+			double ms = run(p, 5000, true);
+			if (ms < 0)
+				throw std::runtime_error("monitors did not follow");
+			total += ms;
+			if (ms > worst)
+				worst = ms;
+		}
+		printf("%-28s %7.1f ms mean, %7.1f ms worst\n", "single changes:", total / n, worst);
+		if (!mirrored(p))
+			throw std::runtime_error("monitors did not follow");
+
+		printf("%lu frames, %.1f us mean, %.1f us worst\n", ticks, tick_total / ticks, tick_worst);
+		for (auto &m: p.monitors) {
+			auto &mon = *m.second;
+			auto f = *std::find_if(fakes.begin(), fakes.end(),
+					[&](FakeMonitor *f) { return f->name == m.first; });
+			printf("%-5s %3lu requests, %3lu coalesced, %3lu writes, %3lu failed, %lu dropped, %3lu NAKed\n",
+					m.first.c_str(), mon.requests.load(), mon.coalesced.load(), mon.writes.load(),
+					mon.failures.load(), mon.dropped.load(), f->naks.load());
+		}
+	} catch (std::exception &e) {
+		cerr << "error: " << e.what() << endl;
+		ret = 1;
+	}
+
+	for (auto f: { "/dev/drm_dp_aux0", "/aux/drm_dp_aux0", "/intel_backlight/brightness",
+			"/intel_backlight/max_brightness" })
+		unlink((root + f).c_str());
+	for (auto d: { "/aux", "/dev", "/intel_backlight", "" })
+		rmdir((root + d).c_str());
+	return ret;
+}
@@ -1,23 +1,52 @@
 #define _POSIX_C_SOURCE 200809L
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <dirent.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <limits.h>
+#include <linux/i2c-dev.h>
+#include <linux/netlink.h>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <poll.h>
 #include <regex>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
 #include <unistd.h>
 #include <utility>
+#include <vector>
+
+#include "pbblctl.h"
+#include "pbpower.h"
+#include "pbstate.h"
+#include "perfcount.h"
+#include "sdnotify.h"
+#include "sysfs.h"
 
 using std::cerr;
 using std::cout;
@@ -28,6 +57,13 @@ using std::move;
 using std::string;
 using std::string_view;
 
+static string dpaux_sysfs = "/sys/class/drm_dp_aux_dev/";
+static string dpaux_dev = "/dev/";
+static string state_path = "/var/lib/pbbacklight/brightness";
+static string drm_sysfs = "/sys/class/drm/";
+static string i2c_dev = "/dev/";
+static string power_dir = PBPOWER_DIR;
+
 static bool starts_with(const string &s, const string_view &f)
 {
 	if (s.size() < f.size())
@@ -74,17 +110,41 @@ static list<string> list_dir(const string &path)
 class SysBacklight {
 public:
 	string path;
-	SysBacklight() {
-		return;
-	}
+	int dir;
+	sysattr bri;
+	sysattr wbri;
+	int maxval = -1;
+	int written = -1; /* our own write, until inotify reports it */
 	SysBacklight(const string &p) : path(p) {
-		return;
+		dir = open(p.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir < 0)
+			throw std::system_error(errno, std::generic_category());
+		sysattr_init(&bri, dir, "brightness", O_RDONLY);
+		sysattr_init(&wbri, dir, "brightness", O_WRONLY);
+	}
+	SysBacklight(SysBacklight &&o) : path(move(o.path)), dir(o.dir), bri(o.bri), wbri(o.wbri),
+		maxval(o.maxval), written(o.written) {
+		o.dir = -1;
+		o.bri.fd = -1;
+		o.wbri.fd = -1;
+	}
+	SysBacklight(const SysBacklight &) = delete;
+	~SysBacklight() {
+		sysattr_close(&wbri);
+		sysattr_close(&bri);
+		if (dir >= 0)
+			close(dir);
 	}
 	int max() {
-		return readint("max_brightness");
+		if (maxval < 0)
+			maxval = readint("max_brightness");
+		return maxval;
 	}
 	int value() {
-		return readint("brightness");
+		long long r = sysattr_read(&bri);
+		if (r < 0)
+			throw std::runtime_error("cannot read " + fullpath("brightness"));
+		return r;
 	}
 	int actual() {
 		return readint("actual_brightness");
@@ -92,6 +152,18 @@ public:
 	double ratio() {
 		return static_cast<double>(value()) / max();
 	}
+	/* best effort, the desktop just keeps showing the old level */
+	void write(double r) {
+		int v = std::lround(r * max());
+		if (!sysattr_write(&wbri, v))
+			written = v;
+	}
+	/* whether the last change is our own write coming back */
+	bool echo() {
+		bool r = written >= 0 && value() == written;
+		written = -1;
+		return r;
+	}
 
 	string fullpath(const string &name) {
 		if (ends_with(path, "/"))
@@ -116,65 +188,157 @@ public:
 	}
 };
 
+/* AUX transfers still failing after the retries, the panel may come back */
+class AuxError : public std::system_error {
+public:
+	explicit AuxError(int e) : std::system_error(e, std::generic_category(), "DP AUX") {}
+};
+
 class DPBacklight {
+	string path;
 	int fd;
+	uint8_t adjcap = 0;
+
+	/* NAKs, defers and timeouts while the panel powers up or down */
+	static bool transient(int e) {
+		return e == EIO || e == EAGAIN || e == ETIMEDOUT || e == EBUSY || e == EPROTO || e == EINTR;
+	}
+	/* the AUX device went away with the connector, opened again */
+	static bool lost(int e) {
+		return e == ENODEV || e == ENXIO || e == EBADF || e == ENOENT;
+	}
+	void reopen() {
+		if (fd >= 0)
+			close(fd);
+		fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+		reopens++;
+	}
+	/*
+	 * One AUX transaction, retried a few times right away since the daemon
+	 * shares its thread with the keyboard. Throws AuxError if it still fails
+	 * and std::system_error for errors retrying cannot fix.
+	 */
+	void transfer(bool wr, void *buf, size_t n, unsigned reg) {
+		auto delay = retry_delay;
+		for (int i = 0; ; i++) {
+			ssize_t r = wr ? pwrite(fd, buf, n, reg) : pread(fd, buf, n, reg);
+			if (r == static_cast<ssize_t>(n))
+				return;
+			/* a short transfer is a partial NAK */
+			int e = r < 0 ? errno : EIO;
+			if (!transient(e) && !lost(e))
+				throw std::system_error(e, std::generic_category());
+			if (i == retries)
+				throw AuxError(e);
+			retried++;
+			std::this_thread::sleep_for(delay);
+			delay *= 2;
+			if (lost(e))
+				reopen();
+		}
+	}
 public:
-	DPBacklight(const string &path) {
-		fd = open(path.c_str(), O_RDWR | O_NOCTTY);
+	constexpr static int pwm_freq = 400; /* Hz */
+	constexpr static int retries = 2;
+	constexpr static auto retry_delay = std::chrono::milliseconds(1); /* doubled per retry */
+	int bits = 16; /* PWMGEN_BIT_COUNT in use */
+	unsigned long retried = 0;
+	unsigned long reopens = 0;
+
+	DPBacklight(const string &p) : path(p) {
+		fd = open(path.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
 		if (fd < 0)
 			throw std::system_error(errno, std::generic_category());
 	}
+	DPBacklight(const DPBacklight &) = delete;
 	~DPBacklight() {
-		close(fd);
+		if (fd >= 0)
+			close(fd);
 	}
-	void setup() {
+	uint8_t readreg(unsigned reg) {
 		uint8_t b;
+		transfer(false, &b, 1, reg);
+		return b;
+	}
+	void writereg(unsigned reg, uint8_t b) {
+		transfer(true, &b, 1, reg);
+	}
+	bool wide() {
+		return adjcap & 0x04; /* BRIGHTNESS_BYTE_COUNT */
+	}
+	int maxlevel() {
+		return (1 << bits) - 1;
+	}
+	/* picks the finest PWM resolution the panel offers */
+	void probe() {
+		/* 0x702 EDP_BACKLIGHT_ADJUSTMENT_CAP */
+		adjcap = readreg(0x702);
+		if (!(adjcap & 0x02))
+			throw std::runtime_error("panel does not support brightness over DP AUX");
+		/* 0x725 PWMGEN_BIT_COUNT_CAP_MIN, 0x726 PWMGEN_BIT_COUNT_CAP_MAX */
+		int bmin = readreg(0x725) & 0x1f;
+		int bmax = readreg(0x726) & 0x1f;
+		int limit = wide() ? 16 : 8;
+		bits = bmax > limit ? limit : bmax;
+		if (bits < bmin)
+			bits = bmin;
+		if (bits < 1)
+			bits = limit;
+	}
+	void setup() {
 		/* 0x721 MODE_SET_REGISTER */
-		if (pread(fd, &b, 1, 0x721) != 1)
-			throw std::system_error(errno, std::generic_category());
+		uint8_t b = readreg(0x721);
 		b &= 0xf8;
 		b |= 0x2;
-		if (pwrite(fd, &b, 1, 0x721) != 1)
-			throw std::system_error(errno, std::generic_category());
-		/* 0x724 PWMGEN_BIT_COUNT */
-		b = 0x10; /* magic number that works */
-		if (pwrite(fd, &b, 1, 0x724) != 1)
-			throw std::system_error(errno, std::generic_category());
-		/* 0x728 BACKLIGHT_FREQ_SET */
-		b = 0x01;
-		if (pwrite(fd, &b, 1, 0x728) != 1)
-			throw std::system_error(errno, std::generic_category());
+		writereg(0x721, b);
+		/* 0x724 PWMGEN_BIT_COUNT, panels may adjust the value */
+		writereg(0x724, bits);
+		int actual = readreg(0x724) & 0x1f;
+		if (actual >= 1 && actual <= (wide() ? 16 : 8))
+			bits = actual;
+		/* 0x728 BACKLIGHT_FREQ_SET, f = 27MHz / (F * 2^bits) */
+		if (adjcap & 0x20) {
+			long f = std::lround(27e6 / (static_cast<double>(pwm_freq) * (1 << bits)));
+			writereg(0x728, f < 1 ? 1 : f > 255 ? 255 : f);
+		}
 	}
-	void set(int value) {
-		if (value < 0)
-			value = 0;
-		if (value > 0xffff)
-			value = 0xffff;
+	void set(int level) {
+		if (level < 0)
+			level = 0;
+		if (level > maxlevel())
+			level = maxlevel();
 		uint8_t b[2];
-		b[0] = value >> 8;
-		b[1] = value & 0xff;
-		/* 0x722 BRIGHTNESS_MSB */
-		if (pwrite(fd, b, 2, 0x722) != 2)
-			throw std::system_error(errno, std::generic_category());
+		b[0] = level >> 8;
+		b[1] = level & 0xff;
+		/* 0x722 BRIGHTNESS_MSB, 0x723 BRIGHTNESS_LSB */
+		if (!wide())
+			b[0] = level;
+		transfer(true, b, wide() ? 2 : 1, 0x722);
+	}
+	/* whether the panel still holds what setup() and set(level) wrote */
+	bool configured(int level) {
+		uint8_t r[4];
+		/* 0x721 mode to 0x724 bit count in one transaction */
+		transfer(false, r, 4, 0x721);
+		int cur = wide() ? (r[1] << 8) | r[2] : r[1];
+		return (r[0] & 0x7) == 0x2 && (r[3] & 0x1f) == bits && cur == level;
 	}
 	int get() {
 		uint8_t buf[2];
-		if (pread(fd, buf, 2, 0x722) != 2)
-			throw std::system_error(errno, std::generic_category());
-		return (buf[0] << 8) | buf[1];
+		transfer(false, buf, wide() ? 2 : 1, 0x722);
+		return wide() ? (buf[0] << 8) | buf[1] : buf[0];
 	}
 };
 
+/* the eDP panel, with brightness as 0 to 0xffff whatever the PWM resolution */
 class PBBacklight {
 public:
-	string dpaux;
-	PBBacklight() {
-		const string dpauxpath = "/sys/class/drm_dp_aux_dev/";
+	static string find() {
 		const std::regex re_link("/card[0-9]+-eDP-[0-9]+/");
-		for (auto e: list_dir(dpauxpath)) {
+		for (auto e: list_dir(dpaux_sysfs)) {
 			if (!starts_with(e, "drm_dp_aux"))
 				continue;
-			auto fp = dpauxpath + e;
+			auto fp = dpaux_sysfs + e;
 			string linktgt;
 			linktgt.resize(1000);
 			auto tl = readlink(fp.c_str(), linktgt.data(), linktgt.size());
@@ -185,20 +349,79 @@ public:
 			regex_search(linktgt, m, re_link);
 			if (m.empty())
 				continue;
-			dpaux = "/dev/" + e;
-			return;
+			return dpaux_dev + e;
 		}
 		throw std::runtime_error("no suitable DP AUX device found");
 	}
+
+	string dpaux;
+	DPBacklight bl;
+	int level = -1; /* last level written */
+	unsigned long writes = 0;
+	unsigned long restores = 0;
+	bool stale = true; /* not set up yet or a transfer failed, what the panel holds is unknown */
+	bool probed = false;
+
+	/*
+	 * The panel may still be powering up at boot, so it is probed with the
+	 * first refresh, where the caller's error handling applies.
+	 */
+	explicit PBBacklight(const string &dev) : dpaux(dev), bl(dpaux) {}
+	PBBacklight() : PBBacklight(find()) {}
+	int quantize(int value) {
+		if (value < 0)
+			value = 0;
+		if (value > 0xffff)
+			value = 0xffff;
+		return (static_cast<long>(value) * bl.maxlevel() + 0x7fff) / 0xffff;
+	}
+	int unquantize(int l) {
+		return (static_cast<long>(l) * 0xffff + bl.maxlevel() / 2) / bl.maxlevel();
+	}
+	/* distance between hardware levels */
+	double hwstep() {
+		return 65535.0 / bl.maxlevel();
+	}
+	/* writes only if value lands on a different hardware level */
 	void set(int value) {
-		DPBacklight bl(dpaux);
+		if (stale) {
+			refresh(value);
+			return;
+		}
+		int l = quantize(value);
+		if (l == level)
+			return;
+		bl.set(l);
+		level = l;
+		writes++;
+	}
+	void probe() {
+		if (probed)
+			return;
+		bl.probe();
+		probed = true;
+	}
+	/* reprograms the panel and writes value unconditionally */
+	void refresh(int value) {
+		probe();
 		bl.setup();
-		bl.set(value);
+		level = quantize(value);
+		bl.set(level);
+		writes++;
+		stale = false;
+	}
+	/* restores value if the panel was reset, returns whether it was */
+	bool check(int value) {
+		if (level >= 0 && !stale && bl.configured(level))
+			return false;
+		refresh(value);
+		restores++;
+		return true;
 	}
 	int get() {
-		DPBacklight bl(dpaux);
+		probe();
 		bl.setup();
-		return bl.get();
+		return unquantize(bl.get());
 	}
 };
 
@@ -208,38 +431,465 @@ public:
 	constexpr static int interval = 10; /* step interval ms */
 	constexpr static int max_bri = 0xffff;
 	constexpr static int min_bri = 300;
+	/* panel I/O pauses after an AUX failure, doubled per failure in a row */
+	constexpr static auto backoff_min = std::chrono::milliseconds(50);
+	constexpr static auto backoff_max = std::chrono::seconds(2);
+	/* more failures than this within error_window are not transient */
+	constexpr static size_t error_budget = 10;
+	constexpr static auto error_window = std::chrono::seconds(60);
+
+	using clock = std::chrono::steady_clock;
 
 	PBBacklight pbbl;
 
 	double cur_bri;
-	double tgt_bri;
+	double tgt_bri; /* req_bri within the ceiling */
+	double req_bri;
+	int ceiling = max_bri;
+	bool restored = false;
+	int saved = -1;
+	unsigned long frames = 0;
+	unsigned long errors = 0;
+	std::deque<clock::time_point> failures; /* within error_window */
+	clock::time_point hold_until;
+	clock::duration backoff{};
 
 	static int absbri(double v) {
 		return min_bri + v * (max_bri - min_bri);
 	}
-	PBBLManager() {
+	/* the last value applied is restored before anything else is set up */
+	explicit PBBLManager(const string &dev = PBBacklight::find()) : pbbl(dev) {
 		cur_bri = absbri(0.5);
-		tgt_bri = absbri(0.5);
+		target(cur_bri);
+		std::ifstream f(state_path);
+		int v;
+		if (f >> v && v >= 0 && v <= max_bri) {
+			cur_bri = saved = v;
+			target(v);
+			aux([&] { pbbl.refresh(v); });
+			restored = true;
+		}
+	}
+	/*
+	 * Best effort, a missing state file only costs the instant restore. What
+	 * was asked for is kept, a battery ceiling applies again after restarts.
+	 */
+	void save() {
+		int v = req_bri + 0.5;
+		if (v == saved || state_path.empty())
+			return;
+		string tmp = state_path + ".tmp";
+		{
+			std::ofstream f(tmp);
+			if (!(f << v << endl))
+				return;
+		}
+		if (rename(tmp.c_str(), state_path.c_str()))
+			unlink(tmp.c_str());
+		else
+			saved = v;
+	}
+	/*
+	 * Runs panel I/O unless it is on hold. An AuxError puts it on hold and
+	 * leaves the panel to be reprogrammed afterwards, and is only rethrown
+	 * once the failures exceed the budget.
+	 */
+	template<class F> bool aux(F f) {
+		auto now = clock::now();
+		if (now < hold_until)
+			return false;
+		try {
+			f();
+			backoff = {};
+			return true;
+		} catch (AuxError &e) {
+			errors++;
+			pbbl.stale = true;
+			failures.push_back(now);
+			while (now - failures.front() > error_window)
+				failures.pop_front();
+			if (failures.size() > error_budget)
+				throw;
+			backoff = backoff == clock::duration{} ? clock::duration(backoff_min) :
+				std::min<clock::duration>(backoff * 2, backoff_max);
+			hold_until = now + backoff;
+			cerr << e.what() << ", retrying in " <<
+				std::chrono::duration_cast<std::chrono::milliseconds>(backoff).count() <<
+				" ms" << endl;
+			return false;
+		}
+	}
+	/* ms until panel I/O is possible again, rounded up, 0 if it is */
+	unsigned held() {
+		auto left = std::chrono::ceil<std::chrono::milliseconds>(
+				hold_until - clock::now()).count();
+		return left > 0 ? left : 0;
+	}
+	void target(double v) {
+		req_bri = v;
+		tgt_bri = std::min<double>(v, ceiling);
+	}
+	/* what was asked for is kept, and comes back with the ceiling lifted */
+	void limit(int v) {
+		ceiling = v;
+		target(req_bri);
 	}
 	void reset(double v) {
-		tgt_bri = absbri(v);
+		target(absbri(v));
 		cur_bri = tgt_bri;
-		pbbl.set(cur_bri + 0.5);
+		aux([&] { pbbl.refresh(cur_bri + 0.5); });
+		save();
+	}
+	/* after a DRM event, the panel may have been reinitialized */
+	void restore() {
+		aux([&] { pbbl.check(cur_bri + 0.5); });
 	}
 	void update(double v) {
-		tgt_bri = absbri(v);
+		target(absbri(v));
+	}
+	void setabs(int v, bool ramp) {
+		target(v < 0 ? 0 : v > max_bri ? max_bri : v);
+		if (!ramp) {
+			cur_bri = tgt_bri;
+			aux([&] { pbbl.set(cur_bri + 0.5); });
+			save();
+		}
+	}
+	bool ramping() {
+		return cur_bri != tgt_bri;
 	}
+	/*
+	 * Moves at least one hardware level per frame and finishes once the
+	 * target level is reached, so every frame changes what the panel shows.
+	 */
 	unsigned step() {
-		double d = tgt_bri - cur_bri;
-		double nextbri = tgt_bri;
-		unsigned ret = 0;
-		if (std::abs(d) > 2) {
-			nextbri = cur_bri + perstep * d;
-			ret = interval;
+		if (unsigned ms = held())
+			return ms;
+		if (pbbl.quantize(cur_bri + 0.5) == pbbl.quantize(tgt_bri + 0.5)) {
+			cur_bri = tgt_bri;
+			if (!aux([&] { pbbl.check(cur_bri + 0.5); }))
+				return std::max(held(), 1u); /* 0 would wait for the idle check */
+			save();
+			return 0;
+		}
+		double d = perstep * (tgt_bri - cur_bri);
+		double minstep = pbbl.hwstep();
+		if (std::abs(d) < minstep)
+			d = d < 0 ? -minstep : minstep;
+		if (std::abs(d) >= std::abs(tgt_bri - cur_bri))
+			cur_bri = tgt_bri;
+		else
+			cur_bri += d;
+		aux([&] { pbbl.set(cur_bri + 0.5); });
+		frames++;
+		return interval;
+	}
+};
+
+class LightSensor {
+public:
+	string path;
+	LightSensor() {
+		const string iiopath = "/sys/bus/iio/devices/";
+		for (auto e: list_dir(iiopath)) {
+			if (!starts_with(e, "iio:device"))
+				continue;
+			std::ifstream n(iiopath + e + "/name");
+			string name;
+			if (!(n >> name) || name != "cros-ec-light")
+				continue;
+			path = iiopath + e + "/in_illuminance_input";
+			int r;
+			if (!lux(r))
+				throw std::runtime_error("cannot read " + path);
+			return;
+		}
+		throw std::runtime_error("no ambient light sensor found");
+	}
+	/* false on errors, a busy EC fails a read now and then */
+	bool lux(int &r) {
+		std::ifstream s(path);
+		return static_cast<bool>(s >> r);
+	}
+};
+
+class AutoBrightness {
+public:
+	constexpr static int interval = 500; /* sample interval ms */
+	constexpr static double smoothing = 0.2; /* weight of a new sample */
+	constexpr static double hysteresis = 0.15; /* log lux change ignored as noise */
+
+	/* lux to brightness ratio, interpolated on log lux */
+	constexpr static std::pair<double, double> curve[] = {
+		{ 0, 0.05 },
+		{ 10, 0.2 },
+		{ 100, 0.5 },
+		{ 1000, 1 },
+	};
+
+	LightSensor sensor;
+	int raw = -1;
+	unsigned long samples = 0;
+	unsigned long errors = 0;
+	double filtered = -1;
+	double accepted = -1;
+	double offset = 0;
+
+	static double curvebri(double lux) {
+		double l = std::log1p(lux);
+		double pl = std::log1p(curve[0].first);
+		if (l <= pl)
+			return curve[0].second;
+		for (size_t i = 1; i < std::size(curve); i++) {
+			double cl = std::log1p(curve[i].first);
+			if (l <= cl)
+				return curve[i - 1].second + (l - pl) *
+					(curve[i].second - curve[i - 1].second) / (cl - pl);
+			pl = cl;
+		}
+		return curve[std::size(curve) - 1].second;
+	}
+	double target() {
+		double v = curvebri(accepted) + offset;
+		return v < 0 ? 0 : v > 1 ? 1 : v;
+	}
+	/* returns true if the target brightness changed */
+	bool sample() {
+		int lux;
+		if (!sensor.lux(lux)) {
+			/* skipped, the filter keeps the last good samples */
+			errors++;
+			return false;
+		}
+		if (lux < 0)
+			lux = 0;
+		raw = lux;
+		samples++;
+		if (filtered < 0) {
+			filtered = lux;
+			accepted = lux;
+			return true;
+		}
+		filtered += smoothing * (lux - filtered);
+		if (std::abs(std::log1p(filtered) - std::log1p(accepted)) < hysteresis)
+			return false;
+		accepted = filtered;
+		return true;
+	}
+	/* manual changes win, kept as an offset from the curve */
+	void manual(double v) {
+		offset = v - curvebri(accepted);
+	}
+};
+
+/* a DDC/CI channel to one monitor, transactions block */
+class DDCBus {
+public:
+	virtual ~DDCBus() {}
+	virtual bool write(const uint8_t *buf, size_t n) = 0;
+	virtual bool read(uint8_t *buf, size_t n) = 0;
+};
+
+class I2CBus : public DDCBus {
+	int fd;
+public:
+	I2CBus(const string &path) {
+		fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			throw std::system_error(errno, std::generic_category());
+		/* DDC/CI is at 0x37 on the display's i2c bus */
+		if (ioctl(fd, I2C_SLAVE, 0x37)) {
+			int e = errno;
+			close(fd);
+			throw std::system_error(e, std::generic_category());
+		}
+	}
+	I2CBus(const I2CBus &) = delete;
+	~I2CBus() {
+		close(fd);
+	}
+	bool write(const uint8_t *buf, size_t n) override {
+		return ::write(fd, buf, n) == static_cast<ssize_t>(n);
+	}
+	bool read(uint8_t *buf, size_t n) override {
+		return ::read(fd, buf, n) == static_cast<ssize_t>(n);
+	}
+};
+
+/*
+ * An external monitor following the brightness through VCP 0x10. The bus is
+ * owned by a worker thread, since a transaction takes tens of ms and monitors
+ * reject commands that come too fast. Only the latest value is kept, so
+ * values arriving while the worker is busy or pausing replace each other.
+ */
+class DDCMonitor {
+public:
+	using clock = std::chrono::steady_clock;
+	constexpr static auto reply_delay = std::chrono::milliseconds(40);
+	constexpr static auto interval = std::chrono::milliseconds(100); /* between commands */
+	constexpr static auto retry_delay = std::chrono::milliseconds(100); /* doubled per retry */
+	constexpr static int retries = 4;
+	constexpr static auto drop_delay = std::chrono::seconds(5); /* before a dropped value is tried again */
+
+	/* i2c adapters of connected external outputs */
+	static list<string> enumerate() {
+		const std::regex re_conn("^card[0-9]+-(DP|HDMI-A|DVI-D)-[0-9]+$");
+		list<string> r;
+		for (auto e: list_dir(drm_sysfs)) {
+			if (!std::regex_match(e, re_conn))
+				continue;
+			std::ifstream st(drm_sysfs + e + "/status");
+			string status;
+			if (!(st >> status) || status != "connected")
+				continue;
+			string adapter;
+			char buf[PATH_MAX];
+			auto n = readlink((drm_sysfs + e + "/ddc").c_str(), buf, sizeof(buf) - 1);
+			if (n > 0) {
+				buf[n] = 0;
+				const char *b = strrchr(buf, '/');
+				adapter = b ? b + 1 : buf;
+			} else {
+				/* DP AUX adapters are children of the connector */
+				for (auto c: list_dir(drm_sysfs + e))
+					if (starts_with(c, "i2c-"))
+						adapter = c;
+			}
+			if (!adapter.empty())
+				r.push_back(i2c_dev + adapter);
+		}
+		return r;
+	}
+
+	string name;
+	std::atomic<unsigned long> requests{0}, coalesced{0}, writes{0}, failures{0}, dropped{0};
+	std::atomic<int> written{-1}; /* last value sent */
+	std::atomic<int> maxval{-1}; /* VCP 0x10 maximum, -1 until queried */
+
+	DDCMonitor(const string &n, std::unique_ptr<DDCBus> b) : name(n), bus(move(b)),
+		worker(&DDCMonitor::run, this) {}
+	DDCMonitor(const DDCMonitor &) = delete;
+	~DDCMonitor() {
+		{
+			std::lock_guard<std::mutex> l(m);
+			quit = true;
+		}
+		cv.notify_one();
+		worker.join();
+	}
+	/* ratio of the monitor's maximum, never blocks on the bus */
+	void set(double ratio) {
+		{
+			std::lock_guard<std::mutex> l(m);
+			if (pending >= 0)
+				coalesced++;
+			pending = ratio;
+		}
+		requests++;
+		cv.notify_one();
+	}
+
+private:
+	std::unique_ptr<DDCBus> bus;
+	std::mutex m;
+	std::condition_variable cv;
+	double pending = -1;
+	bool quit = false;
+	std::thread worker; /* last, starts once everything else is set up */
+
+	static uint8_t checksum(uint8_t c, const uint8_t *b, size_t n) {
+		for (size_t i = 0; i < n; i++)
+			c ^= b[i];
+		return c;
+	}
+	/* sleeps for d, returns false if asked to quit meanwhile */
+	bool pause(clock::duration d) {
+		std::unique_lock<std::mutex> l(m);
+		return !cv.wait_for(l, d, [this] { return quit; });
+	}
+	bool superseded() {
+		std::lock_guard<std::mutex> l(m);
+		return quit || pending >= 0;
+	}
+	/* Get VCP Feature 0x10 */
+	bool query(int &cur, int &max) {
+		uint8_t req[] = { 0x51, 0x82, 0x01, 0x10, 0 };
+		req[4] = checksum(0x6e, req, 4);
+		if (!bus->write(req, sizeof(req)) || !pause(reply_delay))
+			return false;
+		/* source, length, reply opcode, result, code, type, max, current, checksum */
+		uint8_t r[11];
+		if (!bus->read(r, sizeof(r)))
+			return false;
+		if (r[0] != 0x6e || r[1] != 0x88 || r[2] != 0x02 || r[3] != 0 || r[4] != 0x10 ||
+				checksum(0x50, r, 10) != r[10])
+			return false;
+		max = (r[6] << 8) | r[7];
+		cur = (r[8] << 8) | r[9];
+		return max > 0;
+	}
+	/* Set VCP Feature 0x10, monitors NAK it when busy */
+	bool setvcp(int v) {
+		uint8_t req[] = { 0x51, 0x84, 0x03, 0x10,
+			static_cast<uint8_t>(v >> 8), static_cast<uint8_t>(v & 0xff), 0 };
+		req[6] = checksum(0x6e, req, 6);
+		return bus->write(req, sizeof(req));
+	}
+	/*
+	 * retries with backoff until sent, a newer value ends the attempts;
+	 * returns false if the value was dropped
+	 */
+	bool apply(double ratio) {
+		auto delay = retry_delay;
+		for (int i = 0; i <= retries; i++) {
+			if (i && (!pause(delay) || superseded()))
+				return true;
+			delay *= 2;
+			if (maxval < 0) {
+				int cur, max;
+				bool ok = query(cur, max);
+				/* the monitor needs a pause after either outcome */
+				if (!pause(interval))
+					return true;
+				if (!ok) {
+					failures++;
+					continue;
+				}
+				maxval = max;
+				written = cur;
+			}
+			int v = std::lround(ratio * maxval);
+			if (v == written)
+				return true;
+			if (setvcp(v)) {
+				writes++;
+				written = v;
+				pause(interval);
+				return true;
+			}
+			failures++;
+			pause(interval);
+		}
+		/* may have been replugged, query again next time */
+		dropped++;
+		maxval = -1;
+		return false;
+	}
+	void run() {
+		std::unique_lock<std::mutex> l(m);
+		for (;;) {
+			cv.wait(l, [this] { return quit || pending >= 0; });
+			if (quit)
+				return;
+			double r = pending;
+			pending = -1;
+			l.unlock();
+			bool sent = apply(r);
+			l.lock();
+			/* a dropped value is tried again later, unless a newer one comes */
+			if (!sent && !cv.wait_for(l, drop_delay, [this] { return quit || pending >= 0; }))
+				pending = r;
 		}
-		cur_bri = nextbri;
-		pbbl.set(cur_bri + 0.5);
-		return ret;
 	}
 };
 
@@ -247,73 +897,634 @@ class BLProxy {
 public:
 	PBBLManager pbbl;
 	map<int, SysBacklight> blmap;
+	std::optional<AutoBrightness> autobri;
 	int watcher;
+	int uevent; /* DRM uevents, -1 if unavailable */
+	int ep; /* inotify, uevents, control socket and its clients */
+	int ctl = -1;
+
+	struct client {
+		uid_t uid;
+		bool subscribed = false;
+	};
+	map<int, client> clients;
+	int notified_tgt = -1;
+	bool notified_ramping = false;
+
+	constexpr static double key_step = 0.05; /* as the desktop's brightness keys */
+
+	/*
+	 * The battery profile, at or below battery_threshold percent on
+	 * battery: a brightness ceiling the ramp moves to, and fewer light
+	 * sensor samples. Off while battery_ceiling is negative.
+	 */
+	constexpr static int battery_interval = 2000; /* sample interval ms */
+	double battery_ceiling = -1;
+	int battery_threshold = PBPOWER_THRESHOLD;
+	pbpower power{};
+	bool saving = false;
+	/* pixelbookd's keyboard backlight, told of the supply changes read here */
+	void (*power_hook)(int online, int capacity) = nullptr;
+
+	bool ddc = false; /* follow external monitors being plugged */
+	map<string, std::unique_ptr<DDCMonitor>> monitors;
+	int mirrored = -1;
+
+	pbstate_backlight *state = nullptr;
+	string state_file;
 
 	BLProxy() {
 		watcher = inotify_init1(IN_NONBLOCK);
 		if (watcher < 0)
 			throw std::system_error(errno, std::generic_category());
+		ep = epoll_create1(EPOLL_CLOEXEC);
+		if (ep < 0)
+			throw std::system_error(errno, std::generic_category());
+		watch(watcher);
+		uevent = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				NETLINK_KOBJECT_UEVENT);
+		sockaddr_nl nl = {};
+		nl.nl_family = AF_NETLINK;
+		nl.nl_groups = 1; /* kernel uevents */
+		if (uevent >= 0 && bind(uevent, reinterpret_cast<sockaddr *>(&nl), sizeof(nl))) {
+			close(uevent);
+			uevent = -1;
+		}
+		static const char *const subsystems[] = { "drm", "power_supply", nullptr };
+		if (uevent >= 0) {
+			pbpower_filter(uevent, subsystems);
+			watch(uevent);
+		}
 	}
 	~BLProxy() {
+		pbstate_close(state, state_file.c_str());
+		for (auto &c: clients)
+			close(c.first);
+		if (ctl >= 0)
+			close(ctl);
+		close(ep);
+		if (uevent >= 0)
+			close(uevent);
 		close(watcher);
 	}
+	void watch(int fd) {
+		epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev))
+			throw std::system_error(errno, std::generic_category());
+	}
 	void add(const string &path) {
 		SysBacklight b(path);
 		int desc = inotify_add_watch(watcher, b.fullpath("brightness").c_str(), IN_MODIFY);
 		if (desc < 0)
 			throw std::system_error(errno, std::generic_category());
-		blmap[desc] = move(b);
+		blmap.erase(desc);
+		blmap.emplace(desc, move(b));
+	}
+	void listen_control(const char *path) {
+		ctl = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (ctl < 0)
+			throw std::system_error(errno, std::generic_category());
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+		unlink(path);
+		if (bind(ctl, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ||
+				chmod(path, 0666) ||
+				listen(ctl, 8))
+			throw std::system_error(errno, std::generic_category());
+		watch(ctl);
+	}
+	/* best effort, the daemon works without it */
+	void publish_state(const char *path) {
+		state = static_cast<pbstate_backlight *>(pbstate_create(path,
+					PBSTATE_KIND_BACKLIGHT, sizeof(pbstate_backlight)));
+		if (state == nullptr)
+			cerr << "cannot create " << path << ": " << strerror(errno) << endl;
+		else
+			state_file = path;
 	}
 	double getbri() {
 		double a = 0;
 		unsigned n = 0;
-		for (auto i: blmap) {
+		for (auto &i: blmap) {
 			a += i.second.ratio();
 			n += 1;
 		}
 		return a / n;
 	}
-	SysBacklight *waitmodify(unsigned mstimeout) {
-		struct pollfd pfd = {
-			.fd = watcher,
-			.events = POLLIN
-		};
-		int r = poll(&pfd, 1, mstimeout);
-		if (r < 0)
-			throw std::system_error(errno, std::generic_category());
-		if (r == 0)
-			return nullptr;
-		char buf[sizeof(inotify_event) + PATH_MAX + 1];
-		read(watcher, buf, sizeof(buf));
-		auto *ev = reinterpret_cast<inotify_event *>(buf);
-		return &blmap[ev->wd];
+	/*
+	 * Drains pending inotify events, returns the last backlight someone else
+	 * modified. Every backlight reported is checked for our own write once,
+	 * so none keeps a stale one that would swallow a later desktop change.
+	 */
+	SysBacklight *readmodify() {
+		alignas(inotify_event) char buf[sizeof(inotify_event) + PATH_MAX + 1];
+		std::vector<SysBacklight *> touched;
+		ssize_t s;
+		while ((s = read(watcher, buf, sizeof(buf))) > 0) {
+			for (char *p = buf; p < buf + s; ) {
+				auto *ev = reinterpret_cast<inotify_event *>(p);
+				auto i = blmap.find(ev->wd);
+				if (i != blmap.end() &&
+						std::find(touched.begin(), touched.end(), &i->second) == touched.end())
+					touched.push_back(&i->second);
+				p += sizeof(inotify_event) + ev->len;
+			}
+		}
+		SysBacklight *r = nullptr;
+		for (auto *b: touched)
+			if (!b->echo())
+				r = b;
+		return r;
+	}
+	void enable_auto() {
+		autobri.emplace();
+	}
+	void add_monitor(const string &name, std::unique_ptr<DDCBus> bus) {
+		monitors[name] = std::make_unique<DDCMonitor>(name, move(bus));
+		mirrored = -1;
+	}
+	void scan_monitors() {
+		auto found = DDCMonitor::enumerate();
+		for (auto i = monitors.begin(); i != monitors.end(); )
+			if (std::find(found.begin(), found.end(), i->first) == found.end())
+				i = monitors.erase(i);
+			else
+				++i;
+		for (auto &d: found) {
+			if (monitors.count(d))
+				continue;
+			try {
+				add_monitor(d, std::make_unique<I2CBus>(d));
+			} catch (std::exception &e) {
+				cerr << "cannot open " << d << ": " << e.what() << endl;
+			}
+		}
+	}
+	void enable_ddc() {
+		ddc = true;
+		scan_monitors();
+	}
+
+	pbbl_msg status(uint8_t op) {
+		pbbl_msg m = {};
+		m.op = op;
+		m.value = pbbl.cur_bri + 0.5;
+		m.target = pbbl.tgt_bri + 0.5;
+		return m;
+	}
+	void drop(int fd) {
+		epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+		close(fd);
+		clients.erase(fd);
+	}
+	void accept_clients() {
+		int fd;
+		while ((fd = accept4(ctl, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+			ucred cred = {};
+			socklen_t len = sizeof(cred);
+			if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+				close(fd);
+				continue;
+			}
+			clients[fd].uid = cred.uid;
+			watch(fd);
+		}
+	}
+	void serve(int fd) {
+		auto &c = clients[fd];
+		pbbl_msg m;
+		ssize_t r;
+		while ((r = recv(fd, &m, sizeof(m), 0)) > 0) {
+			pbbl_msg reply;
+			if (r != sizeof(m)) {
+				reply = status(m.op | PBBL_REPLY);
+				reply.status = EINVAL;
+			} else if ((m.op == PBBL_SET || m.op == PBBL_SET_RAMP || m.op == PBBL_STEP) &&
+					c.uid != 0) {
+				reply = status(m.op | PBBL_REPLY);
+				reply.status = EPERM;
+			} else {
+				switch (m.op) {
+				case PBBL_GET:
+					break;
+				case PBBL_SET:
+				case PBBL_SET_RAMP:
+					pbbl.setabs(m.value, m.op == PBBL_SET_RAMP);
+					break;
+				case PBBL_SUBSCRIBE:
+					c.subscribed = true;
+					break;
+				case PBBL_STEP:
+					keystep(static_cast<int32_t>(m.value));
+					break;
+				default:
+					m.op = 0;
+				}
+				reply = status(m.op | PBBL_REPLY);
+				if (!m.op)
+					reply.status = EINVAL;
+			}
+			if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) != sizeof(reply))
+				break;
+		}
+		if (r == 0 || (r < 0 && errno != EAGAIN))
+			drop(fd);
+	}
+	/* tells subscribers about new targets and finished ramps */
+	void notify() {
+		int tgt = pbbl.tgt_bri + 0.5;
+		bool ramping = pbbl.ramping();
+		if (tgt == notified_tgt && ramping == notified_ramping)
+			return;
+		notified_tgt = tgt;
+		notified_ramping = ramping;
+		auto m = status(PBBL_CHANGED);
+		list<int> dead;
+		for (auto &c: clients)
+			if (c.second.subscribed &&
+					send(c.first, &m, sizeof(m), MSG_NOSIGNAL) != sizeof(m))
+				dead.push_back(c.first);
+		for (auto fd: dead)
+			drop(fd);
+	}
+
+	static double monitor_ratio(int value) {
+		double r = static_cast<double>(value - PBBLManager::min_bri) /
+			(PBBLManager::max_bri - PBBLManager::min_bri);
+		return r < 0 ? 0 : r > 1 ? 1 : r;
+	}
+	/* external monitors get the target, not every frame of the ramp */
+	void mirror() {
+		int tgt = pbbl.tgt_bri + 0.5;
+		if (monitors.empty() || tgt == mirrored)
+			return;
+		mirrored = tgt;
+		for (auto &mon: monitors)
+			mon.second->set(monitor_ratio(tgt));
+	}
+
+	/* memory writes only, cheap enough for every frame */
+	void publish() {
+		if (!state)
+			return;
+		pbstate_begin(&state->h);
+		state->target = pbbl.tgt_bri + 0.5;
+		state->current = pbbl.cur_bri + 0.5;
+		state->level = pbbl.pbbl.level < 0 ? 0 : pbbl.pbbl.level;
+		state->maxlevel = pbbl.pbbl.bl.maxlevel();
+		state->lux_filtered = autobri ? autobri->filtered : -1;
+		state->lux_raw = autobri ? autobri->raw : -1;
+		state->monitors = monitors.size();
+		state->frames = pbbl.frames;
+		state->panel_writes = pbbl.pbbl.writes;
+		state->panel_restores = pbbl.pbbl.restores;
+		state->lux_samples = autobri ? autobri->samples : 0;
+		state->lux_errors = autobri ? autobri->errors : 0;
+		state->aux_retries = pbbl.pbbl.bl.retried;
+		state->aux_reopens = pbbl.pbbl.bl.reopens;
+		state->aux_errors = pbbl.errors;
+		state->ceiling = pbbl.ceiling;
+		state->capacity = battery_ceiling < 0 ? -1 : power.capacity;
+		pbstate_end(&state->h);
+	}
+
+	using clock = std::chrono::steady_clock;
+	clock::time_point nextsample;
+
+	void start() {
+		if (pbbl.restored)
+			pbbl.update(getbri());
+		else
+			pbbl.reset(getbri());
+		nextsample = clock::now();
+	}
+	void enable_battery(double ceiling, int threshold) {
+		battery_ceiling = ceiling;
+		battery_threshold = threshold;
+		pbpower_init(&power, power_dir.c_str());
+		apply_power();
+	}
+	/* shares the uevent socket, hook gets the supplies right away */
+	void follow_power(void (*hook)(int online, int capacity)) {
+		if (battery_ceiling < 0)
+			pbpower_init(&power, power_dir.c_str());
+		power_hook = hook;
+		power_hook(power.online, power.capacity);
+	}
+	void supplies() {
+		if (!pbpower_read(&power))
+			return;
+		if (battery_ceiling >= 0)
+			apply_power();
+		if (power_hook)
+			power_hook(power.online, power.capacity);
+	}
+	/* the ramp takes the panel to a new ceiling, and back once it is lifted */
+	void apply_power() {
+		saving = pbpower_saving(&power, battery_threshold);
+		pbbl.limit(saving ? PBBLManager::absbri(battery_ceiling) : PBBLManager::max_bri);
+		if (autobri && !saving)
+			nextsample = std::min(nextsample,
+					clock::now() + std::chrono::milliseconds(AutoBrightness::interval));
+	}
+	/*
+	 * Drains uevents, restores the panel on DRM changes such as resume or
+	 * hotplug and rereads the power supplies on theirs.
+	 */
+	void readuevent() {
+		char buf[4096];
+		ssize_t n;
+		bool drm = false, supply = false;
+		while ((n = recv(uevent, buf, sizeof(buf) - 1, 0)) > 0) {
+			buf[n] = 0;
+			for (char *p = buf; p < buf + n; p += strlen(p) + 1)
+				if (!strcmp(p, "SUBSYSTEM=drm"))
+					drm = true;
+			if ((battery_ceiling >= 0 || power_hook) && pbpower_match(buf, n))
+				supply = true;
+		}
+		if (drm)
+			pbbl.restore();
+		if (drm && ddc)
+			scan_monitors();
+		if (supply)
+			supplies();
+	}
+	void manual(double r) {
+		if (autobri) {
+			autobri->manual(r);
+			pbbl.update(autobri->target());
+		} else {
+			pbbl.update(r);
+		}
+	}
+	void modified(SysBacklight *bl) {
+		if (bl)
+			manual(bl->ratio());
+	}
+	/*
+	 * Brightness keys from pbkbd, which skip the desktop. The ramp starts
+	 * right away, then the sysfs backlights are updated for the desktop.
+	 */
+	void keystep(int steps) {
+		double r = monitor_ratio(pbbl.tgt_bri + 0.5) + steps * key_step;
+		manual(r < 0 ? 0 : r > 1 ? 1 : r);
+		double now = monitor_ratio(pbbl.tgt_bri + 0.5);
+		for (auto &i: blmap)
+			i.second.write(now);
+	}
+	/* handles whatever is ready on ep without blocking */
+	void dispatch() {
+		epoll_event evs[16];
+		int n = epoll_wait(ep, evs, 16, 0);
+		for (int i = 0; i < n; i++) {
+			int fd = evs[i].data.fd;
+			if (fd == watcher)
+				modified(readmodify());
+			else if (fd == uevent)
+				readuevent();
+			else if (fd == ctl)
+				accept_clients();
+			else
+				serve(fd);
+		}
+	}
+	/* steps the ramp, returns ms until it should be called again */
+	unsigned tick() {
+		if (autobri && clock::now() >= nextsample) {
+			if (autobri->sample())
+				pbbl.update(autobri->target());
+			nextsample = clock::now() + std::chrono::milliseconds(
+					saving ? battery_interval : AutoBrightness::interval);
+		}
+		unsigned ms = pbbl.step();
+		notify();
+		mirror();
+		publish();
+		if (ms == 0)
+			ms = 1000;
+		if (autobri) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+					nextsample - clock::now()).count();
+			if (left < ms)
+				ms = left > 0 ? left : 0;
+		}
+		return ms;
 	}
 	void mainloop() {
-		pbbl.reset(getbri());
+		start();
+		sdwatchdog wd;
+		sdwatchdog_init(&wd);
+		sd_notify_send("READY=1");
 		for (;;) {
-			int ms = pbbl.step();
-			if (ms == 0)
-				ms = 1000;
-			auto *bl = waitmodify(ms);
-			if (bl)
-				pbbl.update(bl->ratio());
+			struct pollfd pfd = {
+				.fd = ep,
+				.events = POLLIN
+			};
+			if (poll(&pfd, 1, sdwatchdog_timeout(&wd, tick())) < 0 && errno != EINTR)
+				throw std::system_error(errno, std::generic_category());
+			dispatch();
 		}
 	}
 };
 
+/* ceiling[,threshold] as -battery takes them, false if malformed */
+static bool parse_battery(const char *s, double &ceiling, int &threshold)
+{
+	char *e;
+	ceiling = std::strtod(s, &e);
+	if (e == s || !(ceiling >= 0 && ceiling <= 1))
+		return false;
+	threshold = PBPOWER_THRESHOLD;
+	if (*e == ',') {
+		s = e + 1;
+		threshold = std::strtol(s, &e, 10);
+		if (e == s || threshold < 0 || threshold > 100)
+			return false;
+	}
+	return !*e;
+}
+
+#ifndef PB_COMBINED
+/* returns -1 if the daemon is not running */
+static int control_connect()
+{
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, PBBL_SOCKET, sizeof(addr.sun_path) - 1);
+	if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static pbbl_msg control_request(int fd, uint8_t op, int value)
+{
+	pbbl_msg m = {};
+	m.op = op;
+	m.value = value < 0 ? 0 : value;
+	if (send(fd, &m, sizeof(m), MSG_NOSIGNAL) != sizeof(m) ||
+			recv(fd, &m, sizeof(m), 0) != sizeof(m))
+		throw std::system_error(errno, std::generic_category());
+	if (m.status)
+		throw std::system_error(m.status, std::generic_category());
+	return m;
+}
+
+/* an eDP panel DPCD with AUX brightness control and a bits wide PWM */
+static void make_mock_dpcd(const string &path, int bits)
+{
+	uint8_t regs[0x800] = {};
+	regs[0x701] = 0x03; /* TCON backlight adjustment, pin enable */
+	regs[0x702] = 0x26; /* AUX brightness, 16 bit, AUX frequency */
+	regs[0x722] = 0xff; /* power-on brightness */
+	regs[0x723] = 0xff;
+	regs[0x725] = 1;
+	regs[0x726] = bits;
+	std::ofstream f(path, std::ios::binary | std::ios::trunc);
+	if (!f.write(reinterpret_cast<const char *>(regs), sizeof(regs)))
+		throw std::runtime_error("cannot write " + path);
+}
+
+/*
+ * Runs a brightness script against a mock DPCD and reports the cost per
+ * ramp frame. Lines are "ramp <value>", "set <value>" or "sysfs <ratio>",
+ * each followed by the whole ramp it causes.
+ */
+static void replay(const char *script, int rounds)
+{
+	std::ifstream f(script);
+	if (!f.is_open())
+		throw std::runtime_error(string("cannot open ") + script);
+	list<std::pair<string, double>> cmds;
+	string line;
+	while (std::getline(f, line)) {
+		std::istringstream l(line);
+		string op;
+		double v;
+		if (l >> op >> v && op[0] != '#')
+			cmds.emplace_back(op, v);
+	}
+
+	const char *tmp = getenv("TMPDIR");
+	string dpcd = string(tmp ? tmp : "/tmp") + "/pbbacklight-replay.XXXXXX";
+	int fd = mkstemp(dpcd.data());
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category());
+	close(fd);
+	make_mock_dpcd(dpcd, 11);
+	state_path.clear();
+
+	unsigned long frames = 0, writes = 0;
+	long long instructions;
+	std::chrono::nanoseconds elapsed;
+	{
+		PBBLManager m(dpcd);
+		int perf = perfcount_open();
+		auto t0 = std::chrono::steady_clock::now();
+		perfcount_start(perf);
+		for (int r = 0; r < rounds; r++) {
+			for (auto &c: cmds) {
+				if (c.first == "ramp")
+					m.setabs(c.second, true);
+				else if (c.first == "set")
+					m.setabs(c.second, false);
+				else if (c.first == "sysfs")
+					m.update(c.second);
+				int last = m.pbbl.level;
+				while (m.step()) {
+					frames++;
+					if (m.pbbl.level != last)
+						writes++;
+					last = m.pbbl.level;
+				}
+			}
+		}
+		instructions = perfcount_stop(perf);
+		elapsed = std::chrono::steady_clock::now() - t0;
+		if (perf >= 0)
+			close(perf);
+	}
+	unlink(dpcd.c_str());
+
+	double n = frames ? frames : 1;
+	printf("pbbacklight: %lu frames, %.1f ns/frame, ", frames, elapsed.count() / n);
+	if (instructions >= 0)
+		printf("%.1f instructions/frame, ", instructions / n);
+	else
+		printf("instructions n/a, ");
+	printf("%.2f AUX writes/frame\n", writes / n);
+}
+
 int main(int argc, char **argv)
 {
 	try {
+		bool autobri = false, ddc = false;
+		double ceiling = -1;
+		int threshold = PBPOWER_THRESHOLD;
+		while (argc >= 2 && (string(argv[1]) == "-auto" || string(argv[1]) == "-ddc" ||
+					string(argv[1]) == "-battery")) {
+			if (string(argv[1]) == "-battery") {
+				if (argc < 3 || !parse_battery(argv[2], ceiling, threshold)) {
+					cerr << "-battery takes ceiling[,threshold], 0 to 1 and a percentage" << endl;
+					return 1;
+				}
+				argv[2] = argv[0];
+				argv += 2;
+				argc -= 2;
+				continue;
+			}
+			(string(argv[1]) == "-auto" ? autobri : ddc) = true;
+			argv[1] = argv[0];
+			argv++;
+			argc--;
+		}
 		if (argc >= 2 && starts_with(argv[1], "-")) {
-			PBBacklight bl;
-			if (string(argv[1]) == "-get") {
+			string cmd(argv[1]);
+			if ((cmd == "-set" || cmd == "-ramp" || cmd == "-replay") && argc < 3)
+				return 1;
+			if (cmd == "-replay") {
+				replay(argv[2], argc >= 4 ? std::atoi(argv[3]) : 1);
+				return 0;
+			}
+			int ctl = -1;
+			if (cmd == "-get" || cmd == "-set" || cmd == "-ramp" || cmd == "-watch")
+				ctl = control_connect();
+			if (ctl >= 0) {
+				if (cmd == "-get") {
+					cout << control_request(ctl, PBBL_GET, 0).value << endl;
+				} else if (cmd == "-set") {
+					control_request(ctl, PBBL_SET, std::atoi(argv[2]));
+				} else if (cmd == "-ramp") {
+					control_request(ctl, PBBL_SET_RAMP, std::atoi(argv[2]));
+				} else {
+					auto m = control_request(ctl, PBBL_SUBSCRIBE, 0);
+					do
+						cout << m.value << " " << m.target << endl;
+					while (recv(ctl, &m, sizeof(m), 0) == sizeof(m));
+				}
+				close(ctl);
+				return 0;
+			}
+			/* daemon not running, access the panel directly */
+			if (cmd == "-get") {
+				PBBacklight bl;
 				cout << bl.get() << endl;
-			} else if (string(argv[1]) == "-set") {
-				if (argc < 3)
-					return 1;
-				bl.set(std::atoi(argv[2]));
+			} else if (cmd == "-set" || cmd == "-ramp") {
+				PBBacklight bl;
+				bl.refresh(std::atoi(argv[2]));
+			} else if (cmd == "-watch") {
+				cerr << "daemon not running" << endl;
+				return 1;
 			} else {
-				cerr << "usage: " << (argc >= 1 ? argv[0] : "pbbacklight") << " [-get] [-set value] [/path/to/sys/class/backlight/xxx]" << endl
+				cerr << "usage: " << (argc >= 1 ? argv[0] : "pbbacklight") << " [-get] [-set value] [-ramp value] [-watch] [-replay script [rounds]] [-auto] [-ddc] [-battery ceiling[,threshold]] [/path/to/sys/class/backlight/xxx]" << endl
 					<< "Pixelbook userspace backlight driver" << endl;
 				return 1;
 			}
@@ -328,6 +1539,14 @@ int main(int argc, char **argv)
 			for (auto v: SysBacklight::enumerate())
 				p.add(v);
 		}
+		if (autobri)
+			p.enable_auto();
+		if (ddc)
+			p.enable_ddc();
+		if (ceiling >= 0)
+			p.enable_battery(ceiling, threshold);
+		p.listen_control(PBBL_SOCKET);
+		p.publish_state(PBSTATE_BACKLIGHT);
 
 		p.mainloop();
 	} catch (std::exception &e) {
@@ -337,3 +1556,4 @@ int main(int argc, char **argv)
 
 	return 0;
 }
+#endif
@@ -0,0 +1,40 @@
+#ifndef PBBLCTL_H
+#define PBBLCTL_H
+
+#include <stdint.h>
+
+/*
+ * pbbacklight control socket protocol.
+ *
+ * SOCK_SEQPACKET on PBBL_SOCKET, one struct pbbl_msg per packet in host
+ * byte order. Every request is answered with the same op or'ed with
+ * PBBL_REPLY, status is 0 or an errno value. value is the PWM value
+ * currently written to the panel, target is where the ramp is heading,
+ * both in 0 to 0xffff.
+ *
+ * Setting brightness requires root, reading and subscribing does not.
+ * PBBL_STEP moves like the desktop's brightness keys and writes the result
+ * back to the sysfs backlights, so the desktop sees the new level.
+ */
+
+#define PBBL_SOCKET "/run/pbbacklight.sock"
+
+enum pbbl_op {
+	PBBL_GET = 1,
+	PBBL_SET, /* apply value at once */
+	PBBL_SET_RAMP, /* ramp to value */
+	PBBL_SUBSCRIBE, /* a PBBL_CHANGED follows every target change and every finished ramp */
+	PBBL_STEP, /* brightness keys, ramp value steps up from the target, down if negative */
+	PBBL_CHANGED = 0x40,
+	PBBL_REPLY = 0x80,
+};
+
+struct pbbl_msg {
+	uint8_t op;
+	uint8_t status;
+	uint16_t reserved;
+	uint32_t value;
+	uint32_t target;
+};
+
+#endif
@@ -0,0 +1,924 @@
+/*
+ * Offline simulator for pbkbd-backlight.
+ *
+ * Runs the daemon's control loop unmodified against a fake IIO device and a
+ * fake LED directory, or a fake /dev/cros_ec, replacing its clocks, poll,
+ * keyboard activity signals, lid switch and power supply uevents with a
+ * virtual clock driven by lux, keyboard, lid and charger traces. The power
+ * supplies are a fake /sys/class/power_supply tree.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crosec.h"
+
+static time_t sim_time(time_t *t);
+static int sim_clock_gettime(clockid_t clk, struct timespec *ts);
+static int sim_poll(struct pollfd *fds, nfds_t nfds, int ms);
+static int sim_ioctl(int fd, unsigned long req, void *arg);
+static int sim_socket(int domain, int type, int protocol);
+static int sim_bind(int fd, const struct sockaddr *addr, socklen_t len);
+
+#define time(t) sim_time(t)
+#define clock_gettime(c, t) sim_clock_gettime(c, t)
+#define poll(f, n, t) sim_poll(f, n, t)
+#define ioctl(f, r, a) sim_ioctl(f, r, a)
+#define socket(d, t, p) sim_socket(d, t, p)
+#define bind(f, a, l) sim_bind(f, a, l)
+#define main pbkbd_backlight_main
+#include "pbkbd-backlight.c"
+#undef main
+#undef bind
+#undef socket
+#undef ioctl
+#undef poll
+#undef clock_gettime
+#undef time
+
+static void print_help(const char *progname)
+{
+	printf("usage: %s [-l luxtrace | -s low,high,period,noise] [-k keytrace | -t active,idle]\n"
+			"       [-g period,closed] [-b period,unplugged,drain,capacity] [-d seconds]\n"
+			"       [-j lux] [-c config] [-e eclog] [-v]\n"
+			"Simulate pbkbd-backlight on a virtual clock.\n"
+			"Options:\n"
+			"  -l  lux trace, lines of '<seconds> <lux>', held until the next line\n"
+			"  -s  synthetic square wave lux trace with uniform noise\n"
+			"  -k  keyboard trace, lines of '<seconds>' for each keystroke\n"
+			"  -t  synthetic typing, active seconds then idle seconds, repeated\n"
+			"  -g  close the lid for the last closed seconds of every period\n"
+			"  -b  unplug the charger for the last unplugged seconds of every period,\n"
+			"      the battery starts at capacity percent and loses one every drain\n"
+			"      seconds unplugged, gaining it back as fast while charging\n"
+			"  -d  simulated duration, defaults to the end of the traces\n"
+			"  -j  minimum lux change counted as a lighting step, default 5\n"
+			"  -c  pbkbd-backlight config file\n"
+			"  -e  drive the cros_ec backend and log its host commands, - for none\n"
+			"  -v  log every LED write\n"
+			, progname);
+}
+
+#define SIM_EPOCH 1000000000LL
+#define SIM_LED_MAX 100
+
+struct trace_point {
+	long long ms;
+	int lux;
+};
+
+static struct {
+	long long now; /* virtual ms */
+	long long end;
+
+	struct trace_point *lux;
+	size_t luxn, luxcap, luxidx;
+	int synth;
+	int synth_low, synth_high, synth_noise;
+	long long synth_period;
+	int curlux;
+
+	long long *keys;
+	size_t keyn, keycap, keyidx;
+	long long type_active, type_idle;
+	long long last_notify;
+
+	char root[PATH_MAX - 64]; /* room for the files below it */
+	char ledfile[PATH_MAX];
+	char luxfile[PATH_MAX];
+	char ecfile[PATH_MAX];
+
+	long long lid_period, lid_closed;
+	int lid;
+	unsigned long long lid_closes, wakeups_switch, wakeups_closed;
+
+	char powerdir[PATH_MAX];
+	long long pw_period, pw_unplugged, pw_drain;
+	int pw_online, pw_capacity;
+	long long pw_last; /* virtual ms of the last supply change */
+	int uevent_w; /* the daemon reads the other end as its uevent socket */
+	unsigned long long unplugs, uevents, wakeups_power;
+	long long saving_since, saving_ms;
+	int saving;
+
+	int ec;
+	FILE *eclog;
+	unsigned long long ec_commands, ec_reads, ec_writes, ec_probes;
+	long long ec_last, ec_mingap; /* virtual ms between host commands */
+
+	int verbose;
+	int steplux;
+
+	/* report */
+	unsigned long long wakeups_sample, wakeups_fade, wakeups_idle, wakeups_key;
+	unsigned long long led_writes, led_changes, signals;
+	int led;
+	long long led_since;
+	long long led_time[SIM_LED_MAX + 1];
+
+	/* lighting step latency */
+	long long step_at;
+	long long step_first; /* ms to first LED change, -1 while waiting */
+	long long step_settle;
+	unsigned long long steps, steps_responded;
+	long long first_sum, first_max, settle_sum, settle_max;
+} sim = {
+	.steplux = 5,
+	.step_at = -1,
+	.ec_last = -1,
+	.ec_mingap = -1,
+	.uevent_w = -1,
+	.pw_online = 1,
+	.pw_capacity = 100,
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void writefile(const char *path, const char *content)
+{
+	int f = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0)
+		die(path);
+	if (write(f, content, strlen(content)) < 0)
+		die(path);
+	close(f);
+}
+
+static void makedir(const char *path)
+{
+	if (mkdir(path, 0755))
+		die(path);
+}
+
+static void write_supplies(void)
+{
+	char p[PATH_MAX + 64], v[16];
+	snprintf(p, sizeof(p), "%s/AC/online", sim.powerdir);
+	writefile(p, sim.pw_online ? "1\n" : "0\n");
+	snprintf(p, sizeof(p), "%s/BAT0/status", sim.powerdir);
+	writefile(p, !sim.pw_online ? "Discharging\n" :
+			sim.pw_capacity < 100 ? "Charging\n" : "Full\n");
+	snprintf(p, sizeof(p), "%s/BAT0/capacity", sim.powerdir);
+	snprintf(v, sizeof(v), "%d\n", sim.pw_capacity);
+	writefile(p, v);
+}
+
+static void setup_tree(void)
+{
+	const char *tmp = getenv("TMPDIR");
+	snprintf(sim.root, sizeof(sim.root), "%s/pbkbd-backlight-sim.XXXXXX",
+			tmp ? tmp : "/tmp");
+	if (mkdtemp(sim.root) == NULL)
+		die("mkdtemp");
+
+	char p[PATH_MAX + 64];
+	snprintf(p, sizeof(p), "%s/led", sim.root);
+	makedir(p);
+	snprintf(p, sizeof(p), "%s/led/max_brightness", sim.root);
+	writefile(p, "100\n");
+	snprintf(sim.ledfile, sizeof(sim.ledfile), "%s/led/brightness", sim.root);
+	writefile(sim.ledfile, "");
+
+	snprintf(p, sizeof(p), "%s/iio", sim.root);
+	makedir(p);
+	/* a decoy so the sensor scan is exercised */
+	snprintf(p, sizeof(p), "%s/iio/iio:device0", sim.root);
+	makedir(p);
+	snprintf(p, sizeof(p), "%s/iio/iio:device0/name", sim.root);
+	writefile(p, "cros-ec-accel\n");
+	snprintf(p, sizeof(p), "%s/iio/iio:device1", sim.root);
+	makedir(p);
+	snprintf(p, sizeof(p), "%s/iio/iio:device1/name", sim.root);
+	writefile(p, LIGHT_NAME "\n");
+	snprintf(sim.luxfile, sizeof(sim.luxfile), "%s/iio/iio:device1/" LIGHT_PROP, sim.root);
+	writefile(sim.luxfile, "0\n");
+	snprintf(sim.ecfile, sizeof(sim.ecfile), "%s/cros_ec", sim.root);
+	writefile(sim.ecfile, "");
+
+	/* a charger and a battery, an empty class without -b */
+	snprintf(sim.powerdir, sizeof(sim.powerdir), "%s/power", sim.root);
+	makedir(sim.powerdir);
+	if (!sim.pw_period)
+		return;
+	snprintf(p, sizeof(p), "%s/AC", sim.powerdir);
+	makedir(p);
+	snprintf(p, sizeof(p), "%s/AC/type", sim.powerdir);
+	writefile(p, "Mains\n");
+	snprintf(p, sizeof(p), "%s/BAT0", sim.powerdir);
+	makedir(p);
+	snprintf(p, sizeof(p), "%s/BAT0/type", sim.powerdir);
+	writefile(p, "Battery\n");
+	snprintf(p, sizeof(p), "%s/BAT0/present", sim.powerdir);
+	writefile(p, "1\n");
+	write_supplies();
+}
+
+static void cleanup_tree(void)
+{
+	const char *files[] = {
+		"led/max_brightness", "led/brightness", "led",
+		"iio/iio:device0/name", "iio/iio:device0",
+		"iio/iio:device1/name", "iio/iio:device1/" LIGHT_PROP, "iio/iio:device1",
+		"iio", "cros_ec", "event0", "pid", "pbkbd-backlight.conf",
+		"power/AC/type", "power/AC/online", "power/AC",
+		"power/BAT0/type", "power/BAT0/present", "power/BAT0/status",
+		"power/BAT0/capacity", "power/BAT0", "power", ""
+	};
+	size_t i;
+	for (i = 0; i < sizeof(files) / sizeof(*files); i++) {
+		char p[PATH_MAX + 64];
+		snprintf(p, sizeof(p), "%s/%s", sim.root, files[i]);
+		remove(p);
+	}
+}
+
+static void load_lux_trace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		die(path);
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double t, lux;
+		if (sscanf(line, "%lf %lf", &t, &lux) != 2)
+			continue;
+		if (sim.luxn == sim.luxcap) {
+			sim.luxcap = sim.luxcap ? sim.luxcap * 2 : 1024;
+			sim.lux = realloc(sim.lux, sim.luxcap * sizeof(*sim.lux));
+			if (sim.lux == NULL)
+				die("realloc");
+		}
+		sim.lux[sim.luxn].ms = (long long) (t * 1000);
+		sim.lux[sim.luxn].lux = (int) (lux + 0.5);
+		sim.luxn++;
+	}
+	fclose(f);
+	if (sim.luxn && sim.lux[sim.luxn - 1].ms > sim.end)
+		sim.end = sim.lux[sim.luxn - 1].ms;
+}
+
+static void load_key_trace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		die(path);
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		double t;
+		if (sscanf(line, "%lf", &t) != 1)
+			continue;
+		if (sim.keyn == sim.keycap) {
+			sim.keycap = sim.keycap ? sim.keycap * 2 : 1024;
+			sim.keys = realloc(sim.keys, sim.keycap * sizeof(*sim.keys));
+			if (sim.keys == NULL)
+				die("realloc");
+		}
+		sim.keys[sim.keyn++] = (long long) (t * 1000);
+	}
+	fclose(f);
+	if (sim.keyn && sim.keys[sim.keyn - 1] > sim.end)
+		sim.end = sim.keys[sim.keyn - 1];
+}
+
+static int lux_at(long long ms)
+{
+	if (sim.synth) {
+		int v = (ms / sim.synth_period) % 2 ? sim.synth_high : sim.synth_low;
+		if (sim.synth_noise)
+			v += rand() % (2 * sim.synth_noise + 1) - sim.synth_noise;
+		return v < 0 ? 0 : v;
+	}
+	while (sim.luxidx + 1 < sim.luxn && sim.lux[sim.luxidx + 1].ms <= ms)
+		sim.luxidx++;
+	if (!sim.luxn || sim.lux[sim.luxidx].ms > ms)
+		return 0;
+	return sim.lux[sim.luxidx].lux;
+}
+
+/* lighting steps are judged on the noise free signal */
+static int lux_level_at(long long ms)
+{
+	if (sim.synth)
+		return (ms / sim.synth_period) % 2 ? sim.synth_high : sim.synth_low;
+	return lux_at(ms);
+}
+
+/* next keystroke strictly after ms, -1 if none */
+static long long next_key(long long ms)
+{
+	if (sim.type_active || sim.type_idle) {
+		long long cycle = sim.type_active + sim.type_idle;
+		long long n = (ms / 200 + 1) * 200;
+		if (n % cycle >= sim.type_active)
+			n = (n / cycle + 1) * cycle;
+		return n;
+	}
+	while (sim.keyidx < sim.keyn && sim.keys[sim.keyidx] <= ms)
+		sim.keyidx++;
+	return sim.keyidx < sim.keyn ? sim.keys[sim.keyidx] : -1;
+}
+
+/* on for the last on ms of every period */
+static int on_at(long long ms, long long period, long long on)
+{
+	return period && ms % period >= period - on;
+}
+
+/* next change strictly after ms, -1 if none */
+static long long next_edge(long long ms, long long period, long long on)
+{
+	if (!period || !on || on == period)
+		return -1;
+	long long base = ms - ms % period;
+	if (ms - base < period - on)
+		return base + period - on;
+	return base + period;
+}
+
+static int lid_closed_at(long long ms)
+{
+	return on_at(ms, sim.lid_period, sim.lid_closed);
+}
+
+/* next lid switch change strictly after ms, -1 if none */
+static long long next_flip(long long ms)
+{
+	return next_edge(ms, sim.lid_period, sim.lid_closed);
+}
+
+/* next charger or capacity change strictly after ms, -1 if none */
+static long long next_power(long long ms)
+{
+	long long n = next_edge(ms, sim.pw_period, sim.pw_unplugged);
+	if (sim.pw_period && sim.pw_drain &&
+			(sim.pw_online ? sim.pw_capacity < 100 : sim.pw_capacity > 0)) {
+		long long c = sim.pw_last + sim.pw_drain;
+		if (c <= ms)
+			c = ms + 1;
+		if (n < 0 || c < n)
+			n = c;
+	}
+	return n;
+}
+
+static void account_led(long long until)
+{
+	sim.led_time[sim.led] += until - sim.led_since;
+	sim.led_since = until;
+}
+
+/* time on the battery profile, as the daemon publishes it */
+static void account_saving(long long until)
+{
+	if (sim.saving)
+		sim.saving_ms += until - sim.saving_since;
+	sim.saving_since = until;
+	sim.saving = state_page != NULL && state_page->saving;
+}
+
+static void finish_step(void)
+{
+	if (sim.step_at < 0)
+		return;
+	sim.steps++;
+	if (sim.step_first >= 0) {
+		sim.steps_responded++;
+		sim.first_sum += sim.step_first;
+		if (sim.step_first > sim.first_max)
+			sim.first_max = sim.step_first;
+		sim.settle_sum += sim.step_settle;
+		if (sim.step_settle > sim.settle_max)
+			sim.settle_max = sim.step_settle;
+	}
+	sim.step_at = -1;
+}
+
+/* collect what the daemon wrote to the LED since the last wakeup */
+static void check_led(void)
+{
+	char buf[32];
+	int f = open(sim.ledfile, O_RDWR);
+	if (f < 0)
+		die(sim.ledfile);
+	ssize_t s = read(f, buf, sizeof(buf) - 1);
+	if (s > 0) {
+		buf[s] = 0;
+		int v = atoi(buf);
+		if (v < 0)
+			v = 0;
+		if (v > SIM_LED_MAX)
+			v = SIM_LED_MAX;
+		sim.led_writes++;
+		if (sim.verbose)
+			printf("%10.3f led %d\n", sim.now / 1000.0, v);
+		if (v != sim.led) {
+			account_led(sim.now);
+			sim.led = v;
+			sim.led_changes++;
+			if (sim.step_at >= 0) {
+				if (sim.step_first < 0)
+					sim.step_first = sim.now - sim.step_at;
+				sim.step_settle = sim.now - sim.step_at;
+			}
+		}
+		if (ftruncate(f, 0))
+			die(sim.ledfile);
+	}
+	close(f);
+}
+
+/* advance the virtual clock, feeding the fake sensor on the way */
+static void advance(long long to)
+{
+	int level = lux_level_at(sim.now);
+	int lux = lux_at(to);
+	int newlevel = lux_level_at(to);
+	if (abs(newlevel - level) >= sim.steplux) {
+		finish_step();
+		sim.step_at = to;
+		sim.step_first = -1;
+	}
+	if (lux != sim.curlux) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%d\n", lux);
+		writefile(sim.luxfile, buf);
+		sim.curlux = lux;
+	}
+	account_saving(to);
+	sim.now = to;
+	if (sim.end && sim.now >= sim.end)
+		keeploop = 0;
+}
+
+/* deliver keyboard activity due up to ms the way pbkbd does, at most once a second */
+static int deliver_key(long long ms)
+{
+	long long k = next_key(sim.now);
+	if (k < 0 || k > ms)
+		return 0;
+	advance(k);
+	if (k / 1000 == sim.last_notify)
+		return 0;
+	sim.last_notify = k / 1000;
+	sim.signals++;
+	sighandler(SIGHUP);
+	return 1;
+}
+
+static void flip(long long to)
+{
+	advance(to);
+	sim.lid = lid_closed_at(to);
+	if (sim.lid)
+		sim.lid_closes++;
+	sim.wakeups_switch++;
+}
+
+static void uevent(const char *supply)
+{
+	char buf[256];
+	int n = snprintf(buf, sizeof(buf), "change@/devices/sim/power_supply/%s%c"
+			"ACTION=change%cSUBSYSTEM=power_supply%cPOWER_SUPPLY_NAME=%s%c",
+			supply, 0, 0, 0, supply, 0);
+	if (write(sim.uevent_w, buf, n) != n)
+		die("uevent");
+	sim.uevents++;
+}
+
+/* the charger is plugged or unplugged, or the battery gains or loses a percent */
+static void supply_change(long long to)
+{
+	advance(to);
+	int online = !on_at(to, sim.pw_period, sim.pw_unplugged);
+	if (online != sim.pw_online) {
+		sim.pw_online = online;
+		if (!online)
+			sim.unplugs++;
+		write_supplies();
+		uevent("AC");
+	} else {
+		sim.pw_capacity += online ? 1 : -1;
+		write_supplies();
+	}
+	uevent("BAT0");
+	sim.pw_last = to;
+	sim.wakeups_power++;
+}
+
+/* the earliest lid or supply change up to limit, -1 for no limit, 0 if none */
+static int wait_change(long long limit)
+{
+	long long f = next_flip(sim.now);
+	long long p = next_power(sim.now);
+	if (p >= 0 && (limit < 0 || p <= limit) && (f < 0 || p < f)) {
+		supply_change(p);
+		return 2;
+	}
+	if (f >= 0 && (limit < 0 || f <= limit)) {
+		flip(f);
+		return 1;
+	}
+	return 0;
+}
+
+/* returns -1 for keyboard activity, 1 for a lid switch change, 2 for a supply change */
+static int wait_virtual(int ms, unsigned long long *counter)
+{
+	check_led();
+	int r;
+	if (ms < 0) {
+		/* idle wait, only a keystroke, the lid or the supplies end it */
+		for (;;) {
+			long long k = next_key(sim.now);
+			long long limit = k;
+			if (sim.end && (limit < 0 || limit >= sim.end))
+				limit = sim.end - 1;
+			if ((r = wait_change(limit)))
+				return r;
+			if (k < 0 || (sim.end && k >= sim.end)) {
+				advance(sim.end > sim.now ? sim.end : sim.now);
+				keeploop = 0;
+				sim.wakeups_idle++;
+				return 0;
+			}
+			if (deliver_key(k)) {
+				sim.wakeups_key++;
+				return -1;
+			}
+		}
+	}
+	long long deadline = sim.now + ms;
+	for (;;) {
+		long long k = next_key(sim.now);
+		if ((r = wait_change(k >= 0 && k < deadline ? k : deadline)))
+			return r;
+		if (k < 0 || k > deadline)
+			break;
+		if (deliver_key(deadline)) {
+			sim.wakeups_key++;
+			return -1;
+		}
+	}
+	advance(deadline);
+	(*counter)++;
+	if (sim.lid)
+		sim.wakeups_closed++;
+	return 0;
+}
+
+static time_t sim_time(time_t *t)
+{
+	time_t r = SIM_EPOCH + sim.now / 1000;
+	if (t)
+		*t = r;
+	return r;
+}
+
+static int sim_clock_gettime(clockid_t clk, struct timespec *ts)
+{
+	ts->tv_sec = SIM_EPOCH + sim.now / 1000;
+	ts->tv_nsec = sim.now % 1000 * 1000000;
+	return 0;
+}
+
+static int sim_poll(struct pollfd *fds, nfds_t nfds, int ms)
+{
+	/* the fade steps much faster than sampling */
+	int r = wait_virtual(ms, ms >= 0 && ms < 500 / SAMPLERATE ?
+			&sim.wakeups_fade : &sim.wakeups_sample);
+	if (r < 0) {
+		errno = EINTR;
+		return -1;
+	}
+	if (r > 0 && (nfds_t) r < nfds) {
+		/* the daemon polls the config watch, the switches, then the supplies */
+		nfds_t i;
+		for (i = 0; i < nfds; i++)
+			fds[i].revents = i == (nfds_t) r ? POLLIN : 0;
+		return 1;
+	}
+	return 0;
+}
+
+/* the uevent socket is a pipe the simulator writes to */
+static int sim_socket(int domain, int type, int protocol)
+{
+	(void) domain;
+	(void) type;
+	(void) protocol;
+	int p[2];
+	if (pipe(p))
+		return -1;
+	fcntl(p[0], F_SETFL, O_NONBLOCK);
+	fcntl(p[0], F_SETFD, FD_CLOEXEC);
+	if (sim.uevent_w >= 0)
+		close(sim.uevent_w);
+	sim.uevent_w = p[1];
+	return p[0];
+}
+
+static int sim_bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	(void) fd;
+	(void) addr;
+	(void) len;
+	return 0;
+}
+
+/*
+ * The EC behind /dev/cros_ec: two accelerometers and the light sensor as
+ * motion sensors, and the keyboard PWM writing to the fake LED like the
+ * LED driver would. Every host command is logged with the virtual time.
+ */
+#define EC_RES_INVALID_COMMAND 1
+#define EC_RES_INVALID_PARAM 3
+#define FAKE_EC_SENSORS 3
+#define FAKE_EC_LIGHT 2
+
+static int fake_ec(struct cros_ec_command *c, char *what, size_t whatsize)
+{
+	uint8_t *d = c->data;
+	int n = 0;
+	c->result = EC_RES_SUCCESS;
+	if (c->command == EC_CMD_MOTION_SENSE_CMD && c->outsize >= 2) {
+		switch (d[0]) {
+		case MOTIONSENSE_CMD_DUMP:
+			snprintf(what, whatsize, "motion_sense dump");
+			sim.ec_probes++;
+			d[0] = 0;
+			d[1] = FAKE_EC_SENSORS;
+			n = 2;
+			break;
+		case MOTIONSENSE_CMD_INFO:
+			snprintf(what, whatsize, "motion_sense info %d", d[1]);
+			sim.ec_probes++;
+			if (d[1] >= FAKE_EC_SENSORS)
+				c->result = EC_RES_INVALID_PARAM;
+			d[0] = d[1] == FAKE_EC_LIGHT ? MOTIONSENSE_TYPE_LIGHT : 0;
+			d[1] = 0;
+			d[2] = 0;
+			n = 3;
+			break;
+		case MOTIONSENSE_CMD_DATA:
+			snprintf(what, whatsize, "motion_sense data %d = %d", d[1], sim.curlux);
+			sim.ec_reads++;
+			if (d[1] != FAKE_EC_LIGHT) {
+				c->result = EC_RES_INVALID_PARAM;
+				break;
+			}
+			struct ec_response_motion_sensor_data r = {
+				.sensor_num = d[1],
+				.data = { sim.curlux > 0xffff ? 0xffff : sim.curlux }
+			};
+			memcpy(d, &r, sizeof(r));
+			n = sizeof(r);
+			break;
+		default:
+			snprintf(what, whatsize, "motion_sense %d", d[0]);
+			c->result = EC_RES_INVALID_PARAM;
+		}
+	} else if (c->command == EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT && c->outsize >= 1) {
+		snprintf(what, whatsize, "pwm_set_keyboard_backlight %d", d[0]);
+		sim.ec_writes++;
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%d\n", d[0]);
+		writefile(sim.ledfile, buf);
+	} else {
+		snprintf(what, whatsize, "command %#x", c->command);
+		c->result = EC_RES_INVALID_COMMAND;
+	}
+	if (c->result != EC_RES_SUCCESS)
+		n = 0;
+	if ((uint32_t) n > c->insize) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	return n;
+}
+
+static int sim_ioctl(int fd, unsigned long req, void *arg)
+{
+	if (_IOC_TYPE(req) == 'E') {
+		/* the lid switch, a FIFO so it can be polled */
+		uint8_t *bits = arg;
+		memset(bits, 0, _IOC_SIZE(req));
+		if (_IOC_NR(req) == _IOC_NR(EVIOCGBIT(EV_SW, 0)) || sim.lid)
+			bits[0] = 1 << SW_LID;
+		return _IOC_SIZE(req);
+	}
+	if (req != CROS_EC_DEV_IOCXCMD) {
+		errno = ENOTTY;
+		return -1;
+	}
+	sim.ec_commands++;
+	if (sim.ec_last >= 0 && (sim.ec_mingap < 0 || sim.now - sim.ec_last < sim.ec_mingap))
+		sim.ec_mingap = sim.now - sim.ec_last;
+	sim.ec_last = sim.now;
+	char what[64];
+	int r = fake_ec(arg, what, sizeof(what));
+	if (sim.eclog != NULL)
+		fprintf(sim.eclog, "%10.3f %s -> %d\n", sim.now / 1000.0, what,
+				r < 0 ? -errno : (int) ((struct cros_ec_command *) arg)->result);
+	return r;
+}
+
+static int parse_ints(const char *s, int *v, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		char *e;
+		v[i] = strtol(s, &e, 0);
+		if (e == s || (i < n - 1 && *e != ',') || (i == n - 1 && *e))
+			return 1;
+		s = e + 1;
+	}
+	return 0;
+}
+
+static void report(double wall)
+{
+	account_led(sim.now);
+	finish_step();
+
+	double secs = sim.now / 1000.0;
+	printf("simulated %.1f s in %.3f s (%.0fx real time)\n",
+			secs, wall, wall > 0 ? secs / wall : 0);
+	printf("wakeups: %llu total, %llu sample, %llu fade, %llu idle, %llu keyboard (%.3f/s)\n",
+			sim.wakeups_sample + sim.wakeups_fade + sim.wakeups_idle + sim.wakeups_key,
+			sim.wakeups_sample, sim.wakeups_fade, sim.wakeups_idle, sim.wakeups_key,
+			secs > 0 ? (sim.wakeups_sample + sim.wakeups_fade + sim.wakeups_idle + sim.wakeups_key) / secs : 0);
+	printf("keyboard activity signals: %llu\n", sim.signals);
+	if (sim.lid_period)
+		printf("lid closed %llu times, %llu switch wakeups, %llu other wakeups while closed\n",
+				sim.lid_closes, sim.wakeups_switch, sim.wakeups_closed);
+	if (sim.pw_period)
+		printf("charger unplugged %llu times, %llu power supply uevents, %llu supply wakeups, "
+				"%.1f s on the battery profile\n",
+				sim.unplugs, sim.uevents, sim.wakeups_power, sim.saving_ms / 1000.0);
+	printf("led writes: %llu, value changes: %llu\n", sim.led_writes, sim.led_changes);
+	printf("time per brightness level:\n");
+	int i;
+	for (i = 0; i <= SIM_LED_MAX; i++)
+		if (sim.led_time[i])
+			printf("  %3d: %10.1f s %5.1f%%\n", i, sim.led_time[i] / 1000.0,
+					100.0 * sim.led_time[i] / (sim.now ? sim.now : 1));
+	/* through sysfs, the drivers send a host command per access */
+	unsigned long long cmds = sim.ec ? sim.ec_commands : stats[ST_LUX_READS] + stats[ST_LED_WRITES];
+	printf("EC host commands: %llu (%.3f/s)", cmds, secs > 0 ? cmds / secs : 0);
+	if (sim.ec)
+		printf(", %llu sensor reads, %llu PWM writes, %llu probes, min gap %lld ms",
+				sim.ec_reads, sim.ec_writes, sim.ec_probes, sim.ec_mingap);
+	printf("\n");
+	printf("lighting steps: %llu, responded: %llu\n", sim.steps, sim.steps_responded);
+	if (sim.steps_responded)
+		printf("  first response: avg %.1f s, max %.1f s\n"
+				"  settled: avg %.1f s, max %.1f s\n",
+				sim.first_sum / 1000.0 / sim.steps_responded, sim.first_max / 1000.0,
+				sim.settle_sum / 1000.0 / sim.steps_responded, sim.settle_max / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *config = NULL;
+	long long duration = 0;
+	int c;
+	int v[4];
+	while ((c = getopt(argc, argv, "l:s:k:t:g:b:d:j:c:e:vh")) > 0)
+		switch (c) {
+		case 'l':
+			load_lux_trace(optarg);
+			break;
+		case 's':
+			if (parse_ints(optarg, v, 4) || v[2] <= 0) {
+				fprintf(stderr, "bad synthetic lux spec %s\n", optarg);
+				return 1;
+			}
+			sim.synth = 1;
+			sim.synth_low = v[0];
+			sim.synth_high = v[1];
+			sim.synth_period = v[2] * 1000LL;
+			sim.synth_noise = v[3];
+			break;
+		case 'k':
+			load_key_trace(optarg);
+			break;
+		case 't':
+			if (parse_ints(optarg, v, 2) || v[0] <= 0 || v[1] < 0) {
+				fprintf(stderr, "bad typing spec %s\n", optarg);
+				return 1;
+			}
+			sim.type_active = v[0] * 1000LL;
+			sim.type_idle = v[1] * 1000LL;
+			break;
+		case 'g':
+			if (parse_ints(optarg, v, 2) || v[0] <= 0 || v[1] < 0 || v[1] > v[0]) {
+				fprintf(stderr, "bad lid spec %s\n", optarg);
+				return 1;
+			}
+			sim.lid_period = v[0] * 1000LL;
+			sim.lid_closed = v[1] * 1000LL;
+			break;
+		case 'b':
+			if (parse_ints(optarg, v, 4) || v[0] <= 0 || v[1] < 0 || v[1] > v[0] ||
+					v[2] < 0 || v[3] < 0 || v[3] > 100) {
+				fprintf(stderr, "bad charger spec %s\n", optarg);
+				return 1;
+			}
+			sim.pw_period = v[0] * 1000LL;
+			sim.pw_unplugged = v[1] * 1000LL;
+			sim.pw_drain = v[2] * 1000LL;
+			sim.pw_capacity = v[3];
+			sim.pw_online = !on_at(0, sim.pw_period, sim.pw_unplugged);
+			break;
+		case 'd':
+			duration = atoll(optarg) * 1000;
+			break;
+		case 'j':
+			sim.steplux = atoi(optarg);
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'e':
+			sim.ec = 1;
+			if (strcmp(optarg, "-")) {
+				sim.eclog = fopen(optarg, "w");
+				if (sim.eclog == NULL)
+					die(optarg);
+			}
+			break;
+		case 'v':
+			sim.verbose = 1;
+			break;
+		default:
+			print_help(argc == 0 ? "pbkbd-backlight-sim" : argv[0]);
+			return c != 'h';
+		}
+	if (duration)
+		sim.end = duration;
+	if (!sim.end) {
+		fprintf(stderr, "no duration, give traces or -d\n");
+		return 1;
+	}
+
+	setup_tree();
+	sim.last_notify = -1;
+	sim.curlux = 0;
+	advance(0);
+
+	char ledpath[PATH_MAX + 8], iiopath[PATH_MAX + 8], pidpath[PATH_MAX + 8];
+	char cfgpath[PATH_MAX + 32];
+	snprintf(ledpath, sizeof(ledpath), "%s/led", sim.root);
+	snprintf(iiopath, sizeof(iiopath), "%s/iio", sim.root);
+	snprintf(pidpath, sizeof(pidpath), "%s/pid", sim.root);
+	kbdbl_path = ledpath;
+	iiodevs_path = iiopath;
+	crosec_path = sim.ecfile;
+	input_path = sim.root;
+	sysinput_path = sim.root;
+	power_path = sim.powerdir;
+	char swpath[PATH_MAX + 8];
+	snprintf(swpath, sizeof(swpath), "%s/event0", sim.root);
+	if (sim.lid_period && mkfifo(swpath, 0644))
+		die(swpath);
+	pidfile_path = pidpath;
+	char statepath[PATH_MAX + 8];
+	snprintf(statepath, sizeof(statepath), "%s/state", sim.root);
+	state_path = statepath;
+	/* the built-in curve unless a config is given */
+	snprintf(cfgpath, sizeof(cfgpath), "%s/pbkbd-backlight.conf", sim.root);
+
+	char *dargv[] = { "pbkbd-backlight", "-c", (char *) (config ? config : cfgpath),
+		sim.ec ? "-e" : NULL, NULL };
+	optind = 1;
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int r = pbkbd_backlight_main(sim.ec ? 4 : 3, dargv);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	check_led();
+
+	report((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	if (sim.eclog != NULL)
+		fclose(sim.eclog);
+	cleanup_tree();
+	return r;
+}
@@ -3,16 +3,39 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "crosec.h"
+#include "pbpower.h"
+#include "pbstate.h"
+#include "pbstats.h"
+#include "pbswitch.h"
+#include "sdnotify.h"
+#include "sysfs.h"
+#ifdef PB_COMBINED
+# include "pbmodules.h"
+#endif
+
 #define KBDBL "/sys/class/leds/chromeos::kbd_backlight"
 #define IIODEVS "/sys/bus/iio/devices"
+#define INPUTPATH "/dev/input"
+#define SYSINPUTPATH "/sys/class/input"
+#define POWERPATH PBPOWER_DIR
+#define PIDFILE "/run/pbkbd-backlight.pid"
+#define STATSFILE "/run/pbkbd-backlight.stats"
+#define STATS_PERIOD (3600 * 1000)
+
+#define CONFIGDIR "/etc"
+#define CONFIGNAME "pbkbd-backlight.conf"
 
 #define LIGHT_NAME "cros-ec-light"
 #define LIGHT_PROP "in_illuminance_input"
@@ -20,6 +43,7 @@
 #define AVGPERIOD 10
 #define SAMPLERATE 5
 #define INACTIVE_TIMEOUT 10
+#define SCALE_STEP 0.05 /* per sample, moving between the curves */
 #define ENABLE_TIMEOUT 1
 
 #define DEBUG(...)
@@ -34,29 +58,84 @@ struct lux_mapping_entry {
 	double bri;
 };
 
-const struct lux_mapping_entry lux_mapping[] = {
-	{ 0, 0.1 },
-	{ 1, 0.3 },
-	{ 5, 0.8 },
-	{ 10, 1 }
+#define MAX_MAPPING 32
+#define MAX_THRESHOLD 1000 /* bounds the lookup table to AVGPERIOD * SAMPLERATE * 1000 entries */
+
+struct config {
+	struct lux_mapping_entry lux_mapping[MAX_MAPPING];
+	size_t lux_mapping_size;
+	double disable_threshold;
+	double reenable_threshold; /* lux must fall below this to reenable lights */
+	int inactive_timeout;
+	/* the battery profile, at or below battery_threshold percent on battery */
+	int battery_threshold;
+	double battery_scale; /* of the curve */
+	int battery_inactive_timeout;
+	int battery_samplerate;
 };
-const size_t lux_mapping_size = sizeof(lux_mapping) / sizeof(struct lux_mapping_entry);
-#define LUX(i) lux_mapping[i].lux
-#define BRI(i) lux_mapping[i].bri
-const double disable_threshold = 10;
-const double reenable_threshold = 5; /* lux must fall below this to reenable lights */
+
+static const struct config default_config = {
+	.lux_mapping = {
+		{ 0, 0.1 },
+		{ 1, 0.3 },
+		{ 5, 0.8 },
+		{ 10, 1 }
+	},
+	.lux_mapping_size = 4,
+	.disable_threshold = 10,
+	.reenable_threshold = 5,
+	.inactive_timeout = INACTIVE_TIMEOUT,
+	.battery_threshold = PBPOWER_THRESHOLD,
+	.battery_scale = 0.5,
+	.battery_inactive_timeout = 5,
+	.battery_samplerate = 2
+};
+
+#define LUX(i) cfg->lux_mapping[i].lux
+#define BRI(i) cfg->lux_mapping[i].bri
 
 #define ROUND(d) ((long long) ((d) + 0.5))
+#define LED_OFF -1 /* 0 only dims the lights */
+
+enum {
+	ST_WAKE_TIMER,
+	ST_WAKE_CONFIG,
+	ST_WAKE_SIGNAL,
+	ST_WAKE_WATCHDOG,
+	ST_WAKE_SWITCH,
+	ST_LUX_READS,
+	ST_LED_WRITES,
+	ST_OPENS,
+	ST_CONFIG_STATS,
+	ST_ACTIVITY,
+	ST_SIGNALS,
+	ST_EC_ERRORS,
+	ST_WAKE_POWER,
+	ST_MAX
+};
+static unsigned long long stats[ST_MAX];
+#define COUNT(st) (stats[st]++)
 
-static double get_bl(double lux)
+/* overridable for running against fake sysfs trees */
+static const char *kbdbl_path = KBDBL;
+static const char *iiodevs_path = IIODEVS;
+static const char *crosec_path = CROS_EC_DEV;
+#ifndef PB_COMBINED
+static const char *input_path = INPUTPATH;
+static const char *sysinput_path = SYSINPUTPATH;
+static const char *power_path = POWERPATH;
+#endif
+static const char *state_path = PBSTATE_KBDBL;
+
+static double get_bl(const struct config *cfg, double lux)
 {
 	size_t i;
-	for (i = 0; i < lux_mapping_size; i++)
+	for (i = 0; i < cfg->lux_mapping_size; i++)
 		if (LUX(i) >= lux)
 			break;
-	if (i >= lux_mapping_size)
+	if (i >= cfg->lux_mapping_size)
 		return 0;
-	if (LUX(i) == lux)
+	if (LUX(i) == lux || i == 0)
 		return BRI(i);
 	double r = (lux - LUX(i - 1)) *
 		(BRI(i) - BRI(i - 1)) /
@@ -67,8 +146,175 @@ static double get_bl(double lux)
 	return r;
 }
 
+/*
+ * The filter keeps the integer sum of the last AVGPERIOD * SAMPLERATE raw
+ * samples, so every reachable average is sum / avgsz. The curve is
+ * precomputed for every sum below the disable threshold and looked up by
+ * the sum directly.
+ */
+struct bl_table {
+	double *bri;
+	long long disable_sum; /* table size, sums at or above this disable lights */
+	long long reenable_sum; /* sums at or below this reenable lights */
+	int inactive_timeout;
+	int battery_threshold;
+	double battery_scale;
+	int battery_inactive_timeout;
+	int battery_samplerate;
+};
+
+static int build_table(struct bl_table *t, const struct config *cfg, size_t avgsz)
+{
+	long long dsum = (long long) (cfg->disable_threshold * avgsz);
+	if (dsum < cfg->disable_threshold * avgsz)
+		dsum++;
+	double *bri = malloc(sizeof(double) * (dsum > 0 ? dsum : 1));
+	if (bri == NULL)
+		return 1;
+	long long i;
+	for (i = 0; i < dsum; i++)
+		bri[i] = get_bl(cfg, (double) i / avgsz);
+	free(t->bri);
+	t->bri = bri;
+	t->disable_sum = dsum;
+	t->reenable_sum = (long long) (cfg->reenable_threshold * avgsz);
+	t->inactive_timeout = cfg->inactive_timeout;
+	t->battery_threshold = cfg->battery_threshold;
+	t->battery_scale = cfg->battery_scale;
+	t->battery_inactive_timeout = cfg->battery_inactive_timeout;
+	t->battery_samplerate = cfg->battery_samplerate;
+	return 0;
+}
+
+static char *strip(char *s)
+{
+	char *c = strchr(s, '#');
+	if (c != NULL)
+		*c = 0;
+	while (*s == ' ' || *s == '\t')
+		s++;
+	char *e = s + strlen(s);
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\n' || e[-1] == '\r'))
+		e--;
+	*e = 0;
+	return s;
+}
+
+static int validate_config(const struct config *cfg, const char *path)
+{
+	size_t i;
+	if (cfg->lux_mapping_size == 0) {
+		fprintf(stderr, "%s: no mapping points\n", path);
+		return 1;
+	}
+	for (i = 0; i < cfg->lux_mapping_size; i++) {
+		if (LUX(i) < 0 || (i > 0 && LUX(i) <= LUX(i - 1))) {
+			fprintf(stderr, "%s: mapping lux must be increasing and non-negative\n", path);
+			return 1;
+		}
+		if (!(BRI(i) >= 0 && BRI(i) <= 1)) {
+			fprintf(stderr, "%s: mapping brightness must be within 0 and 1\n", path);
+			return 1;
+		}
+	}
+	if (!(cfg->disable_threshold > 0 && cfg->disable_threshold <= MAX_THRESHOLD)) {
+		fprintf(stderr, "%s: disable_threshold must be within 0 and %d\n", path, MAX_THRESHOLD);
+		return 1;
+	}
+	if (!(cfg->reenable_threshold >= 0 &&
+				cfg->reenable_threshold <= cfg->disable_threshold)) {
+		fprintf(stderr, "%s: reenable_threshold must be within 0 and disable_threshold\n", path);
+		return 1;
+	}
+	if (cfg->inactive_timeout < 0) {
+		fprintf(stderr, "%s: inactive_timeout must not be negative\n", path);
+		return 1;
+	}
+	if (cfg->battery_threshold < 0 || cfg->battery_threshold > 100) {
+		fprintf(stderr, "%s: battery_threshold must be within 0 and 100\n", path);
+		return 1;
+	}
+	if (!(cfg->battery_scale >= 0 && cfg->battery_scale <= 1)) {
+		fprintf(stderr, "%s: battery_scale must be within 0 and 1\n", path);
+		return 1;
+	}
+	if (cfg->battery_inactive_timeout < 0) {
+		fprintf(stderr, "%s: battery_inactive_timeout must not be negative\n", path);
+		return 1;
+	}
+	if (cfg->battery_samplerate < 1 || cfg->battery_samplerate > SAMPLERATE) {
+		fprintf(stderr, "%s: battery_samplerate must be within 1 and %d\n", path, SAMPLERATE);
+		return 1;
+	}
+	return 0;
+}
+
+/* returns 0 on success, -1 if the file does not exist, 1 on invalid config */
+static int load_config(struct config *cfg, const char *path)
+{
+	COUNT(ST_OPENS);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return errno == ENOENT ? -1 : 1;
+
+	struct config c = default_config;
+	c.lux_mapping_size = 0;
+	int ret = 0;
+	unsigned lineno = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		char *l = strip(line);
+		if (!*l)
+			continue;
+		double a, b;
+		int n;
+		char extra;
+		if (sscanf(l, "point %lf %lf %c", &a, &b, &extra) == 2) {
+			if (c.lux_mapping_size >= MAX_MAPPING) {
+				fprintf(stderr, "%s:%u: too many mapping points\n", path, lineno);
+				ret = 1;
+				break;
+			}
+			c.lux_mapping[c.lux_mapping_size].lux = a;
+			c.lux_mapping[c.lux_mapping_size].bri = b;
+			c.lux_mapping_size++;
+		} else if (sscanf(l, "disable_threshold %lf %c", &a, &extra) == 1) {
+			c.disable_threshold = a;
+		} else if (sscanf(l, "reenable_threshold %lf %c", &a, &extra) == 1) {
+			c.reenable_threshold = a;
+		} else if (sscanf(l, "inactive_timeout %d %c", &n, &extra) == 1) {
+			c.inactive_timeout = n;
+		} else if (sscanf(l, "battery_threshold %d %c", &n, &extra) == 1) {
+			c.battery_threshold = n;
+		} else if (sscanf(l, "battery_scale %lf %c", &a, &extra) == 1) {
+			c.battery_scale = a;
+		} else if (sscanf(l, "battery_inactive_timeout %d %c", &n, &extra) == 1) {
+			c.battery_inactive_timeout = n;
+		} else if (sscanf(l, "battery_samplerate %d %c", &n, &extra) == 1) {
+			c.battery_samplerate = n;
+		} else {
+			fprintf(stderr, "%s:%u: cannot parse '%s'\n", path, lineno, l);
+			ret = 1;
+			break;
+		}
+	}
+	fclose(f);
+
+	if (!ret && c.lux_mapping_size == 0) {
+		memcpy(c.lux_mapping, default_config.lux_mapping, sizeof(c.lux_mapping));
+		c.lux_mapping_size = default_config.lux_mapping_size;
+	}
+	if (!ret)
+		ret = validate_config(&c, path);
+	if (!ret)
+		*cfg = c;
+	return ret;
+}
+
 static long long readnum(int d, const char *path)
 {
+	COUNT(ST_OPENS);
 	int f = openat(d, path, O_RDONLY);
 	if (f < 0)
 		return -1;
@@ -80,34 +326,36 @@ static long long readnum(int d, const char *path)
 	return r;
 }
 
-static int writenum(int d, const char *path, long long n)
-{
-	int f = openat(d, path, O_WRONLY);
-	if (f < 0)
-		return -1;
-	int r = 0;
-	if (dprintf(f, "%lld", n) < 0)
-		r = -1;
-	close(f);
-	return r;
-}
+static struct sysattr led_brightness;
+static long long led_max = -1;
 
 static void set_backlight(double v)
 {
-	int d = open(KBDBL, O_RDONLY | O_SEARCH);
-	if (d < 0)
-		return;
-
-	long long bri = readnum(d, "max_brightness");
-	if (bri < 0)
-		goto exit_close_d;
-	long long wv = ROUND(v * bri);
+	if (led_max < 0) {
+		COUNT(ST_OPENS);
+		int d = open(kbdbl_path, O_RDONLY | O_SEARCH);
+		if (d < 0)
+			return;
+		led_max = readnum(d, "max_brightness");
+		sysattr_init(&led_brightness, d, "brightness", O_WRONLY);
+		COUNT(ST_OPENS);
+		sysattr_open(&led_brightness);
+		close(d);
+		if (led_max < 0 || led_brightness.fd < 0) {
+			sysattr_close(&led_brightness);
+			led_max = -1;
+			return;
+		}
+	}
+	long long wv = ROUND(v * led_max);
 	if (wv <= 0)
-		wv = 1;
-	writenum(d, "brightness", wv);
-
-exit_close_d:
-	close(d);
+		wv = v == LED_OFF ? 0 : 1;
+	/* the handle cannot be reopened without the directory, start over next time */
+	COUNT(ST_LED_WRITES);
+	if (sysattr_write(&led_brightness, wv)) {
+		sysattr_close(&led_brightness);
+		led_max = -1;
+	}
 }
 
 static int check_sensor(int d)
@@ -129,7 +377,7 @@ static int check_sensor(int d)
 
 static int find_sensor(void)
 {
-	DIR *dd = opendir(IIODEVS);
+	DIR *dd = opendir(iiodevs_path);
 	if (dd == NULL)
 		return -1;
 
@@ -154,9 +402,577 @@ static int find_sensor(void)
 	return ret;
 }
 
+/*
+ * Where lux comes from and where the LED level goes. Through sysfs, the IIO
+ * and LED drivers send an EC host command for every access. The cros_ec
+ * backend sends them itself: one sensor read and at most one PWM write per
+ * control cycle, levels the EC already has are not sent again.
+ */
+struct backend {
+	int (*open)(void); /* nonzero if unavailable */
+	int (*lux)(void); /* -1 on errors */
+	void (*led)(double v);
+	void (*resync)(void); /* the level may have changed behind our back, NULL if always sent */
+	void (*close)(void);
+};
+
+static int sensor_dir = -1;
+static struct sysattr sensor_lux;
+
+static int sysfs_open(void)
+{
+	sensor_dir = find_sensor();
+	if (sensor_dir < 0)
+		return 1;
+	sysattr_init(&sensor_lux, sensor_dir, LIGHT_PROP, O_RDONLY);
+	return 0;
+}
+
+static int sysfs_lux(void)
+{
+	if (sensor_lux.fd < 0)
+		COUNT(ST_OPENS);
+	return sysattr_read(&sensor_lux);
+}
+
+static void sysfs_close(void)
+{
+	sysattr_close(&sensor_lux);
+	close(sensor_dir);
+	sensor_dir = -1;
+}
+
+static const struct backend sysfs_backend = {
+	.open = sysfs_open,
+	.lux = sysfs_lux,
+	.led = set_backlight,
+	.close = sysfs_close,
+};
+
+static int ec_fd = -1;
+static int ec_sensor = -1;
+static int ec_percent = -1; /* last level the EC took */
+
+/* returns the response length, -1 on errors */
+static int ec_command(unsigned cmd, unsigned version, const void *out, size_t outsize,
+		void *in, size_t insize)
+{
+	union {
+		struct cros_ec_command c;
+		uint8_t buf[sizeof(struct cros_ec_command) + 32];
+	} m;
+	size_t room = sizeof(m) - sizeof(struct cros_ec_command);
+	if (outsize > room || insize > room)
+		return -1;
+	m.c.version = version;
+	m.c.command = cmd;
+	m.c.outsize = outsize;
+	/* a response longer than expected would fail the transfer */
+	m.c.insize = room;
+	m.c.result = 0;
+	if (outsize)
+		memcpy(m.c.data, out, outsize);
+	int r = ioctl(ec_fd, CROS_EC_DEV_IOCXCMD, &m);
+	if (r < 0 || m.c.result != EC_RES_SUCCESS || (size_t) r < insize) {
+		COUNT(ST_EC_ERRORS);
+		return -1;
+	}
+	if (insize)
+		memcpy(in, m.c.data, insize);
+	return r;
+}
+
+static int ec_motion_sense(uint8_t cmd, uint8_t arg, void *in, size_t insize)
+{
+	struct ec_params_motion_sense p = {
+		.cmd = cmd,
+		.sensor_num = arg
+	};
+	return ec_command(EC_CMD_MOTION_SENSE_CMD, 1, &p, sizeof(p), in, insize);
+}
+
+static int ec_open(void)
+{
+	COUNT(ST_OPENS);
+	ec_fd = open(crosec_path, O_RDWR | O_CLOEXEC);
+	if (ec_fd < 0)
+		return 1;
+	struct ec_response_motion_sense_dump dump;
+	if (ec_motion_sense(MOTIONSENSE_CMD_DUMP, 0, &dump, sizeof(dump)) >= 0) {
+		int i;
+		for (i = 0; i < dump.sensor_count; i++) {
+			struct ec_response_motion_sense_info info;
+			if (ec_motion_sense(MOTIONSENSE_CMD_INFO, i, &info, sizeof(info)) >= 0 &&
+					info.type == MOTIONSENSE_TYPE_LIGHT) {
+				ec_sensor = i;
+				ec_percent = -1;
+				return 0;
+			}
+		}
+	}
+	close(ec_fd);
+	ec_fd = -1;
+	return 1;
+}
+
+static int ec_lux(void)
+{
+	struct ec_response_motion_sensor_data d;
+	if (ec_motion_sense(MOTIONSENSE_CMD_DATA, ec_sensor, &d, sizeof(d)) < 0)
+		return -1;
+	return d.data[0];
+}
+
+static void ec_led(double v)
+{
+	long long percent = ROUND(v * 100);
+	if (percent <= 0)
+		percent = v == LED_OFF ? 0 : 1;
+	if (percent > 100)
+		percent = 100;
+	if (percent == ec_percent)
+		return;
+	struct ec_params_pwm_set_keyboard_backlight p = {
+		.percent = percent
+	};
+	COUNT(ST_LED_WRITES);
+	ec_percent = ec_command(EC_CMD_PWM_SET_KEYBOARD_BACKLIGHT, 0, &p, sizeof(p), NULL, 0) < 0 ?
+		-1 : percent;
+}
+
+static void ec_resync(void)
+{
+	ec_percent = -1;
+}
+
+static void ec_close(void)
+{
+	close(ec_fd);
+	ec_fd = -1;
+}
+
+static const struct backend ec_backend = {
+	.open = ec_open,
+	.lux = ec_lux,
+	.led = ec_led,
+	.resync = ec_resync,
+	.close = ec_close,
+};
+
+static const struct backend *backend = &sysfs_backend;
+
+/* kernels without CONFIG_CROS_EC_CHARDEV still have the sysfs drivers */
+static int backend_open(void)
+{
+	if (!backend->open())
+		return 0;
+	if (backend != &ec_backend)
+		return 1;
+	fprintf(stderr, "cannot use %s, falling back to sysfs\n", crosec_path);
+	backend = &sysfs_backend;
+	return backend->open();
+}
+
+static const char *config_path = CONFIGDIR "/" CONFIGNAME;
+static struct stat config_stat;
+
+static int config_changed(void)
+{
+	struct stat st;
+	COUNT(ST_CONFIG_STATS);
+	if (stat(config_path, &st))
+		memset(&st, 0, sizeof(st));
+	int r = st.st_ino != config_stat.st_ino ||
+		st.st_size != config_stat.st_size ||
+		st.st_mtim.tv_sec != config_stat.st_mtim.tv_sec ||
+		st.st_mtim.tv_nsec != config_stat.st_mtim.tv_nsec;
+	config_stat = st;
+	return r;
+}
+
+static int reload_config(struct bl_table *t, size_t avgsz)
+{
+	struct config cfg = default_config;
+	int r = load_config(&cfg, config_path);
+	if (r > 0) {
+		fprintf(stderr, "invalid config %s, keeping current curve\n", config_path);
+		return 1;
+	}
+	return build_table(t, &cfg, avgsz);
+}
+
+/* watch the directory so editors replacing the file are noticed too */
+static int watch_config(void)
+{
+	int w = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (w < 0)
+		return -1;
+	char dir[PATH_MAX];
+	strncpy(dir, config_path, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = 0;
+	char *sl = strrchr(dir, '/');
+	if (sl == NULL)
+		strcpy(dir, ".");
+	else if (sl == dir)
+		sl[1] = 0;
+	else
+		*sl = 0;
+	if (inotify_add_watch(w, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+				IN_CREATE | IN_DELETE) < 0) {
+		close(w);
+		return -1;
+	}
+	return w;
+}
+
+static int config_event(int w)
+{
+	const char *name = strrchr(config_path, '/');
+	name = name == NULL ? config_path : name + 1;
+	int r = 0;
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t s;
+	while ((s = read(w, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf + s) {
+			struct inotify_event *ev = (struct inotify_event *) p;
+			if (ev->len && !strcmp(ev->name, name))
+				r = 1;
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	return r;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* ms spent suspended since boot */
+static long long slept_ms(void)
+{
+	struct timespec b, m;
+	clock_gettime(CLOCK_BOOTTIME, &b);
+	clock_gettime(CLOCK_MONOTONIC, &m);
+	return (b.tv_sec - m.tv_sec) * 1000LL + (b.tv_nsec - m.tv_nsec) / 1000000;
+}
+
+enum {
+	ACTIVE = PBSTATE_KBD_ACTIVE,
+	FADING = PBSTATE_KBD_FADING,
+	IDLE = PBSTATE_KBD_IDLE,
+	GATED = PBSTATE_KBD_GATED, /* lid closed or tablet mode */
+};
+
+struct kbdbl {
+	const struct backend *be; /* opened */
+	struct bl_table table;
+	size_t avgsz;
+	int luxbuf[AVGPERIOD * SAMPLERATE];
+	int bufidx;
+	long long bufsum;
+	int waitenable;
+	int state;
+	time_t timeout;
+	double lastbl;
+	double fadebl;
+	double led; /* last level set, LED_OFF while off */
+	long long next; /* monotonic ms of the next step, -1 while idle */
+	long long slept; /* slept_ms() at the last resync */
+	int online; /* power supply state as pbpower reads it */
+	int capacity;
+	int saving; /* on the battery profile */
+	double scale; /* of the curve, moving toward the profile's */
+};
+
+static int kbdbl_timeout(const struct kbdbl *k)
+{
+	return k->saving ? k->table.battery_inactive_timeout : k->table.inactive_timeout;
+}
+
+static int kbdbl_init(struct kbdbl *k, const struct backend *be)
+{
+	memset(k, 0, sizeof(*k));
+	k->avgsz = AVGPERIOD * SAMPLERATE;
+	config_changed();
+	if (reload_config(&k->table, k->avgsz))
+		return 1;
+	k->be = be;
+	k->state = ACTIVE;
+	k->timeout = time(NULL) + k->table.inactive_timeout;
+	k->next = now_ms();
+	k->online = 1;
+	k->capacity = -1;
+	k->scale = 1;
+	k->slept = slept_ms();
+	return 0;
+}
+
+static void kbdbl_free(struct kbdbl *k)
+{
+	free(k->table.bri);
+}
+
+static struct pbstate_kbdbl *state_page = NULL;
+
+static void kbdbl_publish(const struct kbdbl *k)
+{
+	struct pbstate_kbdbl *p = state_page;
+	if (p == NULL)
+		return;
+	pbstate_begin(&p->h);
+	p->state = k->state;
+	p->lux_raw = k->luxbuf[k->bufidx > 0 ? (size_t) k->bufidx - 1 : k->avgsz - 1];
+	p->lux_filtered = (double) k->bufsum / k->avgsz;
+	p->led = k->led;
+	p->disabled = k->waitenable;
+	p->wakeups = stats[ST_WAKE_TIMER] + stats[ST_WAKE_CONFIG] + stats[ST_WAKE_SIGNAL] +
+		stats[ST_WAKE_WATCHDOG] + stats[ST_WAKE_SWITCH] + stats[ST_WAKE_POWER];
+	p->lux_reads = stats[ST_LUX_READS];
+	p->led_writes = stats[ST_LED_WRITES];
+	p->activity = stats[ST_ACTIVITY];
+	p->ec_errors = stats[ST_EC_ERRORS];
+	p->saving = k->saving;
+	p->capacity = k->capacity;
+	pbstate_end(&p->h);
+}
+
+static void kbdbl_led(struct kbdbl *k, double v)
+{
+	k->be->led(v);
+	k->led = v;
+}
+
+/* the LED core restores its own level on resume and others may write it while idle */
+static void kbdbl_resync(struct kbdbl *k)
+{
+	k->slept = slept_ms();
+	if (k->be->resync != NULL)
+		k->be->resync();
+}
+
+static void kbdbl_sample(struct kbdbl *k)
+{
+	COUNT(ST_LUX_READS);
+	int lux = k->be->lux();
+	k->bufsum -= k->luxbuf[k->bufidx];
+	k->luxbuf[k->bufidx] = lux;
+	k->bufsum += lux;
+	DEBUG("read raw %d into idx %d sum %lld avg %lf\n", lux, k->bufidx, k->bufsum, (double) k->bufsum / k->avgsz);
+	if (k->bufidx == k->avgsz - 1)
+		k->bufidx = 0;
+	else
+		k->bufidx += 1;
+	double scale = k->saving ? k->table.battery_scale : 1;
+	if (k->scale < scale - SCALE_STEP)
+		k->scale += SCALE_STEP;
+	else if (k->scale > scale + SCALE_STEP)
+		k->scale -= SCALE_STEP;
+	else
+		k->scale = scale;
+	if (!k->waitenable || k->bufsum <= k->table.reenable_sum) {
+		double bl = 0;
+		if (k->bufsum >= k->table.disable_sum) {
+			k->waitenable = 1;
+		} else {
+			k->waitenable = 0;
+			bl = k->table.bri[k->bufsum > 0 ? k->bufsum : 0] * k->scale;
+		}
+		kbdbl_led(k, bl);
+		k->lastbl = bl;
+	}
+}
+
+/* runs the step that is due and schedules the next one */
+static void kbdbl_step(struct kbdbl *k, long long now)
+{
+	if (slept_ms() - k->slept > 1000) {
+		DEBUG("resumed\n");
+		kbdbl_resync(k);
+	}
+	if (k->state == ACTIVE && ENABLE_TIMEOUT &&
+			kbdbl_timeout(k) > 0 && k->timeout < time(NULL)) {
+		DEBUG("IDLE detected\n");
+		k->state = FADING;
+		k->fadebl = k->lastbl;
+	}
+	switch (k->state) {
+	case ACTIVE:
+		kbdbl_sample(k);
+		k->next = now + 1000 / (k->saving ? k->table.battery_samplerate : SAMPLERATE);
+		break;
+	case FADING:
+		if (k->fadebl > 0) {
+			kbdbl_led(k, k->fadebl);
+			k->fadebl -= 0.01;
+			k->next = now + 10;
+			break;
+		}
+		kbdbl_led(k, 0.01);
+		k->state = IDLE;
+		/* fall through */
+	default:
+		k->next = -1;
+	}
+	kbdbl_publish(k);
+}
+
+static void kbdbl_activity(struct kbdbl *k)
+{
+	COUNT(ST_ACTIVITY);
+	k->timeout = time(NULL) + kbdbl_timeout(k);
+	if (k->state != ACTIVE && k->state != GATED) {
+		DEBUG("leaving IDLE\n");
+		kbdbl_resync(k);
+		k->state = ACTIVE;
+		k->next = now_ms();
+	}
+	kbdbl_publish(k);
+}
+
+/* lights off and no sampling while gated, the last level is back at once after */
+static void kbdbl_gate(struct kbdbl *k, int gated)
+{
+	if (gated && k->state != GATED) {
+		DEBUG("gated\n");
+		kbdbl_led(k, LED_OFF);
+		k->state = GATED;
+		k->next = -1;
+	} else if (!gated && k->state == GATED) {
+		DEBUG("ungated\n");
+		kbdbl_resync(k);
+		kbdbl_led(k, k->lastbl);
+		k->state = ACTIVE;
+		k->timeout = time(NULL) + kbdbl_timeout(k);
+		k->next = now_ms();
+	}
+	kbdbl_publish(k);
+}
+
+/* picks the profile for the supply state, the curve follows over the next samples */
+static void kbdbl_profile(struct kbdbl *k)
+{
+	int saving = !k->online && k->capacity >= 0 && k->capacity <= k->table.battery_threshold;
+	if (saving == k->saving)
+		return;
+	DEBUG("%s battery profile\n", saving ? "entering" : "leaving");
+	k->saving = saving;
+	time_t t = time(NULL) + kbdbl_timeout(k);
+	if (k->state == ACTIVE && t < k->timeout)
+		k->timeout = t;
+	kbdbl_publish(k);
+}
+
+static void kbdbl_power(struct kbdbl *k, int online, int capacity)
+{
+	k->online = online;
+	k->capacity = capacity;
+	kbdbl_profile(k);
+}
+
+static void kbdbl_config_event(struct kbdbl *k, int w)
+{
+	if (config_event(w) && config_changed() && !reload_config(&k->table, k->avgsz))
+		kbdbl_profile(k);
+}
+
+#ifdef PB_COMBINED
+static struct kbdbl module;
+static int module_watcher = -1;
+
+void kbdbl_module_use_ec(void)
+{
+	backend = &ec_backend;
+}
+
+int kbdbl_module_start(const char *config)
+{
+	if (config != NULL)
+		config_path = config;
+	if (backend_open())
+		return 1;
+	if (kbdbl_init(&module, backend)) {
+		backend->close();
+		return 1;
+	}
+	module_watcher = watch_config();
+	if ((state_page = pbstate_create(state_path, PBSTATE_KIND_KBDBL, sizeof(*state_page))) == NULL)
+		fprintf(stderr, "cannot create %s: %s\n", state_path, strerror(errno));
+	return 0;
+}
+
+int kbdbl_module_fd(void)
+{
+	return module_watcher;
+}
+
+long long kbdbl_module_deadline(void)
+{
+	return module.next;
+}
+
+void kbdbl_module_dispatch(long long now)
+{
+	if (module.next >= 0 && module.next <= now)
+		kbdbl_step(&module, now);
+}
+
+void kbdbl_module_config_event(void)
+{
+	kbdbl_config_event(&module, module_watcher);
+}
+
+void kbdbl_module_activity(void)
+{
+	kbdbl_activity(&module);
+}
+
+void kbdbl_module_gate(int gated)
+{
+	kbdbl_gate(&module, gated);
+}
+
+void kbdbl_module_power(int online, int capacity)
+{
+	kbdbl_power(&module, online, capacity);
+}
+
+void kbdbl_module_stop(void)
+{
+	if (module_watcher >= 0)
+		close(module_watcher);
+	pbstate_close(state_page, state_path);
+	state_page = NULL;
+	kbdbl_free(&module);
+	backend->close();
+}
+#else
+static const char *const stat_names[ST_MAX] = {
+	"wake_timer",
+	"wake_config",
+	"wake_signal",
+	"wake_watchdog",
+	"wake_switch",
+	"lux_reads",
+	"led_writes",
+	"file_opens",
+	"config_stats",
+	"activity",
+	"signals",
+	"ec_errors",
+	"wake_power",
+};
+static unsigned long long stats_last[ST_MAX];
+
+static const char *pidfile_path = PIDFILE;
+
 static int write_pidfile(void)
 {
-	FILE *f = fopen("/run/pbkbd-backlight.pid", "w");
+	FILE *f = fopen(pidfile_path, "w");
 	if (f == NULL)
 		return 1;
 	fprintf(f, "%d\n", (int) getpid());
@@ -166,107 +982,152 @@ static int write_pidfile(void)
 
 static void clean_pidfile(void)
 {
-	unlink("/run/pbkbd-backlight.pid");
+	unlink(pidfile_path);
 }
 
 static int keeploop = 1;
 static int update_timeout = 0;
+static volatile sig_atomic_t dumpstats = 0;
 
 static void sighandler(int sig)
 {
+	COUNT(ST_SIGNALS);
 	if (sig == SIGHUP) {
 		update_timeout = 1;
+	} else if (sig == SIGUSR1) {
+		dumpstats = 1;
 	} else {
 		keeploop = 0;
 	}
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+	int verbose = 0;
+	int c;
+	while ((c = getopt(argc, argv, "c:ev")) > 0)
+		switch (c) {
+		case 'c':
+			config_path = optarg;
+			break;
+		case 'e':
+			backend = &ec_backend;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-v] [-e] [-c config]\n",
+					argc == 0 ? "pbkbd-backlight" : argv[0]);
+			return 1;
+		}
+
 	if (write_pidfile()) {
 		puts("cannot write pidfile");
 		return 1;
 	}
 
-	int sensor = find_sensor();
+	if (backend_open())
+		return 1;
 
-	if (sensor < 0)
+	struct kbdbl k;
+	if (kbdbl_init(&k, backend))
 		return 1;
 
+	int watcher = watch_config();
+
+	if (state_path != NULL &&
+			(state_page = pbstate_create(state_path, PBSTATE_KIND_KBDBL, sizeof(*state_page))) == NULL)
+		fprintf(stderr, "cannot create %s: %s\n", state_path, strerror(errno));
+
+	struct pbswitch sw;
+	if (pbswitch_open(&sw, input_path, sysinput_path))
+		fprintf(stderr, "cannot watch lid and tablet mode\n");
+	kbdbl_gate(&k, pbswitch_gated(&sw));
+
+	struct pbpower pw;
+	if (pbpower_open(&pw, power_path))
+		fprintf(stderr, "cannot watch power supplies\n");
+	kbdbl_power(&k, pw.online, pw.capacity);
+
 	struct sigaction sa = {
 		.sa_handler = sighandler
 	};
 	sigaction(SIGHUP, &sa, NULL);
 	sigaction(SIGINT, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
 
-	const size_t avgsz = AVGPERIOD * SAMPLERATE;
-	int luxbuf[avgsz];
-	memset(luxbuf, 0, sizeof(luxbuf));
-	int bufidx = 0;
-	long long bufsum = 0;
+	struct sdwatchdog wd;
+	sdwatchdog_init(&wd);
+	sd_notify_send("READY=1");
 
-	int waitenable = 0;
-	time_t timeout = time(NULL) + INACTIVE_TIMEOUT;
-	double lastbl = 0;
+	struct pbstats st;
+	pbstats_init(&st, stat_names, stats, stats_last, ST_MAX);
 
+	struct pollfd pfd[3] = {
+		{ .fd = watcher, .events = POLLIN },
+		{ .fd = pbswitch_fd(&sw), .events = POLLIN },
+		{ .fd = pbpower_fd(&pw), .events = POLLIN },
+	};
 	while (keeploop) {
-		int lux = readnum(sensor, LIGHT_PROP);
-		bufsum -= luxbuf[bufidx];
-		luxbuf[bufidx] = lux;
-		bufsum += lux;
-		DEBUG("read raw %d into idx %d sum %lld avg %lf\n", lux, bufidx, bufsum, (double) bufsum / avgsz);
-		if (bufidx == avgsz - 1)
-			bufidx = 0;
-		else
-			bufidx += 1;
-		double alux = (double) bufsum / avgsz;
-		if (!waitenable || alux <= reenable_threshold) {
-			double bl = 0;
-			if (alux >= disable_threshold) {
-				waitenable = 1;
-			} else {
-				waitenable = 0;
-				bl = get_bl(alux);
+		long long now = now_ms();
+		if (k.next >= 0 && k.next <= now)
+			kbdbl_step(&k, now);
+		int ms = -1;
+		if (k.next >= 0)
+			ms = k.next > now ? k.next - now : 0;
+		ms = sdwatchdog_timeout(&wd, ms);
+		int r = poll(pfd, 3, ms);
+		if (r > 0) {
+			if (pfd[0].revents & POLLIN) {
+				COUNT(ST_WAKE_CONFIG);
+				kbdbl_config_event(&k, watcher);
+			}
+			if (pfd[1].revents & POLLIN) {
+				COUNT(ST_WAKE_SWITCH);
+				if (pbswitch_update(&sw))
+					kbdbl_gate(&k, pbswitch_gated(&sw));
 			}
-			set_backlight(bl);
-			lastbl = bl;
+			if (pfd[2].revents & POLLIN) {
+				COUNT(ST_WAKE_POWER);
+				if (pbpower_update(&pw))
+					kbdbl_power(&k, pw.online, pw.capacity);
+			}
+		} else if (r < 0) {
+			COUNT(ST_WAKE_SIGNAL);
+		} else if (k.next >= 0 && k.next <= now_ms()) {
+			COUNT(ST_WAKE_TIMER);
+		} else {
+			COUNT(ST_WAKE_WATCHDOG);
+		}
+
+		if (dumpstats) {
+			dumpstats = 0;
+			if (pbstats_write(&st, STATSFILE))
+				fprintf(stderr, "cannot write %s\n", STATSFILE);
 		}
-		struct timespec ts = {
-			.tv_nsec = 1000000000 / SAMPLERATE - 1
-		};
-		clock_nanosleep(CLOCK_REALTIME, 0, &ts, NULL);
+		if (verbose && pbstats_due(&st, STATS_PERIOD))
+			pbstats_summary(&st, stdout);
 
 		if (update_timeout) {
-			timeout = time(NULL) + INACTIVE_TIMEOUT;
 			update_timeout = 0;
-		}
-		if (ENABLE_TIMEOUT && timeout < time(NULL)) {
-			DEBUG("IDLE detected\n");
-			double bl;
-			for (bl = lastbl; bl > 0; bl -= 0.01) {
-				set_backlight(bl);
-				struct timespec ts = {
-					.tv_nsec = 10000000
-				};
-				clock_nanosleep(CLOCK_REALTIME, 0, &ts, NULL);
-			}
-			set_backlight(0.01);
-			if (!update_timeout && keeploop)
-				pause();
-			DEBUG("leaving IDLE\n");
-			/*
-			memset(luxbuf, 0, sizeof(luxbuf));
-			bufidx = 0;
-			bufsum = 0;
-			waitenable = 0;
-			*/
+			kbdbl_activity(&k);
+			if (config_changed() && !reload_config(&k.table, k.avgsz))
+				kbdbl_profile(&k);
 		}
 	}
 
-	close(sensor);
+	if (watcher >= 0)
+		close(watcher);
+	pbswitch_close(&sw);
+	pbpower_close(&pw);
+	pbstate_close(state_page, state_path);
+	kbdbl_free(&k);
+	backend->close();
 
 	clean_pidfile();
 
 	return 0;
 }
+#endif
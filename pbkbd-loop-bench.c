@@ -0,0 +1,321 @@
+/*
+ * Event loop benchmark for pbkbd, poll and libevdev against io_uring.
+ *
+ * The daemon's loop runs in a child process with the keyboard and both
+ * uinput devices replaced by pipes. The replayed trace is written to the
+ * keyboard pipe one keystroke at a time, and the round trip until all of its
+ * translated events come out of the uinput pipes is measured, together with
+ * the child's CPU time. libevdev is emulated with the system calls it makes:
+ * a poll() and a read() per batch of events, a write() per uinput event.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct libevdev;
+struct libevdev_uinput;
+static int bench_has_event_pending(struct libevdev *dev);
+static int bench_next_event(struct libevdev *dev, unsigned int flags, struct input_event *ev);
+static int bench_set_clock_id(struct libevdev *dev, int clockid);
+static int bench_uinput_get_fd(const struct libevdev_uinput *uinput_dev);
+static int bench_uinput_write_event(const struct libevdev_uinput *uinput_dev,
+		unsigned int type, unsigned int code, int value);
+
+#define libevdev_has_event_pending bench_has_event_pending
+#define libevdev_next_event bench_next_event
+#define libevdev_set_clock_id bench_set_clock_id
+#define libevdev_uinput_get_fd bench_uinput_get_fd
+#define libevdev_uinput_write_event bench_uinput_write_event
+#define main pbkbd_main
+#include "pbkbd.c"
+#undef main
+
+struct bench_dev {
+	int fd;
+	struct input_event q[64];
+	int n, i;
+};
+
+/* fd -1 only counts, for working out what a keystroke should produce */
+struct bench_uinput {
+	int fd;
+	unsigned long long n;
+};
+
+static int bench_has_event_pending(struct libevdev *dev)
+{
+	struct bench_dev *d = (struct bench_dev *) dev;
+	if (d->i < d->n)
+		return 1;
+	struct pollfd p = { .fd = d->fd, .events = POLLIN };
+	return poll(&p, 1, 0);
+}
+
+static int bench_next_event(struct libevdev *dev, unsigned int flags, struct input_event *ev)
+{
+	(void) flags;
+	struct bench_dev *d = (struct bench_dev *) dev;
+	if (d->i == d->n) {
+		ssize_t r = read(d->fd, d->q, sizeof(d->q));
+		if (r <= 0)
+			return -EAGAIN;
+		d->n = r / sizeof(*d->q);
+		d->i = 0;
+	}
+	*ev = d->q[d->i++];
+	return LIBEVDEV_READ_STATUS_SUCCESS;
+}
+
+static int bench_set_clock_id(struct libevdev *dev, int clockid)
+{
+	(void) dev;
+	(void) clockid;
+	return 0;
+}
+
+static int bench_uinput_get_fd(const struct libevdev_uinput *uinput_dev)
+{
+	return ((const struct bench_uinput *) uinput_dev)->fd;
+}
+
+static int bench_uinput_write_event(const struct libevdev_uinput *uinput_dev,
+		unsigned int type, unsigned int code, int value)
+{
+	struct bench_uinput *u = (struct bench_uinput *) uinput_dev;
+	if (u->fd < 0) {
+		u->n++;
+		return 0;
+	}
+	struct input_event ev = { .type = type, .code = code, .value = value };
+	return write(u->fd, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -errno;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static struct { int scan, press; } *trace;
+static size_t ntrace;
+
+static void load_trace(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		die(path);
+	size_t cap = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		long long t;
+		int scan, press;
+		if (sscanf(line, "%lld %x %d", &t, &scan, &press) != 3)
+			continue;
+		if (ntrace == cap) {
+			cap = cap ? cap * 2 : 1024;
+			trace = realloc(trace, cap * sizeof(*trace));
+			if (trace == NULL)
+				die("realloc");
+		}
+		trace[ntrace].scan = scan;
+		trace[ntrace].press = press;
+		ntrace++;
+	}
+	fclose(f);
+	if (ntrace == 0) {
+		fprintf(stderr, "no events in %s\n", path);
+		exit(1);
+	}
+}
+
+static unsigned long long fnv(unsigned long long h, const struct input_event *ev)
+{
+	unsigned v[3] = { ev->type, ev->code, (unsigned) ev->value };
+	const unsigned char *p = (const unsigned char *) v;
+	size_t i;
+	for (i = 0; i < sizeof(v); i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+struct result {
+	struct pblat rtt;
+	double cpu_us;
+	long nvcsw, nivcsw;
+	unsigned long long hash[2];
+	unsigned long long out[2];
+};
+
+static void run(bool uring, int rounds, struct result *res)
+{
+	int kbd[2], out[2][2];
+	if (pipe(kbd) || pipe(out[0]) || pipe(out[1]))
+		die("pipe");
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		close(kbd[1]);
+		close(out[0][0]);
+		close(out[1][0]);
+		struct bench_dev dev = { .fd = kbd[0] };
+		struct bench_uinput u = { .fd = out[0][1] }, ufn = { .fd = out[1][1] };
+		struct pbkbd k = {
+			.kbdfd = kbd[0],
+			.kbddev = (struct libevdev *) &dev,
+			.uinputdev = (struct libevdev_uinput *) &u,
+			.uinputfndev = (struct libevdev_uinput *) &ufn,
+			.scancode = -1,
+			.scanvalue = -1,
+		};
+		use_uring = uring;
+		if (sigsetup())
+			die("sigaction");
+		_exit(translate_daemon(&k));
+	}
+	close(kbd[0]);
+	close(out[0][1]);
+	close(out[1][1]);
+
+	/* the same translation in this process tells what to wait for */
+	struct bench_uinput dry[2] = { { .fd = -1 }, { .fd = -1 } };
+	struct pbkbd k = {
+		.kbdfd = -1,
+		.uinputdev = (struct libevdev_uinput *) &dry[0],
+		.uinputfndev = (struct libevdev_uinput *) &dry[1],
+		.scancode = -1,
+		.scanvalue = -1,
+	};
+	memset(res, 0, sizeof(*res));
+	res->hash[0] = res->hash[1] = 0xcbf29ce484222325ULL;
+	struct pollfd pfd[2] = {
+		{ .fd = out[0][0], .events = POLLIN },
+		{ .fd = out[1][0], .events = POLLIN },
+	};
+	/* let the child reach its loop */
+	usleep(50000);
+
+	int r;
+	size_t i;
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < ntrace; i++) {
+			struct input_event ev[3] = {
+				{ .type = EV_MSC, .code = MSC_SCAN, .value = trace[i].scan },
+				{ .type = EV_KEY, .code = KEY_UNKNOWN, .value = trace[i].press },
+				{ .type = EV_SYN, .code = SYN_REPORT },
+			};
+			unsigned long long before = dry[0].n + dry[1].n;
+			translate_event(&k, &ev[0]);
+			translate_event(&k, &ev[1]);
+			translate_event(&k, &ev[2]);
+			bool expect = dry[0].n + dry[1].n != before;
+
+			long long t0 = pblat_now_us();
+			int j;
+			for (j = 0; j < 3; j++) {
+				ev[j].time.tv_sec = t0 / 1000000;
+				ev[j].time.tv_usec = t0 % 1000000;
+			}
+			if (write(kbd[1], ev, sizeof(ev)) != sizeof(ev))
+				die("write");
+			while (res->out[0] < dry[0].n || res->out[1] < dry[1].n) {
+				if (poll(pfd, 2, 5000) <= 0) {
+					fprintf(stderr, "no output from the daemon\n");
+					exit(1);
+				}
+				for (j = 0; j < 2; j++) {
+					if (!(pfd[j].revents & POLLIN))
+						continue;
+					struct input_event o[64];
+					ssize_t n = read(pfd[j].fd, o, sizeof(o));
+					if (n <= 0)
+						die("read");
+					ssize_t e;
+					for (e = 0; e < n / (ssize_t) sizeof(*o); e++)
+						res->hash[j] = fnv(res->hash[j], &o[e]);
+					res->out[j] += n / sizeof(*o);
+				}
+			}
+			if (expect)
+				pblat_add(&res->rtt, pblat_now_us() - t0);
+		}
+
+	int status;
+	struct rusage ru;
+	do {
+		kill(pid, SIGTERM);
+		usleep(1000);
+	} while (wait4(pid, &status, WNOHANG, &ru) == 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		fprintf(stderr, "%s loop failed\n", uring ? "io_uring" : "poll");
+	res->cpu_us = pbstats_us(ru.ru_utime) + pbstats_us(ru.ru_stime);
+	res->nvcsw = ru.ru_nvcsw;
+	res->nivcsw = ru.ru_nivcsw;
+	close(kbd[1]);
+	close(out[0][0]);
+	close(out[1][0]);
+}
+
+static void report(const char *name, const struct result *res, double keystrokes)
+{
+	printf("%-9s round trip p50 %4lld us, p99 %4lld us, max %5lld us, "
+			"%5.2f us CPU/keystroke, %5.2f context switches/keystroke\n",
+			name, pblat_percentile(&res->rtt, 500), pblat_percentile(&res->rtt, 990),
+			res->rtt.max, res->cpu_us / keystrokes,
+			(res->nvcsw + res->nivcsw) / keystrokes);
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = "pbkbd-typing.trace";
+	int rounds = 1;
+	int c;
+	while ((c = getopt(argc, argv, "r:n:")) > 0)
+		switch (c) {
+		case 'r':
+			path = optarg;
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-r trace] [-n rounds]\n",
+					argc == 0 ? "pbkbd-loop-bench" : argv[0]);
+			return 1;
+		}
+	if (rounds < 1)
+		return 1;
+	load_trace(path);
+	verbosity = WARN;
+	/* timeouts would depend on the scheduling */
+	hold_timeout = 0;
+	activity_hook = replay_activity;
+	input_path = "/nonexistent";
+	sysinput_path = "/nonexistent";
+
+	struct result p, u;
+	run(false, rounds, &p);
+	run(true, rounds, &u);
+	double keystrokes = (double) ntrace * rounds;
+	printf("%.0f keystrokes, %llu events written\n", keystrokes, p.out[0] + p.out[1]);
+	report("poll:", &p, keystrokes);
+	report("io_uring:", &u, keystrokes);
+	if (p.hash[0] != u.hash[0] || p.hash[1] != u.hash[1] ||
+			p.out[0] != u.out[0] || p.out[1] != u.out[1]) {
+		printf("output differs\n");
+		return 1;
+	}
+	return 0;
+}
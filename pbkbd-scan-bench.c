@@ -0,0 +1,202 @@
+/*
+ * Startup benchmark for pbkbd's keyboard probing.
+ *
+ * Builds a fake /sys/class/input and /dev/input tree with many devices and
+ * compares the sysfs prefiltered scan_pbkbd() against opening and probing
+ * every event node. The fake nodes are regular files, so libevdev rejects
+ * them cheaply; real devices make full probing considerably slower.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static int bench_openat(int dfd, const char *path, int flags, ...);
+
+#define openat bench_openat
+#define main pbkbd_main
+#include "pbkbd.c"
+#undef main
+#undef openat
+
+static unsigned long long node_opens, sysfs_opens;
+
+static int bench_openat(int dfd, const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	if (flags & O_CREAT) {
+		va_list ap;
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	if (strstr(path, "/device/") != NULL)
+		sysfs_opens++;
+	else
+		node_opens++;
+	return openat(dfd, path, flags, mode);
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void writefile(const char *path, const char *content)
+{
+	int f = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0)
+		die(path);
+	if (write(f, content, strlen(content)) < 0)
+		die(path);
+	close(f);
+}
+
+static char root[PATH_MAX];
+
+static void make_device(int n, const char *bus, const char *name)
+{
+	char p[PATH_MAX + 64];
+	snprintf(p, sizeof(p), "%s/sys/event%d", root, n);
+	mkdir(p, 0755);
+	snprintf(p, sizeof(p), "%s/sys/event%d/device", root, n);
+	mkdir(p, 0755);
+	snprintf(p, sizeof(p), "%s/sys/event%d/device/id", root, n);
+	mkdir(p, 0755);
+	snprintf(p, sizeof(p), "%s/sys/event%d/device/id/bustype", root, n);
+	writefile(p, bus);
+	snprintf(p, sizeof(p), "%s/sys/event%d/device/name", root, n);
+	writefile(p, name);
+	snprintf(p, sizeof(p), "%s/dev/event%d", root, n);
+	writefile(p, "");
+}
+
+static void remove_device(int n)
+{
+	const char *files[] = {
+		"sys/event%d/device/id/bustype", "sys/event%d/device/id",
+		"sys/event%d/device/name", "sys/event%d/device", "sys/event%d",
+		"dev/event%d"
+	};
+	size_t i;
+	for (i = 0; i < sizeof(files) / sizeof(*files); i++) {
+		char f[64], p[PATH_MAX + 64];
+		snprintf(f, sizeof(f), files[i], n);
+		snprintf(p, sizeof(p), "%s/%s", root, f);
+		remove(p);
+	}
+}
+
+/* the probing pbkbd did before the sysfs prefilter */
+static int scan_all(void)
+{
+	DIR *d = opendir(input_path);
+	if (d == NULL)
+		return -1;
+	int ret = -1;
+	struct dirent *e;
+	for (e = readdir(d); e != NULL; e = readdir(d)) {
+		if (!(strlen(e->d_name) > 5 &&
+					!memcmp(e->d_name, "event", 5)))
+			continue;
+		ret = scan_single_input(dirfd(d), e->d_name);
+		if (ret >= 0)
+			break;
+	}
+	closedir(d);
+	return ret;
+}
+
+static double bench(int (*scan)(void), int iterations)
+{
+	node_opens = 0;
+	sysfs_opens = 0;
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	int i;
+	for (i = 0; i < iterations; i++) {
+		int f = scan();
+		if (f >= 0)
+			close(f);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+	int ndev = 64;
+	int iterations = 200;
+	int c;
+	while ((c = getopt(argc, argv, "n:i:")) > 0)
+		switch (c) {
+		case 'n':
+			ndev = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-n devices] [-i iterations]\n",
+					argc == 0 ? "pbkbd-scan-bench" : argv[0]);
+			return 1;
+		}
+	if (ndev < 2 || iterations < 1)
+		return 1;
+	verbosity = FATAL;
+
+	const char *tmp = getenv("TMPDIR");
+	snprintf(root, sizeof(root), "%s/pbkbd-scan-bench.XXXXXX", tmp ? tmp : "/tmp");
+	if (mkdtemp(root) == NULL)
+		die("mkdtemp");
+	char sys[PATH_MAX + 8], dev[PATH_MAX + 8];
+	snprintf(sys, sizeof(sys), "%s/sys", root);
+	snprintf(dev, sizeof(dev), "%s/dev", root);
+	mkdir(sys, 0755);
+	mkdir(dev, 0755);
+
+	/* USB and Bluetooth devices of a docked machine, an i8042 touchpad and the keyboard */
+	int i;
+	for (i = 0; i < ndev; i++) {
+		char name[64];
+		if (i == ndev / 2) {
+			make_device(i, "0011\n", KBD_NAME "\n");
+		} else if (i == ndev / 4) {
+			make_device(i, "0011\n", "PS/2 Generic Mouse\n");
+		} else {
+			snprintf(name, sizeof(name), "Docked device %d\n", i);
+			make_device(i, i % 3 ? "0003\n" : "0005\n", name);
+		}
+	}
+	input_path = dev;
+	sysinput_path = sys;
+
+	double full = bench(scan_all, iterations);
+	unsigned long long full_nodes = node_opens;
+	double pre = bench(scan_pbkbd, iterations);
+	unsigned long long pre_nodes = node_opens, pre_sysfs = sysfs_opens;
+
+	printf("%d devices, %d iterations\n", ndev, iterations);
+	printf("full probe:   %8.1f us/scan, %5.1f device opens/scan\n",
+			full, (double) full_nodes / iterations);
+	printf("sysfs filter: %8.1f us/scan, %5.1f device opens/scan, %5.1f sysfs opens/scan\n",
+			pre, (double) pre_nodes / iterations, (double) pre_sysfs / iterations);
+
+	for (i = 0; i < ndev; i++)
+		remove_device(i);
+	rmdir(sys);
+	rmdir(dev);
+	rmdir(root);
+	return 0;
+}
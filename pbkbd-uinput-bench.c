@@ -0,0 +1,724 @@
+/*
+ * End to end latency benchmark for pbkbd, through the kernel.
+ *
+ * Creates a virtual i8042 keyboard through /dev/uinput, starts pbkbd, which
+ * picks it up like the builtin keyboard, and types a script of plain keys,
+ * Fn keys, Fn combos and Search taps with their scancodes. What comes out of
+ * the "Pixelbook keyboard" and "Pixelbook function keys" devices is read
+ * back: the latency is from before the injecting write() to the kernel
+ * timestamp of the translated events, so it includes the evdev and uinput
+ * hops on both sides. The script is then written as fast as pbkbd takes it
+ * for the throughput. Both runs are compared event by event with the same
+ * translation done in this process. With -R, the throughput run is repeated
+ * while pbkbd is restarted every so often, with this process standing in for
+ * systemd's fd store, and nothing may be lost or reordered across restarts.
+ *
+ * Needs root and pbkbd not running. The output devices are grabbed, so the
+ * keystrokes do not reach the desktop.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct libevdev_uinput;
+static int bench_uinput_write_event(const struct libevdev_uinput *uinput_dev,
+		unsigned int type, unsigned int code, int value);
+
+#define libevdev_uinput_write_event bench_uinput_write_event
+#define main pbkbd_main
+#include "pbkbd.c"
+#undef main
+
+/* one of pbkbd's output devices and what it should deliver */
+struct outdev {
+	const char *name;
+	int fd;
+	bool key[KEY_CNT]; /* in the dry run, the kernel drops unchanged states */
+	bool pending; /* events since the last SYN_REPORT in the dry run */
+	struct input_event *want;
+	size_t nwant, cap;
+	size_t got; /* received and matched so far */
+	bool mismatch;
+	unsigned long dropped; /* SYN_DROPPED */
+};
+
+static struct outdev out[2] = {
+	{ .name = "Pixelbook keyboard", .fd = -1 },
+	{ .name = "Pixelbook function keys", .fd = -1 },
+};
+
+/* records what the input core passes on to readers */
+static int bench_uinput_write_event(const struct libevdev_uinput *uinput_dev,
+		unsigned int type, unsigned int code, int value)
+{
+	struct outdev *o = (struct outdev *) uinput_dev;
+	if (type == EV_KEY && code < KEY_CNT && value != 2) {
+		if (o->key[code] == !!value)
+			return 0;
+		o->key[code] = !!value;
+	}
+	if (type == EV_SYN && code == SYN_REPORT) {
+		if (!o->pending)
+			return 0;
+		o->pending = false;
+	} else {
+		o->pending = true;
+	}
+	if (o->nwant == o->cap) {
+		o->cap = o->cap ? o->cap * 2 : 4096;
+		o->want = realloc(o->want, o->cap * sizeof(*o->want));
+		if (o->want == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	struct input_event ev = { .type = type, .code = code, .value = value };
+	o->want[o->nwant++] = ev;
+	return 0;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* a keystroke of the script and what it should produce */
+struct step {
+	uint8_t scan;
+	uint8_t press;
+	int8_t path; /* LAT_*, -1 if nothing comes out */
+	size_t end[2]; /* expected events up to and including this one */
+};
+
+static struct step *script;
+static size_t nscript, capscript;
+
+static void push(int scan, int press)
+{
+	if (nscript == capscript) {
+		capscript = capscript ? capscript * 2 : 256;
+		script = realloc(script, capscript * sizeof(*script));
+		if (script == NULL)
+			die("realloc");
+	}
+	script[nscript].scan = scan;
+	script[nscript].press = press;
+	nscript++;
+}
+
+static void tap(int scan)
+{
+	push(scan, 1);
+	push(scan, 0);
+}
+
+/* typing with Search taps in between, F1 to F12, and ctrl-alt-arrows */
+static void make_script(int rounds)
+{
+	static const uint8_t text[] = {
+		0x19, 0x17, 0x2d, 0x12, 0x26, 0x30, 0x18, 0x18, 0x25, 0x39,
+		0x14, 0x12, 0x1f, 0x14, 0x1c,
+	};
+	int r;
+	size_t i;
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < sizeof(text); i++) {
+			tap(text[i]);
+			if (i % 5 == 4)
+				tap(keymap_fn_key_scan);
+		}
+		push(keymap_fn_key_scan, 1);
+		for (i = 0x02; i <= 0x0d; i++)
+			tap(i);
+		push(keymap_fn_key_scan, 0);
+		push(keymap_fn_key_scan, 1);
+		for (i = 0x23; i <= 0x26; i++)
+			tap(i);
+		push(keymap_fn_key_scan, 0);
+	}
+}
+
+static void frame(const struct step *s, struct input_event ev[3])
+{
+	int key = keymap_direct[s->scan] > 0 ? keymap_direct[s->scan] : KEY_UNKNOWN;
+	struct input_event f[3] = {
+		{ .type = EV_MSC, .code = MSC_SCAN, .value = s->scan },
+		{ .type = EV_KEY, .code = key, .value = s->press },
+		{ .type = EV_SYN, .code = SYN_REPORT },
+	};
+	memcpy(ev, f, sizeof(f));
+}
+
+/* the translation pbkbd should do, -t 0 so it does not depend on timing */
+static void dry_run(void)
+{
+	struct pbkbd k = {
+		.kbdfd = -1,
+		.uinputdev = (struct libevdev_uinput *) &out[0],
+		.uinputfndev = (struct libevdev_uinput *) &out[1],
+		.scancode = -1,
+		.scanvalue = -1,
+		.stamped = true,
+	};
+	hold_timeout = 0;
+	activity_hook = replay_activity;
+	size_t i;
+	int j;
+	for (i = 0; i < nscript; i++) {
+		unsigned long long n[LAT_MAX];
+		for (j = 0; j < LAT_MAX; j++)
+			n[j] = latency[j].n;
+		struct input_event ev[3];
+		frame(&script[i], ev);
+		for (j = 0; j < 3; j++)
+			translate_event(&k, &ev[j]);
+		script[i].path = -1;
+		for (j = 0; j < LAT_MAX; j++)
+			if (latency[j].n != n[j])
+				script[i].path = j;
+		script[i].end[0] = out[0].nwant;
+		script[i].end[1] = out[1].nwant;
+	}
+}
+
+static int uinput_keyboard(void)
+{
+	int fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		die("/dev/uinput");
+	ioctl(fd, UI_SET_EVBIT, EV_SYN);
+	ioctl(fd, UI_SET_EVBIT, EV_MSC);
+	ioctl(fd, UI_SET_MSCBIT, MSC_SCAN);
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	size_t i;
+	for (i = 0; i < keymap_direct_size; i++)
+		if (keymap_direct[i] > 0)
+			ioctl(fd, UI_SET_KEYBIT, keymap_direct[i]);
+	ioctl(fd, UI_SET_KEYBIT, KEY_UNKNOWN);
+	struct uinput_setup setup = {
+		.id = { .bustype = BUS_I8042, .vendor = 0x0001, .product = 0x0001, .version = 0xab83 },
+	};
+	strcpy(setup.name, KBD_NAME);
+	if (ioctl(fd, UI_DEV_SETUP, &setup) || ioctl(fd, UI_DEV_CREATE))
+		die("creating the virtual keyboard");
+	return fd;
+}
+
+/* event node of a device by name, "" if there is none */
+static void find_device(const char *name, char *node, size_t size)
+{
+	node[0] = 0;
+	DIR *d = opendir("/sys/class/input");
+	if (d == NULL)
+		return;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if (strncmp(e->d_name, "event", 5))
+			continue;
+		char path[NAME_MAX + 64], buf[256];
+		snprintf(path, sizeof(path), "/sys/class/input/%s/device/name", e->d_name);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		bool match = fgets(buf, sizeof(buf), f) != NULL &&
+			!strncmp(buf, name, strlen(name)) && buf[strlen(name)] == '\n';
+		fclose(f);
+		if (match) {
+			snprintf(node, size, "/dev/input/%s", e->d_name);
+			break;
+		}
+	}
+	closedir(d);
+}
+
+/* whether someone, pbkbd hopefully, has grabbed the virtual keyboard */
+static bool grabbed(int ufd)
+{
+	char sysname[64], path[NAME_MAX + 64];
+	if (ioctl(ufd, UI_GET_SYSNAME(sizeof(sysname)), sysname) < 0)
+		return false;
+	snprintf(path, sizeof(path), "/sys/devices/virtual/input/%s", sysname);
+	DIR *d = opendir(path);
+	if (d == NULL)
+		return false;
+	bool r = false;
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL) {
+		if (strncmp(e->d_name, "event", 5))
+			continue;
+		snprintf(path, sizeof(path), "/dev/input/%s", e->d_name);
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			break;
+		r = ioctl(fd, EVIOCGRAB, 1) < 0 && errno == EBUSY;
+		close(fd);
+		break;
+	}
+	closedir(d);
+	return r;
+}
+
+/*
+ * The fd store for -R. pbkbd gets $NOTIFY_SOCKET pointing here, and what it
+ * stores is passed on to the next instance as systemd passes it, one entry
+ * per name being all pbkbd uses.
+ */
+#define STORE_MAX 8
+static struct {
+	char name[32];
+	int fd;
+} store[STORE_MAX];
+static int nstore, notify_fd = -1;
+
+static void notify_open(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1,
+			"pbkbd-uinput-bench-%d", (int) getpid());
+	notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (notify_fd < 0 || bind(notify_fd, (struct sockaddr *) &addr,
+				offsetof(struct sockaddr_un, sun_path) + 1 + len))
+		die("notify socket");
+	char env[sizeof(addr.sun_path) + 1];
+	snprintf(env, sizeof(env), "@%s", addr.sun_path + 1);
+	setenv("NOTIFY_SOCKET", env, 1);
+}
+
+static void store_remove(const char *name)
+{
+	int i;
+	for (i = 0; i < nstore; i++)
+		if (!strcmp(store[i].name, name)) {
+			close(store[i].fd);
+			store[i--] = store[--nstore];
+		}
+}
+
+/* one message within ms, -1 if none came, 1 for READY=1 */
+static int notify_recv(int ms)
+{
+	struct pollfd pfd = { .fd = notify_fd, .events = POLLIN };
+	if (poll(&pfd, 1, ms) <= 0)
+		return -1;
+	char buf[512];
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * STORE_MAX)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	ssize_t n = recvmsg(notify_fd, &mh, MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return -1;
+	buf[n] = 0;
+	int fds[STORE_MAX], nfds = 0, i;
+	struct cmsghdr *c;
+	for (c = CMSG_FIRSTHDR(&mh); c != NULL; c = CMSG_NXTHDR(&mh, c))
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+			nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(c), nfds * sizeof(int));
+		}
+	bool ready = false, add = false, remove = false;
+	char name[32] = "stored";
+	char *line;
+	for (line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		if (!strcmp(line, "READY=1"))
+			ready = true;
+		else if (!strcmp(line, "FDSTORE=1"))
+			add = true;
+		else if (!strcmp(line, "FDSTOREREMOVE=1"))
+			remove = true;
+		else if (!strncmp(line, "FDNAME=", 7))
+			snprintf(name, sizeof(name), "%s", line + 7);
+	}
+	if (add || remove)
+		store_remove(name);
+	for (i = 0; i < nfds; i++) {
+		if (add && nstore < STORE_MAX) {
+			snprintf(store[nstore].name, sizeof(store[nstore].name), "%s", name);
+			store[nstore++].fd = fds[i];
+		} else {
+			close(fds[i]);
+		}
+	}
+	return ready;
+}
+
+/* in the child, the store goes to fds 3 and on like LISTEN_FDS */
+static void pass_store(void)
+{
+	if (nstore == 0)
+		return;
+	int tmp[STORE_MAX], i;
+	char names[STORE_MAX * 33] = "", num[16];
+	for (i = 0; i < nstore; i++)
+		if ((tmp[i] = fcntl(store[i].fd, F_DUPFD_CLOEXEC, 64)) < 0)
+			_exit(127);
+	for (i = 0; i < nstore; i++) {
+		if (dup2(tmp[i], SD_LISTEN_FDS_START + i) < 0)
+			_exit(127);
+		if (i > 0)
+			strcat(names, ":");
+		strcat(names, store[i].name);
+	}
+	snprintf(num, sizeof(num), "%d", nstore);
+	setenv("LISTEN_FDS", num, 1);
+	setenv("LISTEN_FDNAMES", names, 1);
+	snprintf(num, sizeof(num), "%d", (int) getpid());
+	setenv("LISTEN_PID", num, 1);
+}
+
+static pid_t spawn_pbkbd(const char *path)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (pid == 0) {
+		pass_store();
+		execl(path, path, "-q", "-t", "0", (char *) NULL);
+		perror(path);
+		_exit(127);
+	}
+	return pid;
+}
+
+static pid_t start_pbkbd(const char *path, int ufd)
+{
+	pid_t pid = spawn_pbkbd(path);
+	/* wait for both output devices, then take them from the desktop */
+	int i, tries;
+	for (tries = 0; tries < 200; tries++) {
+		char node[NAME_MAX + 16];
+		for (i = 0; i < 2; i++) {
+			if (out[i].fd >= 0)
+				continue;
+			find_device(out[i].name, node, sizeof(node));
+			if (node[0] && (out[i].fd = open(node, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) >= 0) {
+				int clk = CLOCK_MONOTONIC;
+				if (ioctl(out[i].fd, EVIOCGRAB, 1) || ioctl(out[i].fd, EVIOCSCLOCKID, &clk))
+					die(node);
+			}
+		}
+		if (out[0].fd >= 0 && out[1].fd >= 0)
+			break;
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "pbkbd exited\n");
+			exit(1);
+		}
+		usleep(10000);
+	}
+	if (out[0].fd < 0 || out[1].fd < 0) {
+		fprintf(stderr, "pbkbd did not create its devices\n");
+		kill(pid, SIGTERM);
+		exit(1);
+	}
+	/* pbkbd grabs its keyboard after creating the devices */
+	for (tries = 0; tries < 100 && !grabbed(ufd); tries++)
+		usleep(10000);
+	if (tries == 100) {
+		fprintf(stderr, "pbkbd took another keyboard, the builtin one is listed first\n");
+		kill(pid, SIGTERM);
+		exit(1);
+	}
+	return pid;
+}
+
+/* reads what is there, returns the kernel time of the last event read */
+static long long drain(struct outdev *o)
+{
+	long long t = -1;
+	struct input_event ev[64];
+	ssize_t n;
+	while ((n = read(o->fd, ev, sizeof(ev))) > 0) {
+		ssize_t i;
+		for (i = 0; i < n / (ssize_t) sizeof(*ev); i++) {
+			t = ev[i].time.tv_sec * 1000000LL + ev[i].time.tv_usec;
+			if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+				o->dropped++;
+				continue;
+			}
+			if (o->got >= o->nwant || ev[i].type != o->want[o->got].type ||
+					ev[i].code != o->want[o->got].code ||
+					ev[i].value != o->want[o->got].value) {
+				if (!o->mismatch)
+					fprintf(stderr, "%s: event %zu is %d %d %d\n", o->name, o->got,
+							ev[i].type, ev[i].code, ev[i].value);
+				o->mismatch = true;
+			}
+			o->got++;
+		}
+	}
+	return t;
+}
+
+/* waits until everything up to step i has come out, false on timeout */
+static bool wait_output(const struct step *s, long long *last)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = out[0].fd, .events = POLLIN },
+		{ .fd = out[1].fd, .events = POLLIN },
+	};
+	while (out[0].got < s->end[0] || out[1].got < s->end[1]) {
+		if (poll(pfd, 2, 1000) <= 0)
+			return false;
+		int j;
+		for (j = 0; j < 2; j++)
+			if (pfd[j].revents & POLLIN) {
+				long long t = drain(&out[j]);
+				if (t > *last)
+					*last = t;
+			}
+	}
+	return true;
+}
+
+static void reset_output(void)
+{
+	int j;
+	for (j = 0; j < 2; j++) {
+		out[j].got = 0;
+		out[j].mismatch = false;
+		out[j].dropped = 0;
+	}
+}
+
+static bool check_output(const char *run)
+{
+	bool ok = true;
+	int j;
+	for (j = 0; j < 2; j++) {
+		drain(&out[j]);
+		if (out[j].mismatch || out[j].got != out[j].nwant || out[j].dropped) {
+			printf("%s: %s got %zu of %zu events, %lu drops%s\n", run, out[j].name,
+					out[j].got, out[j].nwant, out[j].dropped,
+					out[j].mismatch ? ", wrong events" : "");
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+/* one keystroke at a time, waiting for its output */
+static bool run_latency(int kfd, struct pblat *lat)
+{
+	reset_output();
+	size_t i;
+	for (i = 0; i < nscript; i++) {
+		struct input_event ev[3];
+		frame(&script[i], ev);
+		long long t0 = pblat_now_us(), last = -1;
+		if (write(kfd, ev, sizeof(ev)) != sizeof(ev))
+			die("write");
+		if (script[i].path < 0)
+			continue;
+		if (!wait_output(&script[i], &last)) {
+			printf("latency: no output for keystroke %zu\n", i);
+			return false;
+		}
+		pblat_add(&lat[script[i].path], last - t0);
+	}
+	return check_output("latency");
+}
+
+/* as fast as it goes, with at most window keystrokes not yet translated */
+static bool run_throughput(int kfd, size_t window, double *keystrokes_s)
+{
+	reset_output();
+	long long t0 = pblat_now_us(), last = -1;
+	size_t i, done = 0;
+	for (i = 0; i < nscript; i++) {
+		/* the oldest keystroke with output in the window must be through */
+		while (i - done >= window) {
+			if (script[done].path >= 0 && !wait_output(&script[done], &last)) {
+				printf("throughput: no output for keystroke %zu\n", done);
+				return false;
+			}
+			done++;
+		}
+		struct input_event ev[3];
+		frame(&script[i], ev);
+		if (write(kfd, ev, sizeof(ev)) != sizeof(ev))
+			die("write");
+	}
+	if (!wait_output(&script[nscript - 1], &last)) {
+		printf("throughput: output incomplete\n");
+		return false;
+	}
+	*keystrokes_s = nscript / ((pblat_now_us() - t0) / 1e6);
+	return check_output("throughput");
+}
+
+/*
+ * The throughput run with restarts spread over it. pbkbd is stopped with
+ * keystrokes in flight, more are typed while none runs, and the next one
+ * takes over from the fd store, the keyboard must stay grabbed throughout.
+ */
+static bool run_restart(int kfd, const char *path, pid_t *pid, int restarts,
+		size_t window, size_t *typed, long long *outage)
+{
+	reset_output();
+	*typed = 0;
+	*outage = 0;
+	long long last = -1;
+	size_t i = 0, done = 0;
+	int r;
+	for (r = 0; r <= restarts; r++) {
+		size_t end = nscript * (r + 1) / (restarts + 1);
+		for (; i < end; i++) {
+			while (i - done >= window) {
+				if (script[done].path >= 0 && !wait_output(&script[done], &last)) {
+					printf("restart: no output for keystroke %zu\n", done);
+					return false;
+				}
+				done++;
+			}
+			struct input_event ev[3];
+			frame(&script[i], ev);
+			if (write(kfd, ev, sizeof(ev)) != sizeof(ev))
+				die("write");
+		}
+		if (r == restarts)
+			break;
+
+		while (notify_recv(0) >= 0)
+			;
+		if (nstore < HO_STATE) {
+			printf("restart: pbkbd did not store its devices\n");
+			return false;
+		}
+		long long t0 = pblat_now_us();
+		kill(*pid, SIGTERM);
+		waitpid(*pid, NULL, 0);
+		while (notify_recv(0) >= 0)
+			;
+		if (!grabbed(kfd)) {
+			printf("restart: the keyboard was released\n");
+			return false;
+		}
+		size_t n;
+		for (n = 0; i < nscript && i - done < window && n < window / 2; i++, n++) {
+			struct input_event ev[3];
+			frame(&script[i], ev);
+			if (write(kfd, ev, sizeof(ev)) != sizeof(ev))
+				die("write");
+		}
+		*typed += n;
+		*pid = spawn_pbkbd(path);
+		int ready;
+		while ((ready = notify_recv(5000)) == 0)
+			;
+		if (ready < 0) {
+			printf("restart: pbkbd did not come back\n");
+			return false;
+		}
+		if (pblat_now_us() - t0 > *outage)
+			*outage = pblat_now_us() - t0;
+	}
+	if (!wait_output(&script[nscript - 1], &last)) {
+		printf("restart: output incomplete\n");
+		return false;
+	}
+	return check_output("restart");
+}
+
+int main(int argc, char **argv)
+{
+	const char *pbkbd = "./pbkbd";
+	int rounds = 50;
+	size_t window = 32;
+	int restarts = 0;
+	int c;
+	while ((c = getopt(argc, argv, "p:n:w:R:")) > 0)
+		switch (c) {
+		case 'p':
+			pbkbd = optarg;
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'R':
+			restarts = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-p pbkbd] [-n rounds] [-w keystrokes in flight] [-R restarts]\n",
+					argc == 0 ? "pbkbd-uinput-bench" : argv[0]);
+			return 1;
+		}
+	if (rounds < 1 || window < 1 || restarts < 0)
+		return 1;
+	verbosity = WARN;
+
+	char node[NAME_MAX + 16];
+	find_device(out[0].name, node, sizeof(node));
+	if (node[0]) {
+		fprintf(stderr, "pbkbd is running, stop it first\n");
+		return 1;
+	}
+	/* the profile pbkbd picks on this machine */
+	keymap_select(NULL);
+	make_script(rounds);
+	dry_run();
+
+	if (restarts > 0)
+		notify_open();
+	int kfd = uinput_keyboard();
+	/* let the event node appear before pbkbd scans */
+	usleep(100000);
+	pid_t pid = start_pbkbd(pbkbd, kfd);
+
+	struct pblat lat[LAT_MAX];
+	memset(lat, 0, sizeof(lat));
+	double rate = 0;
+	bool ok = run_latency(kfd, lat);
+	if (ok)
+		ok = run_throughput(kfd, window, &rate);
+	size_t typed = 0;
+	long long outage = 0;
+	if (ok && restarts > 0)
+		ok = run_restart(kfd, pbkbd, &pid, restarts, window, &typed, &outage);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	/* the stored devices go away with the last copies */
+	while (nstore > 0)
+		close(store[--nstore].fd);
+	ioctl(kfd, UI_DEV_DESTROY);
+	close(kfd);
+
+	printf("%zu keystrokes, %zu + %zu events expected\n", nscript, out[0].nwant, out[1].nwant);
+	int i;
+	for (i = 0; i < LAT_MAX; i++)
+		if (lat[i].n)
+			printf("%-10s %6llu keystrokes, p50 %4lld us, p99 %4lld us, max %5lld us\n",
+					latency_names[i], lat[i].n, pblat_percentile(&lat[i], 500),
+					pblat_percentile(&lat[i], 990), lat[i].max);
+	if (rate > 0)
+		printf("saturated: %.0f keystrokes/s with %zu in flight\n", rate, window);
+	if (ok && restarts > 0)
+		printf("restarted %d times, %zu keystrokes typed with pbkbd down, "
+				"longest outage %lld us\n", restarts, typed, outage);
+	printf("output %s\n", ok ? "correct" : "wrong");
+	return !ok;
+}
@@ -1,10 +1,15 @@
 #define _POSIX_C_SOURCE 200809L
+#ifndef _DEFAULT_SOURCE
+# define _DEFAULT_SOURCE /* syscall() for perfcount.h */
+#endif
 
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <libevdev/libevdev-uinput.h>
 #include <libevdev/libevdev.h>
+#include <linux/memfd.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -12,23 +17,57 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "pbblctl.h"
+#include "pblatency.h"
+#include "pbstats.h"
+#include "pbswitch.h"
+#ifndef PB_COMBINED
+# include "pburing.h"
+#endif
+#include "perfcount.h"
+#include "sdnotify.h"
+#ifdef PB_COMBINED
+# include "pbmodules.h"
+#endif
+
 #define INPUTPATH "/dev/input"
+#define SYSINPUTPATH "/sys/class/input"
+#define DMIPATH "/sys/class/dmi/id"
+#define STATSFILE "/run/pbkbd.stats"
+#define STATS_PERIOD (3600 * 1000)
+#define KBD_NAME "AT Translated Set 2 keyboard"
+#define MAX_CANDIDATES 8
+#define HOLD_TIMEOUT 200 /* ms */
 #define FN_LEAK_UNMAPPED
 
+#ifndef PB_COMBINED
 static void print_help(const char *progname)
 {
-	printf("usage: %s [-vq]\n"
+	printf("usage: %s [-vqub] [-t ms] [-k keymap] [-r trace [-n rounds]]\n"
 			"Pixelbook keyboard driver.\n"
 			"Options:\n"
 			"  -v  increase verbosity\n"
 			"  -q  decrease verbosity\n"
-			, progname);
+			"  -t  Search key hold timeout, 0 to decide only on other keys (default %d)\n"
+			"  -u  read and write through io_uring, falls back to poll if unavailable\n"
+			"  -b  send brightness keys straight to pbbacklight instead of the desktop\n"
+			"  -k  keymap profile instead of the one matching DMI: eve, chromebook\n"
+			"  -r  feed a trace of \"<ms> <scancode> <1 press, 0 release>\" lines\n"
+			"      through the translation without devices and report the cost\n"
+			"  -n  replay the trace this many times\n"
+			, progname, HOLD_TIMEOUT);
 }
+#endif
 
 #define errstr strerror(errno)
 
@@ -49,11 +88,79 @@ static int verbosity = INFO;
 	printf(#lvl ": " __VA_ARGS__); \
 } while (0)
 
+enum {
+	ST_WAKE_INPUT,
+	ST_WAKE_TIMER,
+	ST_WAKE_WATCHDOG,
+	ST_WAKE_SIGNAL,
+	ST_WAKE_SWITCH,
+	ST_EVENTS,
+	ST_SPURIOUS,
+	ST_UINPUT_WRITES,
+	ST_OPENS,
+	ST_NOTIFY,
+	ST_SIGNALS,
+	ST_URING_ENTERS,
+	ST_BRIGHTNESS_STEPS,
+	ST_MAX
+};
+static unsigned long long stats[ST_MAX];
+#define COUNT(st) (stats[st]++)
+
+#ifndef PB_COMBINED
+static const char *const stat_names[ST_MAX] = {
+	"wake_input",
+	"wake_timer",
+	"wake_watchdog",
+	"wake_signal",
+	"wake_switch",
+	"events_read",
+	"spurious_reads",
+	"uinput_writes",
+	"file_opens",
+	"backlight_notify",
+	"signals",
+	"uring_enters",
+	"brightness_steps",
+};
+static unsigned long long stats_last[ST_MAX];
+#endif
+
+/* kernel timestamp to the end of the uinput write, by translation */
+enum {
+	LAT_DIRECT,
+	LAT_FN,
+	LAT_COMBO,
+	LAT_TAP, /* Search tapped */
+	LAT_MAX
+};
+static struct pblat latency[LAT_MAX];
+
+#ifndef PB_COMBINED
+static const char *const latency_names[LAT_MAX] = {
+	"direct",
+	"fn",
+	"combo",
+	"search_tap",
+};
+
+static void latency_dump(FILE *f)
+{
+	int i;
+	for (i = 0; i < LAT_MAX; i++)
+		pblat_dump(&latency[i], latency_names[i], f);
+}
+
 static int stop = 0;
+static volatile sig_atomic_t dumpstats = 0;
 
 static void sighandler(int sig)
 {
-	stop = 1;
+	COUNT(ST_SIGNALS);
+	if (sig == SIGUSR1)
+		dumpstats = 1;
+	else
+		stop = 1;
 }
 
 static int sigsetup(void)
@@ -63,15 +170,22 @@ static int sigsetup(void)
 	};
 	if (sigaction(SIGHUP, &sa, NULL) ||
 			sigaction(SIGINT, &sa, NULL) ||
-			sigaction(SIGTERM, &sa, NULL))
+			sigaction(SIGTERM, &sa, NULL) ||
+			sigaction(SIGUSR1, &sa, NULL))
 		return 1;
 	return 0;
 }
+#endif
+
+/* overridable for running against fake trees */
+static const char *input_path = INPUTPATH;
+static const char *sysinput_path = SYSINPUTPATH;
 
 static int scan_single_input(int dfd, const char *devnodename)
 {
 	int ret = -1;
-	LOG(DEBUG2, "found device " INPUTPATH "/%s\n", devnodename);
+	LOG(DEBUG2, "found device %s/%s\n", input_path, devnodename);
+	COUNT(ST_OPENS);
 	int f = openat(dfd, devnodename, O_RDWR | O_NOCTTY);
 	if (f < 0) {
 		LOG(DEBUG2, "device cannot be opened: %s\n", errstr);
@@ -114,26 +228,88 @@ exit:
 	return ret;
 }
 
+static int read_sysattr(int sysfd, const char *devnodename, const char *attr,
+		char *buf, size_t size)
+{
+	char path[NAME_MAX + 32];
+	snprintf(path, sizeof(path), "%s/device/%s", devnodename, attr);
+	COUNT(ST_OPENS);
+	int f = openat(sysfd, path, O_RDONLY | O_CLOEXEC);
+	if (f < 0)
+		return 1;
+	ssize_t s = read(f, buf, size - 1);
+	close(f);
+	if (s < 0)
+		return 1;
+	buf[s] = 0;
+	char *nl = strchr(buf, '\n');
+	if (nl != NULL)
+		*nl = 0;
+	return 0;
+}
+
+/*
+ * Checks the device through sysfs without opening the device node.
+ * Returns 0 if it is not on the i8042 bus, 2 if it is also named like the
+ * builtin keyboard, 1 for other i8042 devices and devices sysfs does not
+ * describe.
+ */
+static int prefilter_input(int sysfd, const char *devnodename)
+{
+	char buf[256];
+	if (sysfd < 0 || read_sysattr(sysfd, devnodename, "id/bustype", buf, sizeof(buf)))
+		return 1;
+	if (strtol(buf, NULL, 16) != BUS_I8042) {
+		LOG(DEBUG2, "skipping %s on bus 0x%s\n", devnodename, buf);
+		return 0;
+	}
+	if (read_sysattr(sysfd, devnodename, "name", buf, sizeof(buf)))
+		return 1;
+	LOG(DEBUG2, "candidate %s '%s'\n", devnodename, buf);
+	return strcmp(buf, KBD_NAME) ? 1 : 2;
+}
+
 static int scan_pbkbd(void)
 {
-	LOG(DEBUG2, "scanning " INPUTPATH "\n");
-	DIR *d = opendir(INPUTPATH);
+	int ret = -1;
+	LOG(DEBUG2, "scanning %s\n", input_path);
+	COUNT(ST_OPENS);
+	DIR *d = opendir(input_path);
 	if (d == NULL) {
 		LOG(ERROR, "cannot scan devices: %s\n", errstr);
 		goto exit;
 	}
 	int dfd = dirfd(d);
+	COUNT(ST_OPENS);
+	int sysfd = open(sysinput_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sysfd < 0)
+		LOG(DEBUG, "cannot open %s, probing all devices: %s\n", sysinput_path, errstr);
 
-	int ret = -1;
+	char candidates[MAX_CANDIDATES][NAME_MAX + 1];
+	int ncandidates = 0;
 	struct dirent *e;
 	for (e = readdir(d); e != NULL; e = readdir(d)) {
 		if (!(strlen(e->d_name) > 5 &&
 					!memcmp(e->d_name, "event", 5)))
 			continue;
-		ret = scan_single_input(dfd, e->d_name);
-		if (ret >= 0)
-			break;
+		int m = prefilter_input(sysfd, e->d_name);
+		if (m == 2) {
+			ret = scan_single_input(dfd, e->d_name);
+			if (ret >= 0)
+				break;
+		} else if (m == 1) {
+			if (ncandidates < MAX_CANDIDATES)
+				strcpy(candidates[ncandidates++], e->d_name);
+			else if ((ret = scan_single_input(dfd, e->d_name)) >= 0)
+				break;
+		}
 	}
+	int i;
+	for (i = 0; ret < 0 && i < ncandidates; i++)
+		ret = scan_single_input(dfd, candidates[i]);
+
+	if (sysfd >= 0)
+		close(sysfd);
 	closedir(d);
 
 exit:
@@ -181,14 +357,215 @@ static struct libevdev_uinput *open_uinputdev(int uinputfd, const char *name)
 	return r;
 }
 
+#ifndef PB_COMBINED
+/*
+ * uinput devices taken over from the previous instance, see handoff. libevdev
+ * only wraps devices it creates itself, so these stand in for its handles
+ * and are written to directly.
+ */
+struct uinput_adopted {
+	int fd;
+};
+static struct uinput_adopted adopted[2] = { { -1 }, { -1 } };
+
+static const struct uinput_adopted *uinput_adopted(const struct libevdev_uinput *uinput)
+{
+	const struct uinput_adopted *u = (const struct uinput_adopted *) uinput;
+	return u == &adopted[0] || u == &adopted[1] ? u : NULL;
+}
+
+static int uinput_fd(const struct libevdev_uinput *uinput)
+{
+	const struct uinput_adopted *u = uinput_adopted(uinput);
+	return u != NULL ? u->fd : libevdev_uinput_get_fd(uinput);
+}
+
+/*
+ * io_uring backend. The keyboard is read into provided buffers by a read
+ * that is rearmed after each completion, the timer and switches are polled
+ * through the ring. The uinput writes of a frame are collected and go out as
+ * linked writes, one per run of events for the same device, in a single
+ * io_uring_enter() that also waits for them.
+ */
+#define RING_ENTRIES 128
+#define RING_BUFS 4
+#define RING_BUF_EVENTS 64
+#define RING_OUT_EVENTS 64
+#define RING_BGID 1
+#if RING_ENTRIES < RING_OUT_EVENTS + 8
+# error "a frame of writes must fit in the submission queue"
+#endif
+
+enum { /* registered files */
+	RF_KBD,
+	RF_UINPUT,
+	RF_UINPUTFN,
+	RF_TIMER,
+	RF_SWITCH,
+	RF_MAX
+};
+
+enum { /* user_data */
+	RU_READ,
+	RU_WRITE,
+	RU_PROVIDE,
+	RU_CANCEL,
+	RU_POLL, /* + RF_* */
+};
+
+struct kbdring {
+	struct pburing r;
+	int fds[RF_MAX];
+	const struct libevdev_uinput *uinputfn;
+	struct input_event buf[RING_BUFS][RING_BUF_EVENTS];
+	struct input_event out[RING_OUT_EVENTS];
+	uint8_t outfile[RING_OUT_EVENTS];
+	int nout;
+	int writing; /* submitted writes not yet completed */
+	bool reading;
+	bool readdone;
+	int readres;
+	unsigned readflags;
+	bool polling[RF_MAX];
+	unsigned ready; /* RF_* bits polled ready */
+	bool parked;
+	bool dropping; /* after SYN_DROPPED, until the next SYN_REPORT */
+};
+
+static struct kbdring *ring = NULL;
+
+/* moves completions into the ring state, the read is handled by the caller */
+static void ring_reap(struct kbdring *q)
+{
+	struct io_uring_cqe *cqe;
+	while ((cqe = pburing_cqe(&q->r)) != NULL) {
+		uint64_t u = cqe->user_data;
+		if (u == RU_READ) {
+			q->reading = false;
+			q->readdone = true;
+			q->readres = cqe->res;
+			q->readflags = cqe->flags;
+		} else if (u == RU_WRITE) {
+			q->writing--;
+			if (cqe->res < 0) {
+				errno = -cqe->res;
+				LOG(WARN, "event write failed: %s\n", errstr);
+			}
+		} else if (u >= RU_POLL && u < RU_POLL + RF_MAX) {
+			q->polling[u - RU_POLL] = false;
+			q->ready |= 1 << (u - RU_POLL);
+		} else if (cqe->res < 0 && cqe->res != -ENOENT && cqe->res != -EALREADY) {
+			errno = -cqe->res;
+			LOG(WARN, "io_uring request failed: %s\n", errstr);
+		}
+		pburing_cqe_seen(&q->r);
+	}
+}
+
+/*
+ * Drops the ring after io_uring failed, the loop polls from then on and
+ * closes it. The runs of the frame from sent on never reached the kernel
+ * and are written directly.
+ */
+static void ring_drop(struct kbdring *q, int sent)
+{
+	LOG(WARN, "io_uring failed, polling from now on\n");
+	int i, j, run = 0;
+	for (i = 0; i < q->nout; i = j, run++) {
+		for (j = i + 1; j < q->nout && q->outfile[j] == q->outfile[i]; j++)
+			;
+		ssize_t len = (j - i) * sizeof(struct input_event);
+		if (run >= sent && write(q->fds[q->outfile[i]], &q->out[i], len) != len)
+			LOG(WARN, "event write failed: %s\n", errstr);
+	}
+	q->nout = 0;
+	q->writing = 0;
+	ring = NULL;
+}
+
+static void ring_flush(void)
+{
+	struct kbdring *q = ring;
+	int i, j, n = 0;
+	for (i = 0; i < q->nout; i = j, n++) {
+		for (j = i + 1; j < q->nout && q->outfile[j] == q->outfile[i]; j++)
+			;
+		struct io_uring_sqe *sqe = pburing_sqe(&q->r);
+		if (sqe == NULL) { /* a frame fits, only a broken ring is full */
+			ring_drop(q, 0);
+			return;
+		}
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->flags = IOSQE_FIXED_FILE | (j < q->nout ? IOSQE_IO_LINK : 0);
+		sqe->fd = q->outfile[i];
+		sqe->addr = (uintptr_t) &q->out[i];
+		sqe->len = (j - i) * sizeof(struct input_event);
+		sqe->off = -1;
+		sqe->user_data = RU_WRITE;
+		q->writing++;
+	}
+	/* uinput writes complete inline, so this is normally one call */
+	while (q->writing > 0) {
+		COUNT(ST_URING_ENTERS);
+		if (pburing_enter(&q->r, q->writing, -1) < 0 && errno != EINTR) {
+			LOG(WARN, "io_uring_enter failed: %s\n", errstr);
+			if (errno != EBUSY) {
+				/* entries are submitted in order, the writes were queued last */
+				ring_drop(q, n - (int) (q->r.queued < (unsigned) n ? q->r.queued : n));
+				return;
+			}
+		}
+		ring_reap(q);
+	}
+	q->nout = 0;
+}
+
+/* queues an event for the frame, the caller flushes a full one first */
+static int ring_write(const struct libevdev_uinput *uinput,
+		unsigned int type, unsigned int code, int value)
+{
+	struct kbdring *q = ring;
+	struct input_event *ev = &q->out[q->nout];
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->code = code;
+	ev->value = value;
+	q->outfile[q->nout++] = uinput == q->uinputfn ? RF_UINPUTFN : RF_UINPUT;
+	return 0;
+}
+#endif
+
 static int uinput_write_event(struct libevdev_uinput *uinput,
 		unsigned int type, unsigned int code, int value)
 {
 	LOG(DEBUG4, "writing uinput type 0x%x code 0x%x value 0x%x\n",
 			type, code, value);
+	COUNT(ST_UINPUT_WRITES);
+	if (uinput == NULL) /* replaying */
+		return 0;
+#ifndef PB_COMBINED
+	if (ring != NULL && ring->nout == RING_OUT_EVENTS)
+		ring_flush();
+	if (ring != NULL)
+		return ring_write(uinput, type, code, value);
+	const struct uinput_adopted *u = uinput_adopted(uinput);
+	if (u != NULL) {
+		struct input_event ev = { .type = type, .code = code, .value = value };
+		return write(u->fd, &ev, sizeof(ev)) == sizeof(ev) ? 0 : -errno;
+	}
+#endif
 	return libevdev_uinput_write_event(uinput, type, code, value);
 }
 
+/* writes what was queued for the frame, if anything is */
+static void uinput_flush(void)
+{
+#ifndef PB_COMBINED
+	if (ring != NULL && ring->nout > 0)
+		ring_flush();
+#endif
+}
+
 static int event_emit(struct libevdev_uinput *uinput, int scan, int key, int release)
 {
 	int ret = 0;
@@ -205,46 +582,239 @@ static int event_emit(struct libevdev_uinput *uinput, int scan, int key, int rel
 	return ret;
 }
 
+static long long replay_ms = -1; /* trace time while replaying, -1 for the clock */
+
+static long long now_ms(void)
+{
+	if (replay_ms >= 0)
+		return replay_ms;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Dual-role keys send their keymap_direct key when tapped and switch to the
+ * keymap_fn layer when held. A pending key is held once another key goes
+ * down, keys without a layer mapping then pass through on their own. Past
+ * the timeout the layer is active already, but a release with no other key
+ * in between is still a tap.
+ */
+enum {
+	DR_IDLE,
+	DR_PENDING,
+	DR_HOLD, /* layer active */
+	DR_EXPIRED, /* layer active, released alone it is a tap */
+};
+
+struct dualrole {
+	uint8_t scan;
+	uint8_t state;
+	long long deadline; /* while pending, -1 without timeout */
+};
+
+static struct dualrole dualrole[] = {
+	{ .scan = keymap_fn_key_scan },
+};
+#define dualrole_size (sizeof(dualrole) / sizeof(*dualrole))
+
+static int hold_timeout = HOLD_TIMEOUT;
+
+static struct dualrole *dualrole_find(int scan)
+{
+	size_t i;
+	for (i = 0; i < dualrole_size; i++)
+		if (dualrole[i].scan == scan)
+			return &dualrole[i];
+	return NULL;
+}
+
+/* overridable for running against fake trees */
+static const char *dmi_path = DMIPATH;
+
+static int read_dmi(const char *attr, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dmi_path, attr);
+	COUNT(ST_OPENS);
+	int f = open(path, O_RDONLY | O_CLOEXEC);
+	if (f < 0)
+		return 1;
+	ssize_t s = read(f, buf, size - 1);
+	close(f);
+	if (s < 0)
+		return 1;
+	buf[s] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+/*
+ * Copies the keymap profile called name, or the first matching DMI if name
+ * is NULL, into the tables the translation uses. Returns nonzero if there
+ * is no profile called name.
+ */
+static int keymap_select(const char *name)
+{
+	char vendor[64] = "", product[64] = "";
+	if (name == NULL) {
+		read_dmi("sys_vendor", vendor, sizeof(vendor));
+		read_dmi("product_name", product, sizeof(product));
+	}
+	const struct keymap_profile *p = NULL;
+	size_t i;
+	for (i = 0; i < keymap_profiles_size && p == NULL; i++) {
+		const struct keymap_profile *q = &keymap_profiles[i];
+		const char *const *pn;
+		if (name != NULL) {
+			if (!strcmp(q->name, name))
+				p = q;
+			continue;
+		}
+		if (strcasecmp(q->vendor, vendor))
+			continue;
+		for (pn = q->products; *pn != NULL && p == NULL; pn++)
+			if (!strcasecmp(*pn, product))
+				p = q;
+	}
+	if (p == NULL) {
+		if (name != NULL)
+			return 1;
+		p = &keymap_profiles[0];
+	}
+	LOG(DEBUG, "keymap %s\n", p->name);
+	memcpy(keymap_direct, p->direct, sizeof(keymap_direct));
+	return 0;
+}
+
+/* earliest pending timeout, -1 if none */
+static long long dualrole_deadline(void)
+{
+	long long r = -1;
+	size_t i;
+	for (i = 0; i < dualrole_size; i++)
+		if (dualrole[i].state == DR_PENDING && dualrole[i].deadline >= 0 &&
+				(r < 0 || dualrole[i].deadline < r))
+			r = dualrole[i].deadline;
+	return r;
+}
+
+static void dualrole_expire(long long now)
+{
+	size_t i;
+	for (i = 0; i < dualrole_size; i++)
+		if (dualrole[i].state == DR_PENDING && dualrole[i].deadline >= 0 &&
+				dualrole[i].deadline <= now) {
+			LOG(DEBUG3, "scan 0x%x held\n", dualrole[i].scan);
+			dualrole[i].state = DR_EXPIRED;
+		}
+}
+
+/* another key went down, returns whether a layer is active for it */
+static bool dualrole_resolve(void)
+{
+	bool layer = false;
+	size_t i;
+	for (i = 0; i < dualrole_size; i++) {
+		struct dualrole *d = &dualrole[i];
+		if (d->state == DR_PENDING || d->state == DR_EXPIRED)
+			d->state = DR_HOLD;
+		if (d->state == DR_HOLD)
+			layer = true;
+	}
+	return layer;
+}
+
+static bool dualrole_layer(void)
+{
+	size_t i;
+	for (i = 0; i < dualrole_size; i++)
+		if (dualrole[i].state == DR_HOLD || dualrole[i].state == DR_EXPIRED)
+			return true;
+	return false;
+}
+
+/* returns LAT_TAP if the tap was sent, -1 otherwise */
+static int dualrole_input(struct dualrole *d, int release,
+		struct libevdev_uinput *uinput)
+{
+	int k = keymap_direct[d->scan];
+	int path = -1;
+	if (!release) {
+		if (d->state == DR_IDLE) {
+			d->state = DR_PENDING;
+			d->deadline = hold_timeout > 0 ? now_ms() + hold_timeout : -1;
+		}
+		return path;
+	}
+	if ((d->state == DR_PENDING || d->state == DR_EXPIRED) && k > 0) {
+		event_emit(uinput, d->scan, k, 0);
+		event_emit(uinput, d->scan, k, 1);
+		path = LAT_TAP;
+	}
+	d->state = DR_IDLE;
+	return path;
+}
+
+/* steps the screen brightness, returns 0 if it was taken */
+static int (*brightness_hook)(int steps) = NULL;
+static bool brightness_taken[keymap_key_max + 1];
+
+/*
+ * Brightness keys go to brightness_hook when there is one, and only to the
+ * desktop if it fails. Returns whether the key was taken, the release of a
+ * taken press is taken as well.
+ */
+static bool brightness_key(int scan, int key, int release)
+{
+	if (brightness_hook == NULL || (key != KEY_BRIGHTNESSUP && key != KEY_BRIGHTNESSDOWN))
+		return false;
+	if (release) {
+		bool t = brightness_taken[scan];
+		brightness_taken[scan] = false;
+		return t;
+	}
+	brightness_taken[scan] = !brightness_hook(key == KEY_BRIGHTNESSUP ? 1 : -1);
+	if (brightness_taken[scan])
+		COUNT(ST_BRIGHTNESS_STEPS);
+	return brightness_taken[scan];
+}
+
+/* scancodes whose press went out on the function keys device */
+static bool fnpressed[keymap_key_max + 1];
+
+/* returns the LAT_* translation that was written, -1 if nothing was */
 static int event_input(int scan, int release,
 		struct libevdev_uinput *uinput, struct libevdev_uinput *uinputfn)
 {
-	static bool fnactive = false;
-	static bool fnactivated = false;
-	static bool fnpressed[keymap_key_max + 1] = { };
-
 	LOG(DEBUG3, "keystroke scan 0x%x %s\n", scan, release ? "RELEASE" : "PRESS");
 
-	if (scan == keymap_fn_key_scan) {
-		if (!release) {
-			fnactive = true;
-			fnactivated = false;
-		} else {
-			if (!fnactivated) {
-				int k = keymap_direct[scan];
-				if (k > 0) {
-					event_emit(uinput, scan, k, 0);
-					event_emit(uinput, scan, k, 1);
-				}
-			}
-			fnactive = false;
-		}
+	struct dualrole *d = dualrole_find(scan);
+	bool fnactive = release ? dualrole_layer() : dualrole_resolve();
+	int path = -1;
+
+	if (d != NULL) {
+		path = dualrole_input(d, release, uinput);
 	} else if (!release && fnactive) {
-		fnactivated = true;
 		int k = keymap_fn[scan];
 		if (k > 0) {
 			fnpressed[scan] = true;
 			event_emit(uinputfn, scan, k, 0);
+			path = LAT_FN;
 		} else if (k < 0) {
 			fnpressed[scan] = true;
 			const int *combo = keymap_combo[-1 - k];
 			for (; *combo > 0; combo++)
 				event_emit(uinputfn, scan, *combo, 0);
+			path = LAT_COMBO;
 		}
 #ifdef FN_LEAK_UNMAPPED
 		else {
 			int k = keymap_direct[scan];
-			if (k > 0)
+			if (k > 0) {
 				event_emit(uinput, scan, k, release);
+				path = LAT_DIRECT;
+			}
 		}
 #endif
 	} else if (release && fnpressed[scan]) {
@@ -252,6 +822,7 @@ static int event_input(int scan, int release,
 		int k = keymap_fn[scan];
 		if (k > 0) {
 			event_emit(uinputfn, scan, k, 1);
+			path = LAT_FN;
 		} else if (k < 0) {
 			const int *combo = keymap_combo[-1 - k];
 			const int *cend = combo;
@@ -260,15 +831,21 @@ static int event_input(int scan, int release,
 			cend--;
 			for (; cend >= combo; cend--)
 				event_emit(uinputfn, scan, *cend, 1);
+			path = LAT_COMBO;
 		}
 	} else {
 		int k = keymap_direct[scan];
-		if (k > 0)
-			event_emit(uinput, scan, k, release);
+		if (k > 0) {
+			if (!brightness_key(scan, k, release))
+				event_emit(uinput, scan, k, release);
+			path = LAT_DIRECT;
+		}
 	}
-	return 0;
+	return path;
 }
 
+static void (*activity_hook)(void) = NULL;
+
 static int notify_backlight(void)
 {
 	static time_t last_notify_sent = 0;
@@ -276,6 +853,12 @@ static int notify_backlight(void)
 	if (now == last_notify_sent)
 		return 0;
 	last_notify_sent = now;
+	COUNT(ST_NOTIFY);
+	if (activity_hook != NULL) {
+		activity_hook();
+		return 0;
+	}
+	COUNT(ST_OPENS);
 	FILE *f = fopen("/run/pbkbd-backlight.pid", "r");
 	if (f == NULL)
 		return 1;
@@ -297,71 +880,153 @@ static int notify_backlight(void)
 	return r;
 }
 
-static int translate_daemon(struct libevdev *kbd,
-		struct libevdev_uinput *uinput, struct libevdev_uinput *uinputfn)
+#ifndef PB_COMBINED
+/*
+ * The brightness_hook of pbkbd -b: a step for pbbacklight on a connection
+ * kept open, reconnected if pbbacklight restarted. Replies are not waited
+ * for, just drained so the socket stays writable.
+ */
+static int blctl = -1;
+
+static int brightness_send(int steps)
 {
-	struct pollfd pfd = {
-		.fd = libevdev_get_fd(kbd),
-		.events = POLLIN
-	};
+	int retry;
+	for (retry = 0; retry < 2; retry++) {
+		if (blctl < 0) {
+			blctl = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+			if (blctl < 0)
+				return 1;
+			struct sockaddr_un addr = { .sun_family = AF_UNIX };
+			strncpy(addr.sun_path, PBBL_SOCKET, sizeof(addr.sun_path) - 1);
+			if (connect(blctl, (struct sockaddr *) &addr, sizeof(addr))) {
+				LOG(DEBUG, "cannot connect to pbbacklight: %s\n", errstr);
+				close(blctl);
+				blctl = -1;
+				return 1;
+			}
+		}
+		struct pbbl_msg m;
+		while (recv(blctl, &m, sizeof(m), 0) > 0)
+			;
+		memset(&m, 0, sizeof(m));
+		m.op = PBBL_STEP;
+		m.value = (uint32_t) steps;
+		if (send(blctl, &m, sizeof(m), MSG_NOSIGNAL) == sizeof(m))
+			return 0;
+		close(blctl);
+		blctl = -1;
+	}
+	return 1;
+}
+#endif
+
+struct pbkbd {
+	int kbdfd;
+	struct libevdev *kbddev;
+	struct libevdev_uinput *uinputdev;
+	struct libevdev_uinput *uinputfndev;
+	int scancode;
+	int scanvalue;
+	bool down[keymap_key_max + 1]; /* scancodes pressed */
+	bool stamped; /* event times are CLOCK_MONOTONIC, latency is recorded */
+	bool adopted; /* taken over with what was typed meanwhile still queued */
+};
 
+static void translate_event(struct pbkbd *k, const struct input_event *ev)
+{
+	switch (ev->type) {
+	case EV_SYN:
+		LOG(DEBUG4, "SYN\n");
+		if (k->scanvalue == 0 || k->scanvalue == 1) {
+			if (k->scancode >= 0 && k->scancode <= keymap_key_max)
+				k->down[k->scancode] = k->scanvalue == 1;
+			int path = event_input(k->scancode, k->scanvalue == 0, k->uinputdev, k->uinputfndev);
+			uinput_flush();
+			if (path >= 0 && k->stamped)
+				pblat_add(&latency[path], pblat_now_us() -
+						(ev->time.tv_sec * 1000000LL + ev->time.tv_usec));
+		}
+		k->scancode = -1;
+		k->scanvalue = -1;
+		notify_backlight();
+		break;
+	case EV_KEY:
+		LOG(DEBUG4, "KEY code 0x%x %s\n", ev->code,
+				ev->value == 0 ? "RELEASE" :
+				ev->value == 1 ? "DEPRESSED" :
+				ev->value == 2 ? "REPEAT" :
+				"UNKNOWN");
+		k->scanvalue = ev->value;
+		break;
+	case EV_MSC:
+		if (ev->code == MSC_SCAN) {
+			LOG(DEBUG4, "SCAN 0x%x\n", ev->value);
+			k->scancode = ev->value;
+			break;
+		}
+	default:
+		LOG(DEBUG4, "kbd event type 0x%x code 0x%x value 0x%x\n",
+				(int) ev->type, (int) ev->code, (int) ev->value);
+	}
+}
+
+/* translates everything that can be read without blocking */
+static void translate_pending(struct pbkbd *k)
+{
 	struct input_event ev;
-	while (poll(&pfd, 1, 0) > 0) {
-		if (libevdev_next_event(kbd, LIBEVDEV_READ_FLAG_NORMAL, &ev)
+	while (libevdev_has_event_pending(k->kbddev) > 0) {
+		if (libevdev_next_event(k->kbddev, LIBEVDEV_READ_FLAG_NORMAL, &ev) != LIBEVDEV_READ_STATUS_SUCCESS) {
+			LOG(DEBUG4, "spurious read\n");
+			COUNT(ST_SPURIOUS);
+			continue;
+		}
+		COUNT(ST_EVENTS);
+		translate_event(k, &ev);
+	}
+}
+
+/* drops events queued before the device was grabbed */
+static void translate_flush(struct pbkbd *k)
+{
+	struct input_event ev;
+	while (libevdev_has_event_pending(k->kbddev) > 0) {
+		if (libevdev_next_event(k->kbddev, LIBEVDEV_READ_FLAG_NORMAL, &ev)
 				== LIBEVDEV_READ_STATUS_SUCCESS)
 			LOG(DEBUG4, "ignored event type 0x%x code 0x%x value 0x%x\n",
 					(int) ev.type, (int) ev.code, (int) ev.value);
 		else
 			break;
 	}
+	k->scancode = -1;
+	k->scanvalue = -1;
+}
 
-	int ret = 0;
-	int scancode = -1;
-	int scanvalue = -1;
-
-	while (!stop) {
-		if (!libevdev_has_event_pending(kbd))
-			if (poll(&pfd, 1, -1) <= 0) {
-				if (errno != EAGAIN && errno != EINTR) {
-					LOG(ERROR, "poll failed: %s\n", errstr);
-					ret = 1;
-				}
-				break;
-			}
-		if (libevdev_next_event(kbd, LIBEVDEV_READ_FLAG_NORMAL, &ev) != LIBEVDEV_READ_STATUS_SUCCESS) {
-			LOG(DEBUG4, "spurious read\n");
-			continue;
-		}
-		switch (ev.type) {
-		case EV_SYN:
-			LOG(DEBUG4, "SYN\n");
-			if (scanvalue == 0 || scanvalue == 1)
-				event_input(scancode, scanvalue == 0, uinput, uinputfn);
-			scancode = -1;
-			scanvalue = -1;
-			notify_backlight();
-			break;
-		case EV_KEY:
-			LOG(DEBUG4, "KEY code 0x%x %s\n", ev.code,
-					ev.value == 0 ? "RELEASE" :
-					ev.value == 1 ? "DEPRESSED" :
-					ev.value == 2 ? "REPEAT" :
-					"UNKNOWN");
-			scanvalue = ev.value;
-			break;
-		case EV_MSC:
-			if (ev.code == MSC_SCAN) {
-				LOG(DEBUG4, "SCAN 0x%x\n", ev.value);
-				scancode = ev.value;
-				break;
-			}
-		default:
-			LOG(DEBUG4, "kbd event type 0x%x code 0x%x value 0x%x\n",
-					(int) ev.type, (int) ev.code, (int) ev.value);
+/*
+ * Parking for lid closed and tablet mode: everything held is released so
+ * nothing sticks, a pending Search key is neither a tap nor a hold, and the
+ * keyboard is not read until unparked.
+ */
+static void translate_park(struct pbkbd *k)
+{
+	LOG(DEBUG, "parking\n");
+	size_t i;
+	for (i = 0; i < dualrole_size; i++)
+		if (dualrole[i].state == DR_PENDING || dualrole[i].state == DR_EXPIRED)
+			dualrole[i].state = DR_IDLE;
+	int scan;
+	for (scan = 0; scan <= keymap_key_max; scan++)
+		if (k->down[scan]) {
+			k->down[scan] = false;
+			event_input(scan, 1, k->uinputdev, k->uinputfndev);
 		}
-	}
+	uinput_flush();
+}
 
-	return ret;
+/* what was typed into the folded keyboard is stale */
+static void translate_unpark(struct pbkbd *k)
+{
+	LOG(DEBUG, "unparking\n");
+	translate_flush(k);
 }
 
 static void priosetup(void)
@@ -370,42 +1035,33 @@ static void priosetup(void)
 		LOG(WARN, "failed setting nice to lowest value\n");
 }
 
-static int start_daemon(void)
+static int pbkbd_open(struct pbkbd *k)
 {
-	int ret = 1;
-
-	LOG(DEBUG, "starting daemon\n");
-
-	LOG(DEBUG2, "setting up signal handlers\n");
-	if (sigsetup()) {
-		LOG(FATAL, "cannot set up signal handlers: %s\n", errstr);
-		return 1;
-	}
-
+	memset(k->down, 0, sizeof(k->down));
+	k->stamped = false;
 	LOG(DEBUG2, "scanning devices for keyboard\n");
-	int kbdfd = scan_pbkbd();
-	if (kbdfd < 0) {
+	k->kbdfd = scan_pbkbd();
+	if (k->kbdfd < 0) {
 		LOG(FATAL, "pixelbook keyboard not found\n");
 		return 1;
 	}
 
-	struct libevdev *kbddev;
-	if (libevdev_new_from_fd(kbdfd, &kbddev)) {
+	if (libevdev_new_from_fd(k->kbdfd, &k->kbddev)) {
 		LOG(FATAL, "libevdev error: %s\n", errstr);
 		goto exit_close_kbdfd;
 	}
 
 	int uinputfd = -1;
-	struct libevdev_uinput *uinputdev = open_uinputdev(uinputfd, "Pixelbook keyboard");
-	if (uinputdev == NULL) {
+	k->uinputdev = open_uinputdev(uinputfd, "Pixelbook keyboard");
+	if (k->uinputdev == NULL) {
 		LOG(FATAL, "libevdev cannot create uinput device\n");
 		goto exit_close_uinputfd;
 	}
 
 	int uinputfnfd = -1;
 
-	struct libevdev_uinput *uinputfndev = open_uinputdev(uinputfnfd, "Pixelbook function keys");
-	if (uinputfndev == NULL) {
+	k->uinputfndev = open_uinputdev(uinputfnfd, "Pixelbook function keys");
+	if (k->uinputfndev == NULL) {
 		LOG(FATAL, "libevdev cannot create uinput device\n");
 		goto exit_close_uinputfnfd;
 	}
@@ -414,23 +1070,683 @@ static int start_daemon(void)
 	priosetup();
 
 	LOG(DEBUG2, "grabbing device\n");
-	if (libevdev_grab(kbddev, LIBEVDEV_GRAB)) {
+	if (libevdev_grab(k->kbddev, LIBEVDEV_GRAB)) {
 		LOG(FATAL, "cannot grab keyboard\n");
 		goto exit_close_uinputfndev;
 	}
 
-	ret = translate_daemon(kbddev, uinputdev, uinputfndev);
+	return 0;
 
-	//exit_ungrab:
-	libevdev_grab(kbddev, LIBEVDEV_UNGRAB);
 exit_close_uinputfndev:
-	libevdev_uinput_destroy(uinputfndev);
+	libevdev_uinput_destroy(k->uinputfndev);
 exit_close_uinputfnfd:
-	libevdev_uinput_destroy(uinputdev);
+	libevdev_uinput_destroy(k->uinputdev);
 exit_close_uinputfd:
-	libevdev_free(kbddev);
+	libevdev_free(k->kbddev);
 exit_close_kbdfd:
-	close(kbdfd);
+	close(k->kbdfd);
+
+	return 1;
+}
+
+static void pbkbd_close(struct pbkbd *k)
+{
+	libevdev_grab(k->kbddev, LIBEVDEV_UNGRAB);
+	libevdev_uinput_destroy(k->uinputfndev);
+	libevdev_uinput_destroy(k->uinputdev);
+	libevdev_free(k->kbddev);
+	close(k->kbdfd);
+}
+
+#ifdef PB_COMBINED
+static struct pbkbd module;
+
+int pbkbd_module_start(int verbose)
+{
+	verbosity += verbose;
+	keymap_select(NULL);
+	if (pbkbd_open(&module))
+		return 1;
+	translate_flush(&module);
+	return 0;
+}
+
+int pbkbd_module_fd(void)
+{
+	return module.kbdfd;
+}
+
+void pbkbd_module_dispatch(void)
+{
+	translate_pending(&module);
+}
+
+void pbkbd_module_set_activity(void (*hook)(void))
+{
+	activity_hook = hook;
+}
+
+void pbkbd_module_set_brightness(int (*hook)(int steps))
+{
+	brightness_hook = hook;
+}
+
+void pbkbd_module_set_hold_timeout(int ms)
+{
+	hold_timeout = ms;
+}
+
+long long pbkbd_module_deadline(void)
+{
+	return dualrole_deadline();
+}
+
+void pbkbd_module_timer(long long now)
+{
+	dualrole_expire(now);
+}
+
+void pbkbd_module_park(int parked)
+{
+	if (parked)
+		translate_park(&module);
+	else
+		translate_unpark(&module);
+}
+
+void pbkbd_module_stop(void)
+{
+	pbkbd_close(&module);
+}
+#else
+/* arms tfd for an absolute monotonic deadline, -1 disarms */
+static int arm_timer(int tfd, long long deadline)
+{
+	struct itimerspec its = { };
+	if (deadline >= 0) {
+		its.it_value.tv_sec = deadline / 1000;
+		its.it_value.tv_nsec = deadline % 1000 * 1000000 + 1;
+	}
+	return timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static bool use_uring = false;
+
+static void ring_provide(struct kbdring *q, int bid, int n)
+{
+	struct io_uring_sqe *sqe = pburing_sqe(&q->r);
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->fd = n;
+	sqe->addr = (uintptr_t) q->buf[bid];
+	sqe->len = sizeof(q->buf[0]);
+	sqe->off = bid;
+	sqe->buf_group = RING_BGID;
+	sqe->user_data = RU_PROVIDE;
+}
+
+static void ring_arm(struct kbdring *q)
+{
+	struct io_uring_sqe *sqe;
+	if (!q->parked && !q->reading) {
+		sqe = pburing_sqe(&q->r);
+		sqe->opcode = IORING_OP_READ;
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->fd = RF_KBD;
+		sqe->len = sizeof(q->buf[0]);
+		sqe->off = -1;
+		sqe->buf_group = RING_BGID;
+		sqe->user_data = RU_READ;
+		q->reading = true;
+	}
+	int i;
+	for (i = RF_TIMER; i <= RF_SWITCH; i++)
+		if (q->fds[i] >= 0 && !q->polling[i]) {
+			sqe = pburing_sqe(&q->r);
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->fd = i;
+			sqe->poll32_events = POLLIN;
+			sqe->user_data = RU_POLL + i;
+			q->polling[i] = true;
+		}
+}
+
+/* a folded keyboard is not read at all, like the poll path ignoring it */
+static void ring_park(struct kbdring *q, bool parked)
+{
+	q->parked = parked;
+	if (parked && q->reading) {
+		struct io_uring_sqe *sqe = pburing_sqe(&q->r);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+		sqe->addr = RU_READ;
+		sqe->user_data = RU_CANCEL;
+	}
+}
+
+/* returns nonzero with errno set if the keyboard cannot be read */
+static int ring_input(struct kbdring *q, struct pbkbd *k)
+{
+	int res = q->readres;
+	q->readdone = false;
+	if (q->readflags & IORING_CQE_F_BUFFER) {
+		int bid = q->readflags >> IORING_CQE_BUFFER_SHIFT;
+		int i, n = res > 0 ? res / (int) sizeof(struct input_event) : 0;
+		if (!q->parked)
+			COUNT(ST_WAKE_INPUT);
+		for (i = 0; i < n && !q->parked; i++) {
+			const struct input_event *ev = &q->buf[bid][i];
+			COUNT(ST_EVENTS);
+			/* libevdev would resync, the frame is dropped instead */
+			if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+				LOG(DEBUG, "events dropped\n");
+				q->dropping = true;
+			} else if (q->dropping) {
+				if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+					q->dropping = false;
+					k->scancode = -1;
+					k->scanvalue = -1;
+				}
+			} else {
+				translate_event(k, ev);
+			}
+		}
+		ring_provide(q, bid, 1);
+	}
+	if (res == 0)
+		res = -ENODEV;
+	if (res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+		errno = -res;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * poll() on the ring: arms what is not, waits, and translates the keyboard
+ * input right away. Timer and switch readiness are reported in pfd.
+ */
+static int ring_wait(struct kbdring *q, struct pbkbd *k, struct pollfd *pfd, int timeout)
+{
+	ring_arm(q);
+	COUNT(ST_URING_ENTERS);
+	if (pburing_enter(&q->r, q->ready || q->readdone ? 0 : 1, timeout) < 0 && errno != ETIME)
+		return -1;
+	ring_reap(q);
+	int n = 0;
+	if (q->readdone) {
+		if (ring_input(q, k))
+			return -1;
+		n++;
+	}
+	pfd[0].revents = 0;
+	pfd[1].revents = q->ready & (1 << RF_TIMER) ? POLLIN : 0;
+	pfd[2].revents = q->ready & (1 << RF_SWITCH) ? POLLIN : 0;
+	n += !!pfd[1].revents + !!pfd[2].revents;
+	q->ready = 0;
+	return n;
+}
+
+static int ring_open(struct kbdring *q, struct pbkbd *k, int tfd, int swfd)
+{
+	memset(q, 0, sizeof(*q));
+	if (pburing_init(&q->r, RING_ENTRIES,
+				IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_CQE_SKIP))
+		return 1;
+	q->fds[RF_KBD] = k->kbdfd;
+	q->fds[RF_UINPUT] = uinput_fd(k->uinputdev);
+	q->fds[RF_UINPUTFN] = uinput_fd(k->uinputfndev);
+	q->fds[RF_TIMER] = tfd;
+	q->fds[RF_SWITCH] = swfd;
+	q->uinputfn = k->uinputfndev;
+	if (!pburing_supported(&q->r, IORING_OP_PROVIDE_BUFFERS)) {
+		errno = ENOTSUP;
+		goto fail;
+	}
+	if (pburing_register_files(&q->r, q->fds, RF_MAX))
+		goto fail;
+	ring_provide(q, 0, RING_BUFS);
+	return 0;
+
+fail:;
+	int e = errno;
+	pburing_exit(&q->r);
+	errno = e;
+	return 1;
+}
+
+static int translate_daemon(struct pbkbd *k)
+{
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0) {
+		LOG(ERROR, "cannot create timer: %s\n", errstr);
+		return 1;
+	}
+	struct pbswitch sw;
+	if (pbswitch_open(&sw, input_path, sysinput_path))
+		LOG(WARN, "cannot watch lid and tablet mode: %s\n", errstr);
+	struct pollfd pfd[3] = {
+		{ .fd = k->kbdfd, .events = POLLIN },
+		{ .fd = tfd, .events = POLLIN },
+		{ .fd = pbswitch_fd(&sw), .events = POLLIN },
+	};
+	long long armed = -1;
+
+	static struct kbdring kr;
+	if (use_uring) {
+		if (ring_open(&kr, k, tfd, pbswitch_fd(&sw)))
+			LOG(WARN, "io_uring unavailable, polling: %s\n", errstr);
+		else
+			ring = &kr;
+	}
+	struct kbdring *opened = ring;
+
+	/* the default CLOCK_REALTIME stamps jump with the wall clock */
+	k->stamped = !libevdev_set_clock_id(k->kbddev, CLOCK_MONOTONIC);
+	if (!k->stamped)
+		LOG(WARN, "cannot set the event clock, latency is not recorded\n");
+	if (!k->adopted)
+		translate_flush(k);
+	if (pbswitch_gated(&sw)) {
+		translate_park(k);
+		pfd[0].fd = -1;
+		if (ring != NULL)
+			ring_park(ring, true);
+	}
+
+	struct sdwatchdog wd;
+	sdwatchdog_init(&wd);
+	sd_notify_send("READY=1");
+
+	struct pbstats st;
+	pbstats_init(&st, stat_names, stats, stats_last, ST_MAX);
+	st.extra = latency_dump;
+
+	int ret = 0;
+
+	while (!stop) {
+		if (opened != NULL && ring == NULL) { /* see ring_drop() */
+			pburing_exit(&opened->r);
+			opened = NULL;
+		}
+		long long deadline = dualrole_deadline();
+		if (deadline != armed) {
+			arm_timer(tfd, deadline);
+			armed = deadline;
+		}
+		int timeout = sdwatchdog_timeout(&wd, -1);
+		int r = ring != NULL ? ring_wait(ring, k, pfd, timeout) : poll(pfd, 3, timeout);
+		if (dumpstats) {
+			dumpstats = 0;
+			if (pbstats_write(&st, STATSFILE))
+				LOG(WARN, "cannot write %s: %s\n", STATSFILE, errstr);
+		}
+		if (LOGENABLED(DEBUG) && pbstats_due(&st, STATS_PERIOD)) {
+			printf("DEBUG: ");
+			pbstats_summary(&st, stdout);
+		}
+		if (r == 0) {
+			COUNT(ST_WAKE_WATCHDOG);
+			continue;
+		}
+		if (r < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				COUNT(ST_WAKE_SIGNAL);
+				continue;
+			}
+			LOG(ERROR, "poll failed: %s\n", errstr);
+			ret = 1;
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			uint64_t expirations;
+			if (read(tfd, &expirations, sizeof(expirations)) > 0)
+				armed = -1;
+			COUNT(ST_WAKE_TIMER);
+			dualrole_expire(now_ms());
+		}
+		if (pfd[0].revents & POLLIN) {
+			COUNT(ST_WAKE_INPUT);
+			translate_pending(k);
+		}
+		if (pfd[2].revents & POLLIN) {
+			COUNT(ST_WAKE_SWITCH);
+			if (pbswitch_update(&sw)) {
+				if (pbswitch_gated(&sw))
+					translate_park(k);
+				else
+					translate_unpark(k);
+				pfd[0].fd = pbswitch_gated(&sw) ? -1 : k->kbdfd;
+				if (ring != NULL)
+					ring_park(ring, pbswitch_gated(&sw));
+			}
+		}
+	}
+
+	if (opened != NULL) {
+		pburing_exit(&opened->r);
+		ring = NULL;
+	}
+	pbswitch_close(&sw);
+	close(tfd);
+	return ret;
+}
+
+static void replay_activity(void)
+{
+}
+
+static int replay(const char *path, int rounds)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		LOG(FATAL, "cannot open %s: %s\n", path, errstr);
+		return 1;
+	}
+	struct { long long t; int scan, press; } *trace = NULL;
+	size_t n = 0, cap = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		long long t;
+		int scan, press;
+		if (sscanf(line, "%lld %x %d", &t, &scan, &press) != 3)
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			trace = realloc(trace, cap * sizeof(*trace));
+			if (trace == NULL) {
+				fclose(f);
+				return 1;
+			}
+		}
+		trace[n].t = t;
+		trace[n].scan = scan;
+		trace[n].press = press;
+		n++;
+	}
+	fclose(f);
+	if (n == 0) {
+		LOG(FATAL, "no events in %s\n", path);
+		free(trace);
+		return 1;
+	}
+
+	struct pbkbd k = { .kbdfd = -1, .scancode = -1, .scanvalue = -1, .stamped = true };
+	activity_hook = replay_activity;
+	int perf = perfcount_open();
+	unsigned long long writes = stats[ST_UINPUT_WRITES];
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	perfcount_start(perf);
+	/* the rounds follow each other on the trace clock, a second apart */
+	long long span = trace[n - 1].t - trace[0].t + 1000;
+	int r;
+	size_t i;
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < n; i++) {
+			/* timeouts fire as they would have between the trace's events */
+			replay_ms = r * span + trace[i].t - trace[0].t;
+			dualrole_expire(replay_ms);
+			struct input_event ev[3] = {
+				{ .type = EV_MSC, .code = MSC_SCAN, .value = trace[i].scan },
+				{ .type = EV_KEY, .code = KEY_UNKNOWN, .value = trace[i].press },
+				{ .type = EV_SYN, .code = SYN_REPORT },
+			};
+			/* as if read right away, the latency is the translation's */
+			long long us = pblat_now_us();
+			ev[2].time.tv_sec = us / 1000000;
+			ev[2].time.tv_usec = us % 1000000;
+			translate_event(&k, &ev[0]);
+			translate_event(&k, &ev[1]);
+			translate_event(&k, &ev[2]);
+		}
+	long long instructions = perfcount_stop(perf);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	replay_ms = -1;
+	if (perf >= 0)
+		close(perf);
+	free(trace);
+
+	double total = (double) n * rounds;
+	double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	printf("pbkbd: %.0f keystrokes, %.1f ns/keystroke, ", total, ns / total);
+	if (instructions >= 0)
+		printf("%.1f instructions/keystroke, ", instructions / total);
+	else
+		printf("instructions n/a, ");
+	printf("%.2f uinput writes/keystroke\n", (stats[ST_UINPUT_WRITES] - writes) / total);
+	for (i = 0; i < LAT_MAX; i++)
+		if (latency[i].n)
+			printf("%-10s %8llu keystrokes, p50 %lld us, p99 %lld us, max %lld us\n",
+					latency_names[i], latency[i].n, pblat_percentile(&latency[i], 500),
+					pblat_percentile(&latency[i], 990), latency[i].max);
+	return 0;
+}
+
+/*
+ * Restarts without device churn. The grabbed keyboard and both uinput
+ * devices go to systemd's fd store as soon as they are open, so they outlive
+ * the process, and a clean exit adds the key state. The next instance is
+ * passed all of it, takes the devices over as they are and translates what
+ * was typed in between. When the service stops for good, systemd closes the
+ * fds and the devices go away with them. After a crash only the devices are
+ * there to take over, keys held at the time may stick until pressed again.
+ * An instance with another keymap starts over instead: the held keys would
+ * be released as other codes, and the uinput devices lack the new ones.
+ */
+enum {
+	HO_KBD,
+	HO_UINPUT,
+	HO_UINPUTFN,
+	HO_STATE,
+	HO_MAX
+};
+static const char *const handoff_names[HO_MAX] = { "kbd", "uinput", "uinputfn", "state" };
+static bool handoff = false; /* the devices are in the fd store */
+
+#define HANDOFF_MAGIC 0x4f48424b /* "KBHO" */
+
+struct handoff_state {
+	uint32_t magic;
+	uint32_t size; /* tells builds with another layout apart */
+	uint32_t keymap; /* keymap_hash() */
+	int32_t scancode;
+	int32_t scanvalue;
+	struct {
+		uint8_t state;
+		long long deadline;
+	} dualrole[dualrole_size];
+	bool down[keymap_key_max + 1];
+	bool fnpressed[keymap_key_max + 1];
+	bool brightness_taken[keymap_key_max + 1];
+};
+
+static void handoff_remove(const char *name)
+{
+	char msg[64];
+	snprintf(msg, sizeof(msg), "FDSTOREREMOVE=1\nFDNAME=%s", name);
+	sd_notify_send(msg);
+}
+
+static int handoff_store_fd(const char *name, int fd)
+{
+	char msg[64];
+	snprintf(msg, sizeof(msg), "FDSTORE=1\nFDNAME=%s", name);
+	return sd_notify_fds(msg, &fd, 1);
+}
+
+static uint32_t fnv1a(uint32_t h, const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+	while (n--)
+		h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+/* of every key code the uinput devices were created for and the state refers to */
+static uint32_t keymap_hash(void)
+{
+	uint32_t h = 2166136261u;
+	h = fnv1a(h, keymap_direct, sizeof(keymap_direct));
+	h = fnv1a(h, keymap_fn, sizeof(keymap_fn));
+	size_t i;
+	for (i = 0; i < keymap_combo_size; i++) {
+		const int *p;
+		for (p = keymap_combo[i]; *p > 0; p++)
+			h = fnv1a(h, p, sizeof(*p));
+	}
+	return h;
+}
+
+/* whether fd holds the state of an instance with the same layout and keymap */
+static bool handoff_read(int fd, struct handoff_state *h)
+{
+	return pread(fd, h, sizeof(*h), 0) == sizeof(*h) && h->magic == HANDOFF_MAGIC &&
+		h->size == sizeof(*h) && h->keymap == keymap_hash();
+}
+
+static void handoff_load(struct pbkbd *k, const struct handoff_state *h)
+{
+	k->scancode = h->scancode;
+	k->scanvalue = h->scanvalue;
+	size_t i;
+	for (i = 0; i < dualrole_size; i++) {
+		dualrole[i].state = h->dualrole[i].state;
+		dualrole[i].deadline = h->dualrole[i].deadline;
+	}
+	memcpy(k->down, h->down, sizeof(k->down));
+	memcpy(fnpressed, h->fnpressed, sizeof(fnpressed));
+	memcpy(brightness_taken, h->brightness_taken, sizeof(brightness_taken));
+}
+
+/* takes over the devices of the previous instance, nonzero if there are none */
+static int handoff_adopt(struct pbkbd *k)
+{
+	int fd[HO_MAX], i;
+	bool any = false, all = true;
+	for (i = 0; i < HO_MAX; i++) {
+		fd[i] = sd_listen_fd(handoff_names[i]);
+		if (fd[i] >= 0)
+			fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+		if (i != HO_STATE) {
+			any |= fd[i] >= 0;
+			all &= fd[i] >= 0;
+		}
+	}
+	struct handoff_state h;
+	bool state = fd[HO_STATE] >= 0 && handoff_read(fd[HO_STATE], &h);
+	if (all && fd[HO_STATE] >= 0 && !state) {
+		LOG(WARN, "previous instance had another keymap or version, starting over\n");
+		all = false;
+	}
+	if (all && libevdev_new_from_fd(fd[HO_KBD], &k->kbddev) == 0) {
+		memset(k->down, 0, sizeof(k->down));
+		k->scancode = -1;
+		k->scanvalue = -1;
+		k->stamped = false;
+		k->adopted = true;
+		k->kbdfd = fd[HO_KBD];
+		adopted[0].fd = fd[HO_UINPUT];
+		adopted[1].fd = fd[HO_UINPUTFN];
+		k->uinputdev = (struct libevdev_uinput *) &adopted[0];
+		k->uinputfndev = (struct libevdev_uinput *) &adopted[1];
+		if (state)
+			handoff_load(k, &h);
+		else
+			LOG(WARN, "no key state from the previous instance, held keys may stick\n");
+		LOG(INFO, "took over the devices of the previous instance\n");
+		handoff = true;
+	} else if (any) {
+		/* left as they are, they would stay around next to new ones */
+		LOG(WARN, "cannot take over the devices of the previous instance\n");
+		for (i = 0; i < HO_STATE; i++)
+			if (fd[i] >= 0) {
+				handoff_remove(handoff_names[i]);
+				close(fd[i]);
+			}
+	}
+	if (fd[HO_STATE] >= 0) {
+		handoff_remove(handoff_names[HO_STATE]);
+		close(fd[HO_STATE]);
+	}
+	return !handoff;
+}
+
+/* hands freshly opened devices to the fd store */
+static void handoff_store(struct pbkbd *k)
+{
+	if (getenv("NOTIFY_SOCKET") == NULL)
+		return;
+	int fd[HO_STATE] = {
+		k->kbdfd,
+		libevdev_uinput_get_fd(k->uinputdev),
+		libevdev_uinput_get_fd(k->uinputfndev),
+	};
+	int i;
+	for (i = 0; i < HO_STATE; i++)
+		if (handoff_store_fd(handoff_names[i], fd[i])) {
+			LOG(WARN, "cannot store the devices for restarts: %s\n", errstr);
+			return;
+		}
+	handoff = true;
+}
+
+/* leaves the devices grabbed and in place for the next instance */
+static void handoff_leave(struct pbkbd *k)
+{
+	struct handoff_state h;
+	memset(&h, 0, sizeof(h));
+	h.magic = HANDOFF_MAGIC;
+	h.size = sizeof(h);
+	h.keymap = keymap_hash();
+	h.scancode = k->scancode;
+	h.scanvalue = k->scanvalue;
+	size_t i;
+	for (i = 0; i < dualrole_size; i++) {
+		h.dualrole[i].state = dualrole[i].state;
+		h.dualrole[i].deadline = dualrole[i].deadline;
+	}
+	memcpy(h.down, k->down, sizeof(h.down));
+	memcpy(h.fnpressed, fnpressed, sizeof(h.fnpressed));
+	memcpy(h.brightness_taken, brightness_taken, sizeof(h.brightness_taken));
+
+	int fd = syscall(SYS_memfd_create, "pbkbd-state", MFD_CLOEXEC);
+	if (fd < 0 || write(fd, &h, sizeof(h)) != sizeof(h) ||
+			handoff_store_fd(handoff_names[HO_STATE], fd))
+		LOG(WARN, "cannot store the key state: %s\n", errstr);
+	if (fd >= 0)
+		close(fd);
+	/* no ungrab and no UI_DEV_DESTROY, both would reach the stored copies */
+	libevdev_free(k->kbddev);
+	close(k->kbdfd);
+}
+
+static int start_daemon(void)
+{
+	LOG(DEBUG, "starting daemon\n");
+
+	LOG(DEBUG2, "setting up signal handlers\n");
+	if (sigsetup()) {
+		LOG(FATAL, "cannot set up signal handlers: %s\n", errstr);
+		return 1;
+	}
+
+	struct pbkbd k = { .kbdfd = -1 };
+	if (!handoff_adopt(&k)) {
+		priosetup();
+	} else {
+		if (pbkbd_open(&k))
+			return 1;
+		handoff_store(&k);
+	}
+
+	int ret = translate_daemon(&k);
+
+	if (handoff)
+		handoff_leave(&k);
+	else
+		pbkbd_close(&k);
 
 	return ret;
 }
@@ -438,7 +1754,10 @@ exit_close_kbdfd:
 int main(int argc, char **argv)
 {
 	int c;
-	while ((c = getopt(argc, argv, "vq")) > 0)
+	const char *replaypath = NULL;
+	const char *keymap = NULL;
+	int rounds = 1;
+	while ((c = getopt(argc, argv, "vqubt:k:r:n:")) > 0)
 		switch (c) {
 		case 'v':
 			verbosity++;
@@ -446,11 +1765,36 @@ int main(int argc, char **argv)
 		case 'q':
 			verbosity--;
 			break;
+		case 't':
+			hold_timeout = atoi(optarg);
+			break;
+		case 'u':
+			use_uring = true;
+			break;
+		case 'b':
+			brightness_hook = brightness_send;
+			break;
+		case 'k':
+			keymap = optarg;
+			break;
+		case 'r':
+			replaypath = optarg;
+			break;
+		case 'n':
+			rounds = atoi(optarg);
+			break;
 		default:
 			LOG(ERROR, "unknown option %c\n", (char) c);
 			print_help((argc == 0) ? "pbkbd" : argv[0]);
 			return 1;
 		}
 
+	if (keymap_select(keymap)) {
+		LOG(FATAL, "unknown keymap %s\n", keymap);
+		return 1;
+	}
+	if (replaypath != NULL)
+		return replay(replaypath, rounds);
 	return start_daemon();
 }
+#endif
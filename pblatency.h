@@ -0,0 +1,88 @@
+#ifndef PB_LATENCY_H
+#define PB_LATENCY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Latency histograms in microseconds. Buckets are logarithmic with four per
+ * power of two, so a bucket is at most 25% wide, from 1 us to beyond a day.
+ * Recording only touches a fixed array, percentiles are computed when the
+ * histogram is dumped and are the upper bound of their bucket.
+ */
+#define PBLAT_SUB 4
+#define PBLAT_BUCKETS (38 * PBLAT_SUB)
+
+struct pblat {
+	unsigned long long bucket[PBLAT_BUCKETS];
+	unsigned long long n;
+	long long max;
+};
+
+static inline long long pblat_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static inline int pblat_index(long long us)
+{
+	if (us < PBLAT_SUB)
+		return us < 0 ? 0 : us;
+	int e = 63 - __builtin_clzll(us);
+	int i = (e - 1) * PBLAT_SUB + ((us >> (e - 2)) & (PBLAT_SUB - 1));
+	return i < PBLAT_BUCKETS ? i : PBLAT_BUCKETS - 1;
+}
+
+/* smallest value of bucket i */
+static inline long long pblat_lower(int i)
+{
+	if (i < PBLAT_SUB)
+		return i;
+	return (long long) (PBLAT_SUB + i % PBLAT_SUB) << (i / PBLAT_SUB - 1);
+}
+
+static inline void pblat_add(struct pblat *h, long long us)
+{
+	h->bucket[pblat_index(us)]++;
+	h->n++;
+	if (us > h->max)
+		h->max = us;
+}
+
+/* q in thousandths */
+static inline long long pblat_percentile(const struct pblat *h, int q)
+{
+	if (h->n == 0)
+		return 0;
+	unsigned long long rank = (h->n * q + 999) / 1000, seen = 0;
+	int i;
+	for (i = 0; i < PBLAT_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+	long long upper = i < PBLAT_BUCKETS - 1 ? pblat_lower(i + 1) - 1 : h->max;
+	return upper < h->max ? upper : h->max;
+}
+
+/* "name value" lines in the format of pbstats_dump */
+static inline void pblat_dump(const struct pblat *h, const char *name, FILE *f)
+{
+	fprintf(f, "latency_%s_count %llu\n"
+			"latency_%s_p50_us %lld\n"
+			"latency_%s_p90_us %lld\n"
+			"latency_%s_p99_us %lld\n"
+			"latency_%s_p999_us %lld\n"
+			"latency_%s_max_us %lld\n",
+			name, h->n,
+			name, pblat_percentile(h, 500),
+			name, pblat_percentile(h, 900),
+			name, pblat_percentile(h, 990),
+			name, pblat_percentile(h, 999),
+			name, h->max);
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef PB_MODULES_H
+#define PB_MODULES_H
+
+/*
+ * Entry points of the daemons when built as modules of pixelbookd,
+ * compiled with PB_COMBINED. Deadlines are CLOCK_MONOTONIC milliseconds.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* pbkbd.c */
+int pbkbd_module_start(int verbose);
+int pbkbd_module_fd(void);
+void pbkbd_module_dispatch(void);
+void pbkbd_module_set_activity(void (*hook)(void));
+void pbkbd_module_set_brightness(int (*hook)(int steps)); /* brightness keys, 0 if taken */
+void pbkbd_module_set_hold_timeout(int ms); /* 0 disables */
+long long pbkbd_module_deadline(void); /* -1 if nothing is pending */
+void pbkbd_module_timer(long long now);
+void pbkbd_module_park(int parked); /* the caller stops polling the fd */
+void pbkbd_module_stop(void);
+
+/* pbkbd-backlight.c */
+void kbdbl_module_use_ec(void); /* before start */
+int kbdbl_module_start(const char *config);
+int kbdbl_module_fd(void); /* config watch, -1 if unavailable */
+long long kbdbl_module_deadline(void); /* -1 while idle */
+void kbdbl_module_dispatch(long long now);
+void kbdbl_module_config_event(void);
+void kbdbl_module_activity(void);
+void kbdbl_module_gate(int gated);
+void kbdbl_module_power(int online, int capacity); /* as pbpower reads them */
+void kbdbl_module_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,733 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libevdev/libevdev-uinput.h>
+#include <libevdev/libevdev.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sdnotify.h"
+
+#define IIODEVS "/sys/bus/iio/devices"
+#define UDEVDATA "/run/udev/data"
+#define STATEFILE "/run/pborient"
+
+#define ACCEL_NAME "cros-ec-accel"
+
+#define SAMPLERATE "2" /* Hz */
+#define FIFO_TIMEOUT "1" /* seconds the EC may batch samples */
+#define SMOOTHING 0.5 /* weight of a new sample */
+
+#define GRAVITY 9.80665
+#define PI 3.14159265358979323846
+#define FLAT_THRESHOLD 0.35 /* screen plane gravity below this ratio keeps orientation */
+#define ORIENT_HYSTERESIS 15 /* degrees past the 45 degree boundary before rotating */
+#define ORIENT_DEBOUNCE 1000 /* ms */
+#define HINGE_THRESHOLD 0.35 /* gravity along the hinge above this ratio keeps tablet mode */
+#define TABLET_ENTER 200 /* degrees */
+#define TABLET_LEAVE 160
+#define HINGE_AMBIGUOUS 20 /* degrees from closed or fully folded, which look alike */
+#define TABLET_DEBOUNCE 1000 /* ms */
+
+static void print_help(const char *progname)
+{
+	printf("usage: %s [-vqs] [-r trace] [-w trace]\n"
+			"Pixelbook orientation and tablet mode daemon.\n"
+			"Options:\n"
+			"  -v  increase verbosity\n"
+			"  -q  decrease verbosity\n"
+			"  -s  report tablet mode through a uinput switch device\n"
+			"  -r  replay a recorded trace instead of reading the sensors\n"
+			"  -w  record samples to a trace\n"
+			"Traces are lines of '<ms> <lid x y z> <base x y z>', the raw samples\n"
+			"in m/s^2 after the mount matrix is applied, nan for a sensor not read.\n"
+			, progname);
+}
+
+#define errstr strerror(errno)
+
+enum {
+	FATAL,
+	ERROR,
+	WARN,
+	INFO,
+	DEBUG, /* show less debug info */
+	DEBUG2, /* show more debug info */
+	DEBUG3, /* log all samples */
+};
+static int verbosity = INFO;
+#define LOGENABLED(lvl) (verbosity >= (lvl))
+#define LOG(lvl, ...) do { \
+	if (LOGENABLED(lvl)) \
+	printf(#lvl ": " __VA_ARGS__); \
+} while (0)
+
+static int stop = 0;
+
+static void sighandler(int sig)
+{
+	(void) sig;
+	stop = 1;
+}
+
+static int sigsetup(void)
+{
+	struct sigaction sa = {
+		.sa_handler = sighandler
+	};
+	if (sigaction(SIGHUP, &sa, NULL) ||
+			sigaction(SIGINT, &sa, NULL) ||
+			sigaction(SIGTERM, &sa, NULL))
+		return 1;
+	return 0;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int readstr(int d, const char *path, char *buf, size_t size)
+{
+	int f = openat(d, path, O_RDONLY);
+	if (f < 0)
+		return 1;
+	ssize_t s = read(f, buf, size - 1);
+	close(f);
+	if (s < 0)
+		return 1;
+	buf[s] = 0;
+	char *nl = strchr(buf, '\n');
+	if (nl != NULL)
+		*nl = 0;
+	return 0;
+}
+
+static int writestr(int d, const char *path, const char *v)
+{
+	int f = openat(d, path, O_WRONLY);
+	if (f < 0)
+		return 1;
+	int r = 0;
+	if (write(f, v, strlen(v)) < 0)
+		r = 1;
+	close(f);
+	return r;
+}
+
+/* sensors */
+
+struct channel {
+	int index;
+	int bytes;
+	int bits;
+	int shift;
+	bool is_signed;
+	bool be;
+	int offset;
+};
+
+struct accel {
+	char name[NAME_MAX + 1]; /* iio:deviceN */
+	int dir;
+	int fd;
+	double scale;
+	double matrix[3][3];
+	struct channel ch[3];
+	int scansize;
+	double g[3]; /* filtered, device frame */
+	bool valid;
+};
+
+static int parse_matrix(const char *s, double m[3][3])
+{
+	return sscanf(s, "%lf , %lf , %lf ; %lf , %lf , %lf ; %lf , %lf , %lf",
+			&m[0][0], &m[0][1], &m[0][2],
+			&m[1][0], &m[1][1], &m[1][2],
+			&m[2][0], &m[2][1], &m[2][2]) != 9;
+}
+
+/* the udev rules set ACCEL_MOUNT_MATRIX, fall back to the kernel's mount matrix */
+static void load_matrix(struct accel *a)
+{
+	static const double identity[3][3] = {
+		{ 1, 0, 0 },
+		{ 0, 1, 0 },
+		{ 0, 0, 1 }
+	};
+	memcpy(a->matrix, identity, sizeof(identity));
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), UDEVDATA "/+iio:%s", a->name);
+	FILE *f = fopen(path, "r");
+	if (f != NULL) {
+		char line[256];
+		while (fgets(line, sizeof(line), f) != NULL)
+			if (!strncmp(line, "E:ACCEL_MOUNT_MATRIX=", 21) &&
+					!parse_matrix(line + 21, a->matrix)) {
+				fclose(f);
+				LOG(DEBUG, "%s: using udev mount matrix\n", a->name);
+				return;
+			}
+		fclose(f);
+	}
+
+	char buf[256];
+	if ((!readstr(a->dir, "in_accel_mount_matrix", buf, sizeof(buf)) ||
+				!readstr(a->dir, "mount_matrix", buf, sizeof(buf))) &&
+			!parse_matrix(buf, a->matrix)) {
+		LOG(DEBUG, "%s: using kernel mount matrix\n", a->name);
+		return;
+	}
+	memcpy(a->matrix, identity, sizeof(identity));
+}
+
+static int setup_channel(struct accel *a, const char *axis, struct channel *ch)
+{
+	char path[64], buf[64];
+	snprintf(path, sizeof(path), "scan_elements/in_accel_%s_en", axis);
+	if (writestr(a->dir, path, "1"))
+		return 1;
+	snprintf(path, sizeof(path), "scan_elements/in_accel_%s_index", axis);
+	if (readstr(a->dir, path, buf, sizeof(buf)))
+		return 1;
+	ch->index = atoi(buf);
+	snprintf(path, sizeof(path), "scan_elements/in_accel_%s_type", axis);
+	if (readstr(a->dir, path, buf, sizeof(buf)))
+		return 1;
+	/* e.g. le:s16/16>>0 */
+	char endian, sign;
+	int bits, storage, shift = 0;
+	if (sscanf(buf, "%ce:%c%d/%d>>%d", &endian, &sign, &bits, &storage, &shift) < 4 ||
+			storage % 8 || storage > 64)
+		return 1;
+	ch->be = endian == 'b';
+	ch->is_signed = sign == 's';
+	ch->bits = bits;
+	ch->bytes = storage / 8;
+	ch->shift = shift;
+	return 0;
+}
+
+/* only the three axes are enabled, lay them out by scan index with natural alignment */
+static void layout_scan(struct accel *a)
+{
+	struct channel *order[3] = { &a->ch[0], &a->ch[1], &a->ch[2] };
+	int i, j;
+	for (i = 0; i < 3; i++)
+		for (j = i + 1; j < 3; j++)
+			if (order[j]->index < order[i]->index) {
+				struct channel *t = order[i];
+				order[i] = order[j];
+				order[j] = t;
+			}
+	int off = 0, align = 1;
+	for (i = 0; i < 3; i++) {
+		int b = order[i]->bytes;
+		off = (off + b - 1) / b * b;
+		order[i]->offset = off;
+		off += b;
+		if (b > align)
+			align = b;
+	}
+	a->scansize = (off + align - 1) / align * align;
+}
+
+static void disable_other_channels(struct accel *a)
+{
+	int d = openat(a->dir, "scan_elements", O_RDONLY | O_DIRECTORY);
+	if (d < 0)
+		return;
+	DIR *dd = fdopendir(d);
+	if (dd == NULL) {
+		close(d);
+		return;
+	}
+	struct dirent *e;
+	for (e = readdir(dd); e != NULL; e = readdir(dd)) {
+		size_t l = strlen(e->d_name);
+		if (l < 3 || strcmp(e->d_name + l - 3, "_en"))
+			continue;
+		writestr(dirfd(dd), e->d_name, "0");
+	}
+	closedir(dd);
+}
+
+static int open_accel(struct accel *a)
+{
+	char buf[64];
+	if (readstr(a->dir, "in_accel_scale", buf, sizeof(buf)) &&
+			readstr(a->dir, "scale", buf, sizeof(buf))) {
+		LOG(ERROR, "%s: no scale\n", a->name);
+		return 1;
+	}
+	a->scale = strtod(buf, NULL);
+	load_matrix(a);
+
+	writestr(a->dir, "buffer/enable", "0");
+	disable_other_channels(a);
+	if (setup_channel(a, "x", &a->ch[0]) ||
+			setup_channel(a, "y", &a->ch[1]) ||
+			setup_channel(a, "z", &a->ch[2])) {
+		LOG(ERROR, "%s: cannot set up scan elements\n", a->name);
+		return 1;
+	}
+	layout_scan(a);
+
+	if (writestr(a->dir, "sampling_frequency", SAMPLERATE) &&
+			writestr(a->dir, "in_accel_sampling_frequency", SAMPLERATE))
+		LOG(WARN, "%s: cannot set sampling frequency\n", a->name);
+	writestr(a->dir, "buffer/hwfifo_timeout", FIFO_TIMEOUT);
+	writestr(a->dir, "buffer/length", "16");
+	if (writestr(a->dir, "buffer/enable", "1")) {
+		LOG(ERROR, "%s: cannot enable buffer: %s\n", a->name, errstr);
+		return 1;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/dev/%s", a->name);
+	a->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (a->fd < 0) {
+		LOG(ERROR, "cannot open %s: %s\n", path, errstr);
+		writestr(a->dir, "buffer/enable", "0");
+		return 1;
+	}
+	return 0;
+}
+
+static void close_accel(struct accel *a)
+{
+	if (a->fd >= 0) {
+		close(a->fd);
+		writestr(a->dir, "buffer/enable", "0");
+	}
+	if (a->dir >= 0)
+		close(a->dir);
+}
+
+static int find_accels(struct accel *lid, struct accel *base)
+{
+	DIR *dd = opendir(IIODEVS);
+	if (dd == NULL)
+		return 1;
+
+	struct dirent *e;
+	for (e = readdir(dd); e != NULL; e = readdir(dd)) {
+		if (!(strlen(e->d_name) > 10 &&
+					!memcmp(e->d_name, "iio:device", 10)))
+			continue;
+		int d = openat(dirfd(dd), e->d_name, O_RDONLY | O_DIRECTORY);
+		if (d < 0)
+			continue;
+		char buf[64];
+		struct accel *a = NULL;
+		if (!readstr(d, "name", buf, sizeof(buf)) && !strcmp(buf, ACCEL_NAME) &&
+				!readstr(d, "location", buf, sizeof(buf))) {
+			if (!strcmp(buf, "lid"))
+				a = lid;
+			else if (!strcmp(buf, "base"))
+				a = base;
+		}
+		if (a == NULL || a->dir >= 0) {
+			close(d);
+			continue;
+		}
+		LOG(INFO, "found %s accelerometer %s\n", buf, e->d_name);
+		snprintf(a->name, sizeof(a->name), "%s", e->d_name);
+		a->dir = d;
+	}
+	closedir(dd);
+
+	return lid->dir < 0;
+}
+
+static double channel_value(const struct channel *ch, const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i = 0; i < ch->bytes; i++)
+		v |= (uint64_t) p[ch->be ? i : ch->bytes - 1 - i] << (8 * (ch->bytes - 1 - i));
+	v >>= ch->shift;
+	if (ch->bits < 64)
+		v &= (1ULL << ch->bits) - 1;
+	if (ch->is_signed && ch->bits < 64 && (v >> (ch->bits - 1)) & 1)
+		return (double) (int64_t) (v | ~((1ULL << ch->bits) - 1));
+	return (double) (int64_t) v;
+}
+
+/* reads all pending scans, returns the last one in device frame */
+static int read_accel(struct accel *a, double out[3])
+{
+	uint8_t buf[256];
+	int scans = 0;
+	ssize_t s;
+	while ((s = read(a->fd, buf, sizeof(buf) / a->scansize * a->scansize)) >= a->scansize) {
+		const uint8_t *last = buf + (s / a->scansize - 1) * a->scansize;
+		double raw[3];
+		int i, j;
+		for (i = 0; i < 3; i++)
+			raw[i] = channel_value(&a->ch[i], last + a->ch[i].offset) * a->scale;
+		for (i = 0; i < 3; i++) {
+			out[i] = 0;
+			for (j = 0; j < 3; j++)
+				out[i] += a->matrix[i][j] * raw[j];
+		}
+		scans++;
+	}
+	return scans;
+}
+
+/* state */
+
+enum {
+	ORIENT_UNDEFINED = -1,
+	ORIENT_NORMAL,
+	ORIENT_RIGHT_UP,
+	ORIENT_BOTTOM_UP,
+	ORIENT_LEFT_UP,
+};
+static const char * const orient_names[] = {
+	"normal",
+	"right-up",
+	"bottom-up",
+	"left-up",
+};
+
+struct debounce {
+	int cur;
+	int cand;
+	long long since;
+};
+
+static bool debounce(struct debounce *d, int v, long long now, long long hold)
+{
+	if (v == d->cur) {
+		d->cand = v;
+		return false;
+	}
+	if (v != d->cand) {
+		d->cand = v;
+		d->since = now;
+	}
+	if (now - d->since < hold)
+		return false;
+	d->cur = v;
+	return true;
+}
+
+static void lowpass(double f[3], const double v[3], bool *valid)
+{
+	int i;
+	for (i = 0; i < 3; i++)
+		f[i] = *valid ? f[i] + SMOOTHING * (v[i] - f[i]) : v[i];
+	*valid = true;
+}
+
+/*
+ * Android axis convention: an upright screen reads +y, right edge up reads
+ * +x. The orientation only changes once gravity is past the 45 degree
+ * boundary by ORIENT_HYSTERESIS.
+ */
+static int orientation_of(const double g[3], int cur)
+{
+	if (hypot(g[0], g[1]) < FLAT_THRESHOLD * GRAVITY)
+		return cur;
+	double a = atan2(g[0], g[1]) * 180 / PI;
+	if (cur != ORIENT_UNDEFINED &&
+			fabs(remainder(a - cur * 90, 360)) <= 45 + ORIENT_HYSTERESIS)
+		return cur;
+	long q = lround(a / 90);
+	return (int) ((q + 4) % 4);
+}
+
+/*
+ * Hinge angle from the lid and base gravity around the hinge (x) axis,
+ * 90 degrees for an upright screen on a flat base, 180 degrees when both
+ * halves are coplanar. Returns -1 when the hinge is
+ * too close to vertical for the angle to be meaningful.
+ */
+static double hinge_angle(const double lid[3], const double base[3])
+{
+	if (hypot(lid[1], lid[2]) < HINGE_THRESHOLD * GRAVITY ||
+			hypot(base[1], base[2]) < HINGE_THRESHOLD * GRAVITY)
+		return -1;
+	double a = atan2(base[1] * lid[2] - base[2] * lid[1],
+			base[1] * lid[1] + base[2] * lid[2]) * 180 / PI;
+	return 180 + a;
+}
+
+static int tablet_of(double angle, int cur)
+{
+	if (angle < 0 || angle < HINGE_AMBIGUOUS || angle > 360 - HINGE_AMBIGUOUS)
+		return cur;
+	if (angle > TABLET_ENTER)
+		return 1;
+	if (angle < TABLET_LEAVE)
+		return 0;
+	return cur;
+}
+
+/* publishing */
+
+static struct libevdev_uinput *open_switchdev(void)
+{
+	struct libevdev *refdev = libevdev_new();
+	libevdev_set_name(refdev, "Pixelbook tablet mode switch");
+	libevdev_enable_event_type(refdev, EV_SYN);
+	libevdev_enable_event_code(refdev, EV_SYN, SYN_REPORT, NULL);
+	libevdev_enable_event_type(refdev, EV_SW);
+	libevdev_enable_event_code(refdev, EV_SW, SW_TABLET_MODE, NULL);
+
+	struct libevdev_uinput *r;
+	if (libevdev_uinput_create_from_device(refdev,
+				LIBEVDEV_UINPUT_OPEN_MANAGED, &r))
+		r = NULL;
+	libevdev_free(refdev);
+	return r;
+}
+
+static const char *statefile = STATEFILE;
+
+static int publish(long long now, int orient, int tablet, struct libevdev_uinput *sw)
+{
+	LOG(INFO, "%lld: orientation %s, tablet mode %s\n", now,
+			orient == ORIENT_UNDEFINED ? "undefined" : orient_names[orient],
+			tablet ? "on" : "off");
+
+	if (sw != NULL && tablet >= 0) {
+		libevdev_uinput_write_event(sw, EV_SW, SW_TABLET_MODE, tablet);
+		libevdev_uinput_write_event(sw, EV_SYN, SYN_REPORT, 0);
+	}
+
+	if (statefile == NULL)
+		return 0;
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", statefile);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		LOG(WARN, "cannot write %s: %s\n", tmp, errstr);
+		return 1;
+	}
+	fprintf(f, "ORIENTATION=%s\nTABLET_MODE=%d\n",
+			orient == ORIENT_UNDEFINED ? "undefined" : orient_names[orient],
+			tablet > 0);
+	if (fclose(f) || rename(tmp, statefile)) {
+		LOG(WARN, "cannot write %s: %s\n", statefile, errstr);
+		unlink(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+struct state {
+	struct debounce orient;
+	struct debounce tablet;
+	struct libevdev_uinput *sw;
+	FILE *record;
+};
+
+static void process(struct state *st, long long now,
+		const double lid[3], const double base[3], bool hasbase)
+{
+	LOG(DEBUG3, "%lld lid %.2f %.2f %.2f base %.2f %.2f %.2f\n", now,
+			lid[0], lid[1], lid[2],
+			base[0], base[1], base[2]);
+
+	bool changed = debounce(&st->orient,
+			orientation_of(lid, st->orient.cur), now, ORIENT_DEBOUNCE);
+	if (hasbase) {
+		double angle = hinge_angle(lid, base);
+		LOG(DEBUG2, "hinge angle %.0f\n", angle);
+		changed |= debounce(&st->tablet,
+				tablet_of(angle, st->tablet.cur), now, TABLET_DEBOUNCE);
+	}
+	if (changed)
+		publish(now, st->orient.cur, st->tablet.cur, st->sw);
+}
+
+/* the unfiltered samples of one wakeup, NULL for a sensor not read */
+static void record(FILE *f, long long now, const double lid[3], const double base[3])
+{
+	static const double none[3] = { NAN, NAN, NAN };
+	if (lid == NULL)
+		lid = none;
+	if (base == NULL)
+		base = none;
+	fprintf(f, "%lld %.3f %.3f %.3f %.3f %.3f %.3f\n", now,
+			lid[0], lid[1], lid[2], base[0], base[1], base[2]);
+}
+
+static int replay(struct state *st, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		LOG(FATAL, "cannot open %s: %s\n", path, errstr);
+		return 1;
+	}
+	bool lidvalid = false, basevalid = false;
+	double lid[3] = { }, base[3] = { };
+	char line[256];
+	while (!stop && fgets(line, sizeof(line), f) != NULL) {
+		long long t;
+		double l[3], b[3];
+		if (sscanf(line, "%lld %lf %lf %lf %lf %lf %lf", &t,
+					&l[0], &l[1], &l[2], &b[0], &b[1], &b[2]) != 7)
+			continue;
+		/* filtered like sensor_daemon() does, only what was read */
+		if (!isnan(b[0]))
+			lowpass(base, b, &basevalid);
+		if (!isnan(l[0]))
+			lowpass(lid, l, &lidvalid);
+		if (lidvalid)
+			process(st, t, lid, base, basevalid);
+	}
+	fclose(f);
+	return 0;
+}
+
+static int sensor_daemon(struct state *st)
+{
+	int ret = 1;
+	struct accel lid = { .dir = -1, .fd = -1 };
+	struct accel base = { .dir = -1, .fd = -1 };
+	if (find_accels(&lid, &base)) {
+		LOG(FATAL, "lid accelerometer not found\n");
+		goto exit;
+	}
+	if (open_accel(&lid))
+		goto exit;
+	if (base.dir >= 0 && open_accel(&base)) {
+		LOG(WARN, "base accelerometer unusable, tablet mode disabled\n");
+		close_accel(&base);
+		base.dir = -1;
+		base.fd = -1;
+	}
+	if (base.fd < 0)
+		st->tablet.cur = -1;
+
+	publish(now_ms(), st->orient.cur, st->tablet.cur, st->sw);
+
+	struct sdwatchdog wd;
+	sdwatchdog_init(&wd);
+	sd_notify_send("READY=1");
+
+	struct pollfd pfd[2] = {
+		{ .fd = lid.fd, .events = POLLIN },
+		{ .fd = base.fd, .events = POLLIN },
+	};
+	while (!stop) {
+		if (poll(pfd, base.fd < 0 ? 1 : 2, sdwatchdog_timeout(&wd, -1)) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG(ERROR, "poll failed: %s\n", errstr);
+			goto exit;
+		}
+		double lv[3], bv[3];
+		bool gotlid = false, gotbase = false;
+		if ((pfd[1].revents & POLLIN) && read_accel(&base, bv) > 0) {
+			lowpass(base.g, bv, &base.valid);
+			gotbase = true;
+		}
+		if ((pfd[0].revents & POLLIN) && read_accel(&lid, lv) > 0) {
+			lowpass(lid.g, lv, &lid.valid);
+			gotlid = true;
+		}
+		if (!gotlid && !gotbase)
+			continue;
+		long long now = now_ms();
+		if (st->record != NULL)
+			record(st->record, now, gotlid ? lv : NULL, gotbase ? bv : NULL);
+		if (lid.valid)
+			process(st, now, lid.g, base.g, base.valid);
+	}
+	ret = 0;
+
+exit:
+	close_accel(&base);
+	close_accel(&lid);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *replaypath = NULL;
+	const char *recordpath = NULL;
+	bool useswitch = false;
+	int c;
+	while ((c = getopt(argc, argv, "vqsr:w:")) > 0)
+		switch (c) {
+		case 'v':
+			verbosity++;
+			break;
+		case 'q':
+			verbosity--;
+			break;
+		case 's':
+			useswitch = true;
+			break;
+		case 'r':
+			replaypath = optarg;
+			break;
+		case 'w':
+			recordpath = optarg;
+			break;
+		default:
+			LOG(ERROR, "unknown option %c\n", (char) c);
+			print_help((argc == 0) ? "pborient" : argv[0]);
+			return 1;
+		}
+
+	if (sigsetup()) {
+		LOG(FATAL, "cannot set up signal handlers: %s\n", errstr);
+		return 1;
+	}
+
+	struct state st = {
+		.orient = { .cur = ORIENT_UNDEFINED, .cand = ORIENT_UNDEFINED },
+		.tablet = { .cur = 0, .cand = 0 },
+	};
+	if (recordpath != NULL) {
+		st.record = fopen(recordpath, "w");
+		if (st.record == NULL) {
+			LOG(FATAL, "cannot open %s: %s\n", recordpath, errstr);
+			return 1;
+		}
+		setvbuf(st.record, NULL, _IOLBF, 0);
+	}
+
+	int ret;
+	if (replaypath != NULL) {
+		statefile = NULL;
+		ret = replay(&st, replaypath);
+	} else {
+		if (useswitch) {
+			st.sw = open_switchdev();
+			if (st.sw == NULL) {
+				LOG(FATAL, "libevdev cannot create uinput device\n");
+				return 1;
+			}
+		}
+		ret = sensor_daemon(&st);
+		unlink(statefile);
+		if (st.sw != NULL)
+			libevdev_uinput_destroy(st.sw);
+	}
+
+	if (st.record != NULL)
+		fclose(st.record);
+	return ret;
+}
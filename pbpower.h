@@ -0,0 +1,236 @@
+#ifndef PB_POWER_H
+#define PB_POWER_H
+
+#include <asm/socket.h> /* SO_ATTACH_FILTER without _DEFAULT_SOURCE */
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Power supply state for the battery profiles. The supplies are read once
+ * and then again only when a kernel uevent names the power_supply
+ * subsystem, which the chargers and the battery send on plugging and as
+ * the capacity changes. Nothing is polled.
+ */
+#define PBPOWER_DIR "/sys/class/power_supply"
+#define PBPOWER_THRESHOLD 30 /* percent, the profiles' default */
+#define PBPOWER_HDRMAX 256 /* longest uevent header the socket filter parses */
+
+struct pbpower {
+	const char *dir; /* /sys/class/power_supply */
+	int fd; /* kernel uevents, -1 if the owner reads them itself */
+	int online; /* on external power, or no battery at all */
+	int capacity; /* percent, averaged over the batteries, -1 if unknown */
+};
+
+/* whether the profile for threshold percent applies, 100 for any time on battery */
+static inline int pbpower_saving(const struct pbpower *p, int threshold)
+{
+	return !p->online && p->capacity >= 0 && p->capacity <= threshold;
+}
+
+/* the first line of an attribute, nonzero if unreadable */
+static inline int pbpower_attr(const struct pbpower *p, const char *supply,
+		const char *attr, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s/%s", p->dir, supply, attr);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+	ssize_t n = read(fd, buf, size - 1);
+	close(fd);
+	if (n <= 0)
+		return 1;
+	buf[n] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+/* rereads the supplies, returns whether anything changed */
+static inline int pbpower_read(struct pbpower *p)
+{
+	int online = 0, mains = 0, discharging = 0;
+	int batteries = 0, capacity = 0;
+	DIR *d = opendir(p->dir);
+	struct dirent *e;
+	while (d != NULL && (e = readdir(d)) != NULL) {
+		char v[32];
+		if (e->d_name[0] == '.' || pbpower_attr(p, e->d_name, "type", v, sizeof(v)))
+			continue;
+		if (strcmp(v, "Battery")) {
+			/* Mains and the USB chargers */
+			if (!pbpower_attr(p, e->d_name, "online", v, sizeof(v))) {
+				mains++;
+				if (atoi(v))
+					online = 1;
+			}
+			continue;
+		}
+		if (!pbpower_attr(p, e->d_name, "present", v, sizeof(v)) && !atoi(v))
+			continue;
+		if (!pbpower_attr(p, e->d_name, "status", v, sizeof(v)) && !strcmp(v, "Discharging"))
+			discharging = 1;
+		if (!pbpower_attr(p, e->d_name, "capacity", v, sizeof(v))) {
+			capacity += atoi(v);
+			batteries++;
+		}
+	}
+	if (d != NULL)
+		closedir(d);
+	/* without a charger to ask, the battery tells */
+	if (!mains)
+		online = !discharging;
+	if (!batteries) {
+		online = 1;
+		capacity = -1;
+	} else {
+		capacity /= batteries;
+	}
+	int changed = online != p->online || capacity != p->capacity;
+	p->online = online;
+	p->capacity = capacity;
+	return changed;
+}
+
+/* whether a uevent message of n bytes is about a power supply */
+static inline int pbpower_match(const char *buf, size_t n)
+{
+	static const char key[] = "SUBSYSTEM=power_supply";
+	const char *p = buf;
+	while (p < buf + n) {
+		size_t l = strnlen(p, buf + n - p);
+		if (l == sizeof(key) - 1 && !memcmp(p, key, l))
+			return 1;
+		p += l + 1;
+	}
+	return 0;
+}
+
+static inline struct sock_filter *pbpower_insn(struct sock_filter *p,
+		uint16_t code, uint32_t k, uint8_t jt, uint8_t jf)
+{
+	p->code = code;
+	p->jt = jt;
+	p->jf = jf;
+	p->k = k;
+	return p + 1;
+}
+
+/*
+ * Keeps the kernel from waking the owner for uevents of subsystems not in
+ * the NULL terminated list. A kernel uevent starts with an "ACTION@DEVPATH"
+ * header followed by ACTION=, DEVPATH= and SUBSYSTEM= in this order, so
+ * SUBSYSTEM= is at twice the header length plus 15. Classic BPF has no
+ * loops, the search for the end of the header is unrolled. Longer headers
+ * pass, pbpower_match() still decides. Returns nonzero on errors.
+ */
+static inline int pbpower_filter(int fd, const char *const *subsystems)
+{
+	struct sock_filter prog[PBPOWER_HDRMAX * 4 + 64];
+	struct sock_filter *p = prog, *end = prog + sizeof(prog) / sizeof(prog[0]);
+	int i;
+	for (i = 0; i < PBPOWER_HDRMAX; i++) {
+		p = pbpower_insn(p, BPF_LD | BPF_B | BPF_ABS, i, 0, 0);
+		p = pbpower_insn(p, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2);
+		p = pbpower_insn(p, BPF_LDX | BPF_IMM, 2 * (i + 1) + 15, 0, 0);
+		/* to the first subsystem, past the rest and the return below */
+		p = pbpower_insn(p, BPF_JMP | BPF_JA, 4 * (PBPOWER_HDRMAX - i - 1) + 1, 0, 0);
+	}
+	p = pbpower_insn(p, BPF_RET | BPF_K, 0xffffffff, 0, 0);
+	for (; *subsystems != NULL; subsystems++) {
+		unsigned char key[64];
+		int n = snprintf((char *) key, sizeof(key), "SUBSYSTEM=%s", *subsystems) + 1;
+		if (n > (int) sizeof(key))
+			return 1;
+		/* a load and a compare per word, half word and byte, then the return */
+		int len = 2 * (n / 4 + n % 4 / 2 + n % 2) + 1;
+		if (end - p < len + 1)
+			return 1;
+		struct sock_filter *next = p + len;
+		int off = 0;
+		while (off < n) {
+			int w = n - off >= 4 ? 4 : n - off >= 2 ? 2 : 1;
+			uint32_t v = 0;
+			for (i = 0; i < w; i++)
+				v = v << 8 | key[off + i];
+			p = pbpower_insn(p, BPF_LD | BPF_IND |
+					(w == 4 ? BPF_W : w == 2 ? BPF_H : BPF_B), off, 0, 0);
+			p = pbpower_insn(p, BPF_JMP | BPF_JEQ | BPF_K, v, 0, next - p - 1);
+			off += w;
+		}
+		p = pbpower_insn(p, BPF_RET | BPF_K, 0xffffffff, 0, 0);
+	}
+	p = pbpower_insn(p, BPF_RET | BPF_K, 0, 0, 0);
+	struct sock_fprog fprog;
+	fprog.len = p - prog;
+	fprog.filter = prog;
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) != 0;
+}
+
+/* drains the uevents, rereads on power supply ones, returns whether anything changed */
+static inline int pbpower_update(struct pbpower *p)
+{
+	char buf[4096];
+	ssize_t n;
+	int seen = 0;
+	while (p->fd >= 0 && (n = read(p->fd, buf, sizeof(buf))) > 0)
+		if (pbpower_match(buf, n))
+			seen = 1;
+	return seen && pbpower_read(p);
+}
+
+/* reads the supplies without a uevent socket, for owners that have one */
+static inline void pbpower_init(struct pbpower *p, const char *dir)
+{
+	p->dir = dir;
+	p->fd = -1;
+	p->online = 1;
+	p->capacity = -1;
+	pbpower_read(p);
+}
+
+/* returns nonzero if changes cannot be watched, the state is read regardless */
+static inline int pbpower_open(struct pbpower *p, const char *dir)
+{
+	pbpower_init(p, dir);
+	p->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			NETLINK_KOBJECT_UEVENT);
+	if (p->fd < 0)
+		return 1;
+	struct sockaddr_nl nl;
+	memset(&nl, 0, sizeof(nl));
+	nl.nl_family = AF_NETLINK;
+	nl.nl_groups = 1; /* kernel uevents */
+	if (bind(p->fd, (struct sockaddr *) &nl, sizeof(nl))) {
+		close(p->fd);
+		p->fd = -1;
+		return 1;
+	}
+	/* without it, every uevent is read and matched here */
+	static const char *const subsystems[] = { "power_supply", NULL };
+	pbpower_filter(p->fd, subsystems);
+	return 0;
+}
+
+static inline int pbpower_fd(const struct pbpower *p)
+{
+	return p->fd;
+}
+
+static inline void pbpower_close(struct pbpower *p)
+{
+	if (p->fd >= 0)
+		close(p->fd);
+	p->fd = -1;
+}
+
+#endif
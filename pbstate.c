@@ -0,0 +1,157 @@
+/*
+ * Prints the state pbbacklight and pbkbd-backlight publish in /run, one
+ * "name value" pair per line like the stats files. With -w, the files are
+ * mapped once and read again every interval without system calls.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pbstate.h"
+
+static const char *const kbd_states[] = { "active", "fading", "idle", "gated" };
+
+static double age(uint64_t ns)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL + ts.tv_nsec - ns) / 1e9;
+}
+
+static void print_header(const struct pbstate_header *h)
+{
+	printf("pid %u\n"
+			"age_s %.3f\n",
+			h->pid, age(h->updated_ns));
+}
+
+static int print_backlight(const void *m)
+{
+	struct pbstate_backlight s;
+	if (pbstate_read(m, &s, sizeof(s)))
+		return 1;
+	print_header(&s.h);
+	printf("target %u\n"
+			"current %u\n"
+			"level %u\n"
+			"maxlevel %u\n"
+			"lux_filtered %.1f\n"
+			"lux_raw %d\n"
+			"monitors %u\n"
+			"frames %llu\n"
+			"panel_writes %llu\n"
+			"panel_restores %llu\n"
+			"lux_samples %llu\n"
+			"aux_retries %llu\n"
+			"aux_reopens %llu\n"
+			"aux_errors %llu\n"
+			"ceiling %u\n"
+			"capacity %d\n"
+			"lux_errors %llu\n",
+			s.target, s.current, s.level, s.maxlevel, s.lux_filtered, s.lux_raw,
+			s.monitors, (unsigned long long) s.frames,
+			(unsigned long long) s.panel_writes,
+			(unsigned long long) s.panel_restores,
+			(unsigned long long) s.lux_samples,
+			(unsigned long long) s.aux_retries,
+			(unsigned long long) s.aux_reopens,
+			(unsigned long long) s.aux_errors,
+			s.ceiling, s.capacity,
+			(unsigned long long) s.lux_errors);
+	return 0;
+}
+
+static int print_kbdbl(const void *m)
+{
+	struct pbstate_kbdbl s;
+	if (pbstate_read(m, &s, sizeof(s)))
+		return 1;
+	print_header(&s.h);
+	printf("state %s\n"
+			"lux_filtered %.1f\n"
+			"lux_raw %d\n"
+			"led %.3f\n"
+			"disabled %u\n"
+			"wakeups %llu\n"
+			"lux_reads %llu\n"
+			"led_writes %llu\n"
+			"activity %llu\n"
+			"ec_errors %llu\n"
+			"saving %u\n"
+			"capacity %d\n",
+			s.state < 4 ? kbd_states[s.state] : "unknown",
+			s.lux_filtered, s.lux_raw, s.led, s.disabled,
+			(unsigned long long) s.wakeups,
+			(unsigned long long) s.lux_reads,
+			(unsigned long long) s.led_writes,
+			(unsigned long long) s.activity,
+			(unsigned long long) s.ec_errors,
+			s.saving, s.capacity);
+	return 0;
+}
+
+struct source {
+	const char *path;
+	uint16_t kind;
+	int (*print)(const void *m);
+	const void *map;
+};
+
+int main(int argc, char **argv)
+{
+	int interval = 0;
+	struct source src[] = {
+		{ PBSTATE_BACKLIGHT, PBSTATE_KIND_BACKLIGHT, print_backlight, NULL },
+		{ PBSTATE_KBDBL, PBSTATE_KIND_KBDBL, print_kbdbl, NULL },
+	};
+	const size_t nsrc = sizeof(src) / sizeof(*src);
+	int c;
+	while ((c = getopt(argc, argv, "w:b:k:")) > 0)
+		switch (c) {
+		case 'w':
+			interval = atoi(optarg);
+			break;
+		case 'b':
+			src[0].path = optarg;
+			break;
+		case 'k':
+			src[1].path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-w ms] [-b pbbacklight state] [-k pbkbd-backlight state]\n",
+					argc == 0 ? "pbstate" : argv[0]);
+			return 1;
+		}
+
+	size_t i, found = 0;
+	for (i = 0; i < nsrc; i++) {
+		src[i].map = pbstate_map(src[i].path, src[i].kind);
+		if (src[i].map != NULL)
+			found++;
+		else if (errno != ENOENT)
+			fprintf(stderr, "%s: %s\n", src[i].path, strerror(errno));
+	}
+	if (!found) {
+		fprintf(stderr, "no daemon publishes its state\n");
+		return 1;
+	}
+	for (;;) {
+		for (i = 0; i < nsrc; i++) {
+			if (src[i].map == NULL)
+				continue;
+			printf("# %s\n", src[i].path);
+			if (src[i].print(src[i].map))
+				fprintf(stderr, "%s: no consistent snapshot\n", src[i].path);
+		}
+		if (interval <= 0)
+			return 0;
+		fflush(stdout);
+		struct timespec ts = { interval / 1000, interval % 1000 * 1000000L };
+		nanosleep(&ts, NULL);
+	}
+}
@@ -0,0 +1,205 @@
+#ifndef PB_STATE_H
+#define PB_STATE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Live state of the daemons, published in a small file under /run that
+ * readers map once and then read without system calls.
+ *
+ * Layout: a pbstate_header followed by the daemon's fields, all naturally
+ * aligned and in host byte order. Fields are only ever appended, version
+ * changes only for incompatible layouts, and size is what the writer fills
+ * in, so a reader must ignore fields beyond it.
+ *
+ * Updates are guarded by a sequence lock: the writer makes seq odd, writes
+ * the fields and makes seq even again. A reader copies the struct and keeps
+ * the copy only if seq was even and unchanged across the copy, which is
+ * what pbstate_read() does. A file left behind by a daemon that died keeps
+ * its last state, pid and updated_ns tell.
+ */
+#define PBSTATE_MAGIC 0x54534250 /* "PBST" */
+#define PBSTATE_VERSION 1
+#define PBSTATE_MAPSIZE 4096
+
+#define PBSTATE_BACKLIGHT "/run/pbbacklight.state"
+#define PBSTATE_KBDBL "/run/pbkbd-backlight.state"
+
+enum {
+	PBSTATE_KIND_BACKLIGHT = 1,
+	PBSTATE_KIND_KBDBL = 2,
+};
+
+struct pbstate_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t kind; /* PBSTATE_KIND_* */
+	uint32_t size; /* of the whole struct */
+	uint32_t seq; /* odd while being written */
+	uint64_t updated_ns; /* CLOCK_MONOTONIC */
+	uint32_t pid;
+	uint32_t reserved;
+};
+
+/* pbbacklight, brightness is 0 to 65535 as with pbbacklight -get */
+struct pbstate_backlight {
+	struct pbstate_header h;
+	uint32_t target; /* where the ramp is heading */
+	uint32_t current; /* shown now */
+	uint32_t level; /* PWM level written to the panel */
+	uint32_t maxlevel;
+	double lux_filtered; /* -1 without -auto */
+	int32_t lux_raw; /* last sample, -1 without -auto */
+	uint32_t monitors; /* mirrored over DDC/CI */
+	uint64_t frames; /* ramp steps */
+	uint64_t panel_writes;
+	uint64_t panel_restores; /* panel found reset and reprogrammed */
+	uint64_t lux_samples;
+	uint64_t aux_retries; /* transfers retried right away */
+	uint64_t aux_reopens; /* AUX device opened again */
+	uint64_t aux_errors; /* transfers given up on */
+	uint32_t ceiling; /* the battery profile's, 65535 without one */
+	int32_t capacity; /* battery percent, -1 if unknown */
+	uint64_t lux_errors; /* samples that could not be read */
+};
+
+enum {
+	PBSTATE_KBD_ACTIVE,
+	PBSTATE_KBD_FADING,
+	PBSTATE_KBD_IDLE,
+	PBSTATE_KBD_GATED, /* lid closed or tablet mode */
+};
+
+/* pbkbd-backlight */
+struct pbstate_kbdbl {
+	struct pbstate_header h;
+	uint32_t state; /* PBSTATE_KBD_* */
+	int32_t lux_raw; /* last sample */
+	double lux_filtered; /* average the curve is applied to */
+	double led; /* level set, 0 to 1, -1 for off */
+	uint32_t disabled; /* too bright for the lights */
+	uint32_t reserved;
+	uint64_t wakeups;
+	uint64_t lux_reads;
+	uint64_t led_writes;
+	uint64_t activity;
+	uint64_t ec_errors;
+	uint32_t saving; /* on the battery profile */
+	int32_t capacity; /* battery percent, -1 if unknown */
+};
+
+/*
+ * Creates path with a fresh header and maps it, the file only appears once
+ * the header is valid. Returns NULL with errno set on failure.
+ */
+static inline void *pbstate_create(const char *path, uint16_t kind, uint32_t size)
+{
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+	void *m = MAP_FAILED;
+	if (!ftruncate(fd, PBSTATE_MAPSIZE))
+		m = mmap(NULL, PBSTATE_MAPSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m != MAP_FAILED) {
+		struct pbstate_header *h = (struct pbstate_header *) m;
+		h->magic = PBSTATE_MAGIC;
+		h->version = PBSTATE_VERSION;
+		h->kind = kind;
+		h->size = size;
+		h->pid = getpid();
+	}
+	int e = errno;
+	close(fd);
+	if (m == MAP_FAILED || rename(tmp, path)) {
+		e = errno;
+		if (m != MAP_FAILED)
+			munmap(m, PBSTATE_MAPSIZE);
+		unlink(tmp);
+		errno = e;
+		return NULL;
+	}
+	return m;
+}
+
+static inline void pbstate_close(void *m, const char *path)
+{
+	if (m == NULL)
+		return;
+	munmap(m, PBSTATE_MAPSIZE);
+	unlink(path);
+}
+
+static inline void pbstate_begin(struct pbstate_header *h)
+{
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void pbstate_end(struct pbstate_header *h)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	h->updated_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Maps a state file read only, NULL with errno set if it is missing or not
+ * of the expected kind and version.
+ */
+static inline const void *pbstate_map(const char *path, uint16_t kind)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void *m = MAP_FAILED;
+	if (!fstat(fd, &st) && st.st_size >= PBSTATE_MAPSIZE)
+		m = mmap(NULL, PBSTATE_MAPSIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		errno = EINVAL;
+		return NULL;
+	}
+	const struct pbstate_header *h = (const struct pbstate_header *) m;
+	if (h->magic != PBSTATE_MAGIC || h->version != PBSTATE_VERSION || h->kind != kind) {
+		munmap(m, PBSTATE_MAPSIZE);
+		errno = EINVAL;
+		return NULL;
+	}
+	return m;
+}
+
+/*
+ * Copies a consistent snapshot of up to size bytes, the part the writer
+ * does not fill in is zeroed. Returns nonzero if the writer kept it busy.
+ */
+static inline int pbstate_read(const void *m, void *copy, uint32_t size)
+{
+	const struct pbstate_header *h = (const struct pbstate_header *) m;
+	int tries;
+	for (tries = 0; tries < 1000; tries++) {
+		uint32_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		uint32_t n = h->size < size ? h->size : size;
+		memcpy(copy, m, n);
+		memset((char *) copy + n, 0, size - n);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return 1;
+}
+
+#endif
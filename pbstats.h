@@ -0,0 +1,116 @@
+#ifndef PB_STATS_H
+#define PB_STATS_H
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Self-accounting for power work: named event counters plus getrusage().
+ * The dump is one "name value" pair per line for scripts, the summary is a
+ * single log line of deltas since the previous summary.
+ */
+struct pbstats {
+	const char *const *names;
+	unsigned long long *count;
+	unsigned long long *last; /* at the previous summary */
+	size_t n;
+	long long start; /* monotonic ms */
+	long long lastsummary;
+	struct rusage lastru;
+	void (*extra)(FILE *f); /* appends more lines to the dump */
+};
+
+static inline long long pbstats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static inline long long pbstats_us(struct timeval tv)
+{
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static inline void pbstats_init(struct pbstats *s, const char *const *names,
+		unsigned long long *count, unsigned long long *last, size_t n)
+{
+	s->names = names;
+	s->count = count;
+	s->last = last;
+	s->n = n;
+	s->start = pbstats_now();
+	s->lastsummary = s->start;
+	s->extra = NULL;
+	getrusage(RUSAGE_SELF, &s->lastru);
+}
+
+static inline void pbstats_dump(const struct pbstats *s, FILE *f)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	size_t i;
+	for (i = 0; i < s->n; i++)
+		fprintf(f, "%s %llu\n", s->names[i], s->count[i]);
+	fprintf(f, "uptime_ms %lld\n"
+			"utime_us %lld\n"
+			"stime_us %lld\n"
+			"maxrss_kb %ld\n"
+			"minflt %ld\n"
+			"majflt %ld\n"
+			"inblock %ld\n"
+			"oublock %ld\n"
+			"nvcsw %ld\n"
+			"nivcsw %ld\n",
+			pbstats_now() - s->start,
+			pbstats_us(ru.ru_utime), pbstats_us(ru.ru_stime),
+			ru.ru_maxrss, ru.ru_minflt, ru.ru_majflt,
+			ru.ru_inblock, ru.ru_oublock, ru.ru_nvcsw, ru.ru_nivcsw);
+	if (s->extra != NULL)
+		s->extra(f);
+}
+
+/* replaces path atomically, returns nonzero on errors */
+static inline int pbstats_write(const struct pbstats *s, const char *path)
+{
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL)
+		return 1;
+	pbstats_dump(s, f);
+	if (fclose(f) || rename(tmp, path)) {
+		unlink(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+static inline int pbstats_due(const struct pbstats *s, long long period)
+{
+	return pbstats_now() - s->lastsummary >= period;
+}
+
+static inline void pbstats_summary(struct pbstats *s, FILE *f)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	long long now = pbstats_now();
+	fprintf(f, "stats %llds:", (now - s->lastsummary) / 1000);
+	size_t i;
+	for (i = 0; i < s->n; i++) {
+		if (s->count[i] != s->last[i])
+			fprintf(f, " %s=%llu", s->names[i], s->count[i] - s->last[i]);
+		s->last[i] = s->count[i];
+	}
+	fprintf(f, " utime_us=%lld stime_us=%lld nvcsw=%ld nivcsw=%ld\n",
+			pbstats_us(ru.ru_utime) - pbstats_us(s->lastru.ru_utime),
+			pbstats_us(ru.ru_stime) - pbstats_us(s->lastru.ru_stime),
+			ru.ru_nvcsw - s->lastru.ru_nvcsw, ru.ru_nivcsw - s->lastru.ru_nivcsw);
+	s->lastru = ru;
+	s->lastsummary = now;
+}
+
+#endif
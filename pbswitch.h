@@ -0,0 +1,202 @@
+#ifndef PB_SWITCH_H
+#define PB_SWITCH_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/input.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+/*
+ * Lid and tablet mode switches. Every evdev device reporting SW_LID or
+ * SW_TABLET_MODE is read behind one epoll descriptor, devices created later
+ * such as pborient's switch are picked up through inotify. The keyboard is
+ * unusable while either switch is on.
+ */
+#define PBSWITCH_MAX 8
+
+struct pbswitch {
+	const char *dir; /* /dev/input */
+	const char *sysdir; /* /sys/class/input, to skip devices without switches */
+	int ep;
+	int watch;
+	int fd[PBSWITCH_MAX];
+	char name[PBSWITCH_MAX][NAME_MAX + 1];
+	int lid; /* closed */
+	int tablet;
+};
+
+#define PBSWITCH_BIT(b, n) ((b)[(n) / 8] & (1 << ((n) % 8)))
+
+static inline int pbswitch_gated(const struct pbswitch *s)
+{
+	return s->lid || s->tablet;
+}
+
+/* whether sysfs rules the device out, unknown counts as a candidate */
+static inline int pbswitch_skip(const struct pbswitch *s, const char *name)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s/device/capabilities/sw", s->sysdir, name);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	/* space separated words, the lowest one last */
+	char buf[256];
+	char *last = NULL;
+	if (fgets(buf, sizeof(buf), f) != NULL) {
+		last = strrchr(buf, ' ');
+		last = last == NULL ? buf : last + 1;
+	}
+	fclose(f);
+	if (last == NULL)
+		return 0;
+	unsigned long sw = strtoul(last, NULL, 16);
+	return !(sw & ((1UL << SW_LID) | (1UL << SW_TABLET_MODE)));
+}
+
+static inline void pbswitch_add(struct pbswitch *s, const char *name)
+{
+	if (strncmp(name, "event", 5))
+		return;
+	int i, slot = -1;
+	for (i = 0; i < PBSWITCH_MAX; i++) {
+		if (s->fd[i] >= 0 && !strcmp(s->name[i], name))
+			return;
+		if (s->fd[i] < 0 && slot < 0)
+			slot = i;
+	}
+	if (slot < 0 || pbswitch_skip(s, name))
+		return;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", s->dir, name);
+	int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	uint8_t bits[SW_MAX / 8 + 1];
+	memset(bits, 0, sizeof(bits));
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (ioctl(fd, EVIOCGBIT(EV_SW, sizeof(bits)), bits) < 0 ||
+			!(PBSWITCH_BIT(bits, SW_LID) || PBSWITCH_BIT(bits, SW_TABLET_MODE)) ||
+			epoll_ctl(s->ep, EPOLL_CTL_ADD, fd, &ev)) {
+		close(fd);
+		return;
+	}
+	s->fd[slot] = fd;
+	snprintf(s->name[slot], sizeof(s->name[slot]), "%s", name);
+}
+
+static inline void pbswitch_drop(struct pbswitch *s, int i)
+{
+	epoll_ctl(s->ep, EPOLL_CTL_DEL, s->fd[i], NULL);
+	close(s->fd[i]);
+	s->fd[i] = -1;
+}
+
+/* drains pending events and rereads the switches, returns whether gating changed */
+static inline int pbswitch_update(struct pbswitch *s)
+{
+	int before = pbswitch_gated(s);
+	char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t r;
+	while (s->watch >= 0 && (r = read(s->watch, buf, sizeof(buf))) > 0) {
+		char *p = buf;
+		while (p < buf + r) {
+			struct inotify_event *ev = (struct inotify_event *) p;
+			if (ev->len)
+				pbswitch_add(s, ev->name);
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+	s->lid = 0;
+	s->tablet = 0;
+	int i;
+	for (i = 0; i < PBSWITCH_MAX; i++) {
+		if (s->fd[i] < 0)
+			continue;
+		struct input_event ev[16];
+		while ((r = read(s->fd[i], ev, sizeof(ev))) > 0)
+			;
+		if (r < 0 && errno != EAGAIN) {
+			pbswitch_drop(s, i);
+			continue;
+		}
+		/* the state, not the events, so dropped events do no harm */
+		uint8_t st[SW_MAX / 8 + 1];
+		memset(st, 0, sizeof(st));
+		if (ioctl(s->fd[i], EVIOCGSW(sizeof(st)), st) < 0)
+			continue;
+		if (PBSWITCH_BIT(st, SW_LID))
+			s->lid = 1;
+		if (PBSWITCH_BIT(st, SW_TABLET_MODE))
+			s->tablet = 1;
+	}
+	return pbswitch_gated(s) != before;
+}
+
+/* returns nonzero if the switches cannot be watched */
+static inline int pbswitch_open(struct pbswitch *s, const char *dir, const char *sysdir)
+{
+	memset(s, 0, sizeof(*s));
+	s->dir = dir;
+	s->sysdir = sysdir;
+	s->watch = -1;
+	int i;
+	for (i = 0; i < PBSWITCH_MAX; i++)
+		s->fd[i] = -1;
+	s->ep = epoll_create1(EPOLL_CLOEXEC);
+	if (s->ep < 0)
+		return 1;
+	/* IN_ATTRIB as udev fixes the permissions after creating the node */
+	s->watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = s->watch;
+	if (s->watch >= 0 && (inotify_add_watch(s->watch, dir, IN_CREATE | IN_ATTRIB) < 0 ||
+				epoll_ctl(s->ep, EPOLL_CTL_ADD, s->watch, &ev))) {
+		close(s->watch);
+		s->watch = -1;
+	}
+	DIR *d = opendir(dir);
+	if (d != NULL) {
+		struct dirent *e;
+		while ((e = readdir(d)) != NULL)
+			pbswitch_add(s, e->d_name);
+		closedir(d);
+	}
+	pbswitch_update(s);
+	return 0;
+}
+
+static inline int pbswitch_fd(const struct pbswitch *s)
+{
+	return s->ep;
+}
+
+static inline void pbswitch_close(struct pbswitch *s)
+{
+	int i;
+	for (i = 0; i < PBSWITCH_MAX; i++)
+		if (s->fd[i] >= 0)
+			close(s->fd[i]);
+	if (s->watch >= 0)
+		close(s->watch);
+	if (s->ep >= 0)
+		close(s->ep);
+	s->ep = -1;
+}
+
+#endif
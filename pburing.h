@@ -0,0 +1,186 @@
+#ifndef PB_URING_H
+#define PB_URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Just enough io_uring for pbkbd, through the raw system calls so there is
+ * no liburing dependency. Single threaded: entries are queued with
+ * pburing_sqe() and go to the kernel with the next pburing_enter().
+ */
+struct pburing {
+	int fd;
+	unsigned features;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqmap, *cqmap;
+	size_t sqmapsz, cqmapsz, sqesz;
+	unsigned queued; /* not yet submitted */
+};
+
+static inline int pburing_syscall_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int pburing_syscall_enter(int fd, unsigned submit, unsigned wait,
+		unsigned flags, const void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static inline void pburing_exit(struct pburing *r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqesz);
+	if (r->cqmap != NULL && r->cqmap != MAP_FAILED && r->cqmap != r->sqmap)
+		munmap(r->cqmap, r->cqmapsz);
+	if (r->sqmap != NULL && r->sqmap != MAP_FAILED)
+		munmap(r->sqmap, r->sqmapsz);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->fd = -1;
+}
+
+/* returns nonzero with errno set if io_uring or a required feature is missing */
+static inline int pburing_init(struct pburing *r, unsigned entries, unsigned required)
+{
+	memset(r, 0, sizeof(*r));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = pburing_syscall_setup(entries, &p);
+	if (r->fd < 0)
+		return 1;
+	r->features = p.features;
+	if ((p.features & required) != required) {
+		pburing_exit(r);
+		errno = ENOTSUP;
+		return 1;
+	}
+
+	r->sqmapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqmapsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cqmapsz > r->sqmapsz)
+			r->sqmapsz = r->cqmapsz;
+		r->cqmapsz = r->sqmapsz;
+	}
+	r->sqmap = mmap(NULL, r->sqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQ_RING);
+	if (r->sqmap == MAP_FAILED)
+		goto fail;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cqmap = r->sqmap;
+	else
+		r->cqmap = mmap(NULL, r->cqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				r->fd, IORING_OFF_CQ_RING);
+	if (r->cqmap == MAP_FAILED)
+		goto fail;
+	r->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqesz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto fail;
+
+	char *sq = r->sqmap, *cq = r->cqmap;
+	r->sq_head = (unsigned *) (sq + p.sq_off.head);
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 0;
+
+fail:;
+	int e = errno;
+	pburing_exit(r);
+	errno = e;
+	return 1;
+}
+
+/* whether the kernel knows opcode, asks the kernel once per call */
+static inline int pburing_supported(struct pburing *r, int op)
+{
+	struct {
+		struct io_uring_probe p;
+		struct io_uring_probe_op ops[IORING_OP_LAST];
+	} probe;
+	memset(&probe, 0, sizeof(probe));
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, &probe, IORING_OP_LAST) < 0)
+		return 0;
+	return op <= probe.p.last_op && (probe.ops[op].flags & IO_URING_OP_SUPPORTED);
+}
+
+static inline int pburing_register_files(struct pburing *r, const int *fds, unsigned n)
+{
+	return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds, n);
+}
+
+/* a cleared entry, NULL if the queue is full */
+static inline struct io_uring_sqe *pburing_sqe(struct pburing *r)
+{
+	unsigned tail = *r->sq_tail;
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > *r->sq_mask)
+		return NULL;
+	unsigned i = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[i];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[i] = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+	return sqe;
+}
+
+/*
+ * Submits everything queued and waits for at least wait completions, for up
+ * to timeout ms unless it is negative. Returns -1 with errno set, ETIME on
+ * timeout and EINTR on signals.
+ */
+static inline int pburing_enter(struct pburing *r, unsigned wait, int timeout)
+{
+	unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	const void *argp = NULL;
+	size_t argsz = 0;
+	if (wait && timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000LL;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uintptr_t) &ts;
+		argp = &arg;
+		argsz = sizeof(arg);
+		flags |= IORING_ENTER_EXT_ARG;
+	}
+	int n = pburing_syscall_enter(r->fd, r->queued, wait, flags, argp, argsz);
+	if (n > 0)
+		r->queued -= (unsigned) n < r->queued ? (unsigned) n : r->queued;
+	return n < 0 ? -1 : n;
+}
+
+/* the oldest completion, NULL if there is none */
+static inline struct io_uring_cqe *pburing_cqe(struct pburing *r)
+{
+	unsigned head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+static inline void pburing_cqe_seen(struct pburing *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
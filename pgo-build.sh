@@ -0,0 +1,23 @@
+#!/bin/sh
+# Builds an LTO and PGO optimized tree trained on the bundled workloads, and
+# compares the workloads against a plain optimized build.
+# usage: pgo-build.sh [build directory]
+set -e
+
+src=$(cd "$(dirname "$0")" && pwd)
+out=${1:-"$src/_pgo"}
+
+cmake -S "$src" -B "$out/base" -DCMAKE_BUILD_TYPE=Release
+cmake --build "$out/base"
+
+cmake -S "$src" -B "$out/pgo" -DCMAKE_BUILD_TYPE=Release -DENABLE_LTO=ON -DPGO=GENERATE
+cmake --build "$out/pgo"
+find "$out/pgo" -name '*.gcda' -delete
+cmake --build "$out/pgo" --target workloads
+cmake -S "$src" -B "$out/pgo" -DPGO=USE
+cmake --build "$out/pgo"
+
+echo "== plain Release"
+cmake --build "$out/base" --target workloads
+echo "== LTO + PGO"
+cmake --build "$out/pgo" --target workloads
@@ -0,0 +1,342 @@
+/*
+ * pbkbd, pbkbd-backlight and pbbacklight as modules of one process on a
+ * single epoll loop. Keyboard activity reaches the keyboard backlight as a
+ * function call, and all timed work shares one timerfd.
+ */
+#include "pbbacklight.cpp"
+#include "pbmodules.h"
+#include "pbpower.h"
+#include "pbswitch.h"
+
+#include <csignal>
+#include <ctime>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+enum {
+	SRC_SIGNAL,
+	SRC_TIMER,
+	SRC_KBD,
+	SRC_KBDBL_CONFIG,
+	SRC_BACKLIGHT,
+	SRC_SWITCH,
+	SRC_POWER,
+};
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void epoll_add(int ep, int fd, uint32_t src)
+{
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u32 = src;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev))
+		throw std::system_error(errno, std::generic_category());
+}
+
+static long long earliest(long long a, long long b)
+{
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+	return a < b ? a : b;
+}
+
+static void arm_timer(int tfd, long long deadline)
+{
+	itimerspec its = {};
+	if (deadline >= 0) {
+		its.it_value.tv_sec = deadline / 1000;
+		its.it_value.tv_nsec = deadline % 1000 * 1000000;
+		/* zero disarms, deadlines in the past fire at once */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr))
+		throw std::system_error(errno, std::generic_category());
+}
+
+static BLProxy *keyproxy;
+
+/* brightness keys as a function call, -b */
+static int brightness_step(int steps)
+{
+	keyproxy->keystep(steps);
+	return 0;
+}
+
+static void print_help(const char *progname)
+{
+	cout << "usage: " << progname << " [-vqadeb] [-c config] [-t ms] [-p ceiling[,threshold]] [-K] [-L] [-B] [/path/to/sys/class/backlight/xxx]" << endl
+		<< "Pixelbook keyboard, keyboard backlight and backlight drivers in one process." << endl
+		<< "Options:" << endl
+		<< "  -v  increase keyboard driver verbosity" << endl
+		<< "  -q  decrease keyboard driver verbosity" << endl
+		<< "  -a  automatic screen brightness, as pbbacklight -auto" << endl
+		<< "  -d  external monitor brightness over DDC/CI, as pbbacklight -ddc" << endl
+		<< "  -c  keyboard backlight config file" << endl
+		<< "  -e  keyboard backlight through /dev/cros_ec, as pbkbd-backlight -e" << endl
+		<< "  -t  Search key hold timeout in ms, as pbkbd -t" << endl
+		<< "  -b  brightness keys straight to the backlight driver, as pbkbd -b" << endl
+		<< "  -p  battery brightness ceiling, as pbbacklight -battery" << endl
+		<< "  -K  disable keyboard driver" << endl
+		<< "  -L  disable keyboard backlight driver" << endl
+		<< "  -B  disable backlight driver" << endl;
+}
+
+int main(int argc, char **argv)
+{
+	int verbose = 0;
+	bool autobri = false, ddc = false, ec = false, keys = false;
+	const char *config = nullptr;
+	int hold_timeout = -1;
+	double ceiling = -1;
+	int threshold = PBPOWER_THRESHOLD;
+	bool kbd = true, kbdbl = true, backlight = true;
+	int c;
+	while ((c = getopt(argc, argv, "vqadc:et:bp:KLB")) > 0)
+		switch (c) {
+		case 'v':
+			verbose++;
+			break;
+		case 'q':
+			verbose--;
+			break;
+		case 'a':
+			autobri = true;
+			break;
+		case 'd':
+			ddc = true;
+			break;
+		case 'c':
+			config = optarg;
+			break;
+		case 'e':
+			ec = true;
+			break;
+		case 't':
+			hold_timeout = atoi(optarg);
+			break;
+		case 'b':
+			keys = true;
+			break;
+		case 'p':
+			if (!parse_battery(optarg, ceiling, threshold)) {
+				print_help(argv[0]);
+				return 1;
+			}
+			break;
+		case 'K':
+			kbd = false;
+			break;
+		case 'L':
+			kbdbl = false;
+			break;
+		case 'B':
+			backlight = false;
+			break;
+		default:
+			print_help(argc == 0 ? "pixelbookd" : argv[0]);
+			return 1;
+		}
+
+	int ret = 0;
+	try {
+		int ep = epoll_create1(EPOLL_CLOEXEC);
+		if (ep < 0)
+			throw std::system_error(errno, std::generic_category());
+		int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (tfd < 0)
+			throw std::system_error(errno, std::generic_category());
+		epoll_add(ep, tfd, SRC_TIMER);
+
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGHUP);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		sigprocmask(SIG_BLOCK, &mask, nullptr);
+		int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (sfd < 0)
+			throw std::system_error(errno, std::generic_category());
+		epoll_add(ep, sfd, SRC_SIGNAL);
+
+		if (kbdbl && ec)
+			kbdbl_module_use_ec();
+		if (kbdbl && kbdbl_module_start(config)) {
+			cerr << "keyboard backlight unavailable" << endl;
+			kbdbl = false;
+		}
+		if (kbdbl && kbdbl_module_fd() >= 0)
+			epoll_add(ep, kbdbl_module_fd(), SRC_KBDBL_CONFIG);
+
+		if (kbd && hold_timeout >= 0)
+			pbkbd_module_set_hold_timeout(hold_timeout);
+		if (kbd && pbkbd_module_start(verbose)) {
+			cerr << "keyboard unavailable" << endl;
+			kbd = false;
+		}
+		if (kbd) {
+			if (kbdbl)
+				pbkbd_module_set_activity(kbdbl_module_activity);
+			epoll_add(ep, pbkbd_module_fd(), SRC_KBD);
+		}
+
+		/* lid closed or tablet mode, the keyboard and its lights are unused */
+		pbswitch sw;
+		bool switches = (kbd || kbdbl) && !pbswitch_open(&sw, "/dev/input", "/sys/class/input");
+		auto gate = [&](bool gated) {
+			if (kbdbl)
+				kbdbl_module_gate(gated);
+			if (kbd) {
+				pbkbd_module_park(gated);
+				if (gated)
+					epoll_ctl(ep, EPOLL_CTL_DEL, pbkbd_module_fd(), nullptr);
+				else
+					epoll_add(ep, pbkbd_module_fd(), SRC_KBD);
+			}
+		};
+		if (switches) {
+			epoll_add(ep, pbswitch_fd(&sw), SRC_SWITCH);
+			if (pbswitch_gated(&sw))
+				gate(true);
+		}
+
+		std::optional<BLProxy> proxy;
+		long long bldeadline = -1;
+		if (backlight) {
+			proxy.emplace();
+			if (optind < argc) {
+				for (int i = optind; i < argc; i++)
+					proxy->add(argv[i]);
+			} else {
+				for (auto v: SysBacklight::enumerate())
+					proxy->add(v);
+			}
+			if (autobri)
+				proxy->enable_auto();
+			if (ddc)
+				proxy->enable_ddc();
+			if (ceiling >= 0)
+				proxy->enable_battery(ceiling, threshold);
+			proxy->listen_control(PBBL_SOCKET);
+			proxy->publish_state(PBSTATE_BACKLIGHT);
+			proxy->start();
+			bldeadline = now_ms();
+			epoll_add(ep, proxy->ep, SRC_BACKLIGHT);
+		}
+		/* supply changes come off the backlight's uevent socket, or one of their own */
+		pbpower power;
+		bool supplies = kbdbl && !backlight;
+		if (kbdbl && backlight) {
+			if (proxy->uevent < 0)
+				cerr << "cannot watch power supplies" << endl;
+			proxy->follow_power(kbdbl_module_power);
+		} else if (supplies) {
+			if (pbpower_open(&power, PBPOWER_DIR))
+				cerr << "cannot watch power supplies" << endl;
+			kbdbl_module_power(power.online, power.capacity);
+			if (pbpower_fd(&power) >= 0)
+				epoll_add(ep, pbpower_fd(&power), SRC_POWER);
+		}
+
+		if (kbd && backlight && keys) {
+			keyproxy = &*proxy;
+			pbkbd_module_set_brightness(brightness_step);
+		}
+
+		if (!kbd && !kbdbl && !backlight)
+			throw std::runtime_error("nothing to drive");
+
+		sdwatchdog wd;
+		sdwatchdog_init(&wd);
+		sd_notify_send("READY=1");
+
+		long long armed = -1;
+		bool stop = false;
+		while (!stop) {
+			long long now = now_ms();
+			if (kbdbl)
+				kbdbl_module_dispatch(now);
+			if (kbd)
+				pbkbd_module_timer(now);
+			if (bldeadline >= 0 && bldeadline <= now)
+				bldeadline = now + proxy->tick();
+
+			long long next = earliest(bldeadline, kbdbl ? kbdbl_module_deadline() : -1);
+			next = earliest(next, kbd ? pbkbd_module_deadline() : -1);
+			long long wdleft = sdwatchdog_ping(&wd);
+			next = earliest(next, wdleft < 0 ? -1 : now + wdleft);
+			if (next != armed) {
+				arm_timer(tfd, next);
+				armed = next;
+			}
+
+			epoll_event evs[8];
+			int n = epoll_wait(ep, evs, 8, -1);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				throw std::system_error(errno, std::generic_category());
+			}
+			for (int i = 0; i < n; i++) {
+				switch (evs[i].data.u32) {
+				case SRC_SIGNAL: {
+					signalfd_siginfo si;
+					while (read(sfd, &si, sizeof(si)) == sizeof(si))
+						stop = true;
+					break;
+				}
+				case SRC_TIMER: {
+					uint64_t expirations;
+					if (read(tfd, &expirations, sizeof(expirations)) > 0)
+						armed = -1;
+					break;
+				}
+				case SRC_KBD:
+					pbkbd_module_dispatch();
+					break;
+				case SRC_KBDBL_CONFIG:
+					kbdbl_module_config_event();
+					break;
+				case SRC_BACKLIGHT:
+					proxy->dispatch();
+					bldeadline = now_ms();
+					break;
+				case SRC_SWITCH:
+					if (pbswitch_update(&sw))
+						gate(pbswitch_gated(&sw));
+					break;
+				case SRC_POWER:
+					if (pbpower_update(&power))
+						kbdbl_module_power(power.online, power.capacity);
+					break;
+				}
+			}
+		}
+
+		if (switches)
+			pbswitch_close(&sw);
+		if (supplies)
+			pbpower_close(&power);
+		if (kbd)
+			pbkbd_module_stop();
+		if (kbdbl)
+			kbdbl_module_stop();
+		close(sfd);
+		close(tfd);
+		close(ep);
+	} catch (std::exception &e) {
+		cerr << "fatal error: " << e.what() << endl;
+		ret = 1;
+	}
+
+	return ret;
+}
@@ -0,0 +1,141 @@
+#ifndef PB_SDNOTIFY_H
+#define PB_SDNOTIFY_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SD_LISTEN_FDS_START 3
+#define SD_NOTIFY_FDS_MAX 8
+
+/*
+ * The systemd notification protocol without libsystemd: one datagram per
+ * message to $NOTIFY_SOCKET, with n fds attached for FDSTORE=1. Everything
+ * is a no-op when not started by systemd.
+ */
+static inline int sd_notify_fds(const char *msg, const int *fds, int n)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (path == NULL || (path[0] != '/' && path[0] != '@'))
+		return 0;
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t len = strlen(path);
+	if (len >= sizeof(addr.sun_path) || n < 0 || n > SD_NOTIFY_FDS_MAX)
+		return -1;
+	memcpy(addr.sun_path, path, len);
+	if (path[0] == '@') /* abstract namespace */
+		addr.sun_path[0] = 0;
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	struct iovec iov = { (void *) msg, strlen(msg) };
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name = &addr;
+	mh.msg_namelen = offsetof(struct sockaddr_un, sun_path) + len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * SD_NOTIFY_FDS_MAX)];
+		struct cmsghdr align;
+	} control;
+	if (n > 0) {
+		mh.msg_control = control.buf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+		struct cmsghdr *c = CMSG_FIRSTHDR(&mh);
+		c->cmsg_level = SOL_SOCKET;
+		c->cmsg_type = SCM_RIGHTS;
+		c->cmsg_len = CMSG_LEN(sizeof(int) * n);
+		memcpy(CMSG_DATA(c), fds, sizeof(int) * n);
+	}
+	ssize_t r = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	close(fd);
+	return r < 0 ? -1 : 0;
+}
+
+static inline int sd_notify_send(const char *msg)
+{
+	return sd_notify_fds(msg, NULL, 0);
+}
+
+/*
+ * The fd systemd passed as name, from the fd store or a socket unit, -1 if
+ * there is none. Passed fds start at 3 in the order of $LISTEN_FDNAMES.
+ */
+static inline int sd_listen_fd(const char *name)
+{
+	const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS");
+	const char *names = getenv("LISTEN_FDNAMES");
+	if (pid == NULL || fds == NULL || names == NULL || atol(pid) != (long) getpid())
+		return -1;
+	int n = atoi(fds), i;
+	size_t len = strlen(name);
+	for (i = 0; i < n; i++) {
+		size_t l = strcspn(names, ":");
+		if (l == len && !memcmp(names, name, len))
+			return SD_LISTEN_FDS_START + i;
+		if (names[l] == 0)
+			break;
+		names += l + 1;
+	}
+	return -1;
+}
+
+/* pings at half of WatchdogSec= from the main loop */
+struct sdwatchdog {
+	long long period; /* ms, -1 if disabled */
+	long long next;
+};
+
+static inline long long sdwatchdog_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static inline void sdwatchdog_init(struct sdwatchdog *w)
+{
+	w->period = -1;
+	w->next = -1;
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid = getenv("WATCHDOG_PID");
+	if (usec == NULL || (pid != NULL && atol(pid) != (long) getpid()))
+		return;
+	long long us = strtoll(usec, NULL, 10);
+	if (us <= 0)
+		return;
+	w->period = us / 2000 > 0 ? us / 2000 : 1;
+	w->next = sdwatchdog_now();
+}
+
+/* pings if due, returns ms until the next ping or -1 if disabled */
+static inline long long sdwatchdog_ping(struct sdwatchdog *w)
+{
+	if (w->period < 0)
+		return -1;
+	long long now = sdwatchdog_now();
+	if (now >= w->next) {
+		sd_notify_send("WATCHDOG=1");
+		w->next = now + w->period;
+	}
+	return w->next - now;
+}
+
+/* pings if due and shortens a poll timeout to the next ping */
+static inline int sdwatchdog_timeout(struct sdwatchdog *w, int ms)
+{
+	long long left = sdwatchdog_ping(w);
+	if (left >= 0 && (ms < 0 || left < ms))
+		return left;
+	return ms;
+}
+
+#endif
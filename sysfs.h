@@ -0,0 +1,77 @@
+#ifndef PB_SYSFS_H
+#define PB_SYSFS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * A sysfs attribute kept open between accesses. Attributes are re-read and
+ * rewritten at offset 0, so every access is a single pread or pwrite. The
+ * file is reopened once if the cached descriptor went stale.
+ */
+struct sysattr {
+	int dir; /* borrowed */
+	const char *name;
+	int flags;
+	int fd;
+};
+
+static inline void sysattr_init(struct sysattr *a, int dir, const char *name, int flags)
+{
+	a->dir = dir;
+	a->name = name;
+	a->flags = flags;
+	a->fd = -1;
+}
+
+static inline void sysattr_close(struct sysattr *a)
+{
+	if (a->fd >= 0)
+		close(a->fd);
+	a->fd = -1;
+}
+
+static inline int sysattr_open(struct sysattr *a)
+{
+	if (a->fd < 0)
+		a->fd = openat(a->dir, a->name, a->flags | O_CLOEXEC);
+	return a->fd;
+}
+
+/* returns -1 on errors */
+static inline long long sysattr_read(struct sysattr *a)
+{
+	int retry;
+	for (retry = 0; retry < 2; retry++) {
+		if (sysattr_open(a) < 0)
+			return -1;
+		char buf[32];
+		ssize_t s = pread(a->fd, buf, sizeof(buf) - 1, 0);
+		if (s > 0) {
+			buf[s] = 0;
+			return strtoll(buf, NULL, 0);
+		}
+		sysattr_close(a);
+	}
+	return -1;
+}
+
+static inline int sysattr_write(struct sysattr *a, long long v)
+{
+	char buf[32];
+	int l = snprintf(buf, sizeof(buf), "%lld", v);
+	int retry;
+	for (retry = 0; retry < 2; retry++) {
+		if (sysattr_open(a) < 0)
+			return -1;
+		if (pwrite(a->fd, buf, l, 0) == l)
+			return 0;
+		sysattr_close(a);
+	}
+	return -1;
+}
+
+#endif